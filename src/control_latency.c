@@ -0,0 +1,221 @@
+/* control_latency.c - Round trip times of the Unix socket control vs. SOAP
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+// Measures how long a position query takes through --control-socket and
+// through the SOAP control URL of a running gmediarender. Not installed;
+// build with "make control-latency".
+//
+//   control-latency <control-socket> <host> <upnp-port> [count]
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "unix_control.h"
+
+#define TRANSPORT_CONTROL_URL "/upnp/control/rendertransport1"
+#define TRANSPORT_TYPE "urn:schemas-upnp-org:service:AVTransport:1"
+
+static const char kPositionInfoRequest[] =
+	"<?xml version=\"1.0\"?>"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body><u:GetPositionInfo xmlns:u=\"" TRANSPORT_TYPE "\">"
+	"<InstanceID>0</InstanceID>"
+	"</u:GetPositionInfo></s:Body></s:Envelope>";
+
+static int64_t now_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+	const char *p = (const char*) buf;
+	while (len > 0) {
+		const ssize_t w = write(fd, p, len);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+	char *p = (char*) buf;
+	while (len > 0) {
+		const ssize_t r = read(fd, p, len);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+// One GET_POSITION over an open control connection. Returns the status.
+static int unix_get_position(int fd) {
+	const unsigned char request[5] = { 0, 0, 0, 1,
+					   UNIX_CONTROL_GET_POSITION };
+	unsigned char response[4 + 2 + 8];
+	if (write_all(fd, request, sizeof(request)) != 0
+	    || read_all(fd, response, 4) != 0)
+		return -1;
+	const uint32_t len = ((uint32_t) response[0] << 24
+			      | response[1] << 16 | response[2] << 8
+			      | response[3]);
+	if (len < 2 || len > sizeof(response) - 4
+	    || read_all(fd, response + 4, len) != 0)
+		return -1;
+	return response[4] << 8 | response[5];
+}
+
+static int connect_unix(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr*) &addr,
+			       sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// One GetPositionInfo as a controller sends it: a new connection, the SOAP
+// request, the whole response. Returns the HTTP status.
+static int soap_get_position(const struct addrinfo *ai, const char *host,
+			     const char *port) {
+	const int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+		close(fd);
+		return -1;
+	}
+	char request[2048];
+	const int len = snprintf(request, sizeof(request),
+		"POST " TRANSPORT_CONTROL_URL " HTTP/1.1\r\n"
+		"Host: %s:%s\r\n"
+		"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+		"SOAPACTION: \"" TRANSPORT_TYPE "#GetPositionInfo\"\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n%s", host, port, strlen(kPositionInfoRequest),
+		kPositionInfoRequest);
+	int status = -1;
+	if (write_all(fd, request, len) == 0) {
+		char response[8192];
+		size_t total = 0;
+		ssize_t r;
+		while ((r = read(fd, response + total,
+				 sizeof(response) - 1 - total)) > 0) {
+			total += r;
+			if (total == sizeof(response) - 1)
+				total = 0;  // only the status line matters.
+		}
+		response[total] = '\0';
+		const char *code = strchr(response, ' ');
+		status = code ? atoi(code + 1) : -1;
+	}
+	close(fd);
+	return status;
+}
+
+static int compare_int64(const void *a, const void *b) {
+	const int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static void report(const char *name, int64_t *usec, int count) {
+	qsort(usec, count, sizeof(*usec), compare_int64);
+	printf("%-12s min %6lld  median %6lld  p99 %6lld  max %6lld usec\n",
+	       name, (long long) usec[0], (long long) usec[count / 2],
+	       (long long) usec[count * 99 / 100], (long long) usec[count - 1]);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <control-socket> <host> "
+			"<upnp-port> [count]\n", argv[0]);
+		return 1;
+	}
+	const int count = argc > 4 ? atoi(argv[4]) : 1000;
+	if (count <= 0)
+		return 1;
+	int64_t *usec = (int64_t*) malloc(count * sizeof(*usec));
+
+	const int fd = connect_unix(argv[1]);
+	if (fd < 0) {
+		fprintf(stderr, "Can't connect to %s: %s\n", argv[1],
+			strerror(errno));
+		return 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		const int64_t start = now_usec();
+		if (unix_get_position(fd) != 0) {
+			fprintf(stderr, "GET_POSITION failed\n");
+			return 1;
+		}
+		usec[i] = now_usec() - start;
+	}
+	close(fd);
+	report("unix socket", usec, count);
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(argv[2], argv[3], &hints, &ai) != 0) {
+		fprintf(stderr, "Can't resolve %s\n", argv[2]);
+		return 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		const int64_t start = now_usec();
+		const int status = soap_get_position(ai, argv[2], argv[3]);
+		if (status != 200) {
+			fprintf(stderr, "GetPositionInfo failed (%d)\n",
+				status);
+			return 1;
+		}
+		usec[i] = now_usec() - start;
+	}
+	freeaddrinfo(ai);
+	report("SOAP", usec, count);
+	free(usec);
+	return 0;
+}
@@ -0,0 +1,1049 @@
+/* http_frontend.c - Event driven HTTP server for control and eventing
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_frontend.h"
+
+#include "logging.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#define MAX_REQUEST_SIZE (64 << 10)
+#define MAX_CONNECTIONS 256
+#define MAX_EVENTS 64
+#define IDLE_TIMEOUT_SEC 60
+#define NOTIFY_TIMEOUT_SEC 5
+// A subscriber that fails this many deliveries in a row is dropped.
+#define MAX_DELIVERY_FAILURES 3
+// Comment line sent on idle state streams, so that proxies keep them open.
+#define STREAM_HEARTBEAT_SEC 15
+// A state stream client this far behind is dropped.
+#define MAX_STREAM_BACKLOG (1 << 20)
+
+#define SERVER_STRING "Linux UPnP/1.0 " PACKAGE_NAME "/" PACKAGE_VERSION
+
+// An event, shared by the queues of all subscribers it goes to.
+struct event {
+	int refcount;
+	char *propertyset;
+};
+
+struct subscriber {
+	char sid[48];
+	char *event_path;
+	struct sockaddr_in callback_addr;
+	char *callback_host;  // as given, for the HOST header.
+	char *callback_path;
+	gint64 expires;       // monotonic time, usec.
+	unsigned int seq;
+	GQueue *events;
+	int failures;
+	struct connection *delivery;  // NOTIFY in flight, if any.
+	struct subscriber *next;
+};
+
+enum connection_kind {
+	CONN_CLIENT,   // request from a controller.
+	CONN_NOTIFY,   // our NOTIFY to a subscriber.
+	CONN_STREAM,   // a client following a state stream.
+};
+
+// A control request handed to the handler. Only the front-end thread
+// touches "connection"; it is cleared if the client goes away first.
+struct http_frontend_request {
+	struct connection *connection;
+	int status;
+	char *response;
+};
+
+struct connection {
+	int fd;
+	enum connection_kind kind;
+	struct sockaddr_storage peer;
+	GString *in;
+	GString *out;
+	size_t out_pos;
+	int close_after_write;
+	gint64 last_active;
+	struct subscriber *subscriber;  // CONN_NOTIFY
+	struct event *event;            // CONN_NOTIFY: being delivered
+	char *stream_path;              // CONN_STREAM
+	// CONN_CLIENT: control request being answered; no further requests
+	// are read until it is.
+	struct http_frontend_request *control;
+	// CONN_STREAM: versions of the sources the snapshot reflected.
+	int stream_versions[HTTP_FRONTEND_STREAM_SOURCES];
+	struct connection *next;
+};
+
+// Notifications, stream data and answered control requests handed over
+// from other threads.
+struct pending_notify {
+	struct http_frontend_request *control;  // If set, only this.
+	int stream;  // "propertyset" is data for the state stream at "path".
+	int source;  // stream: where it comes from, and its version.
+	int version;
+	char *path;
+	char *propertyset;
+};
+
+static const struct http_frontend_handlers *handlers_;
+static struct http_frontend_limits limits_;
+static int epoll_fd_ = -1;
+static int listen_fd_ = -1;
+static int wakeup_fd_ = -1;
+static struct connection *connections_ = NULL;
+// Closed during the current batch of epoll events, which may still refer
+// to them; freed after the batch.
+static struct connection *closed_connections_ = NULL;
+static int connection_count_ = 0;
+static struct subscriber *subscribers_ = NULL;
+static int subscriber_count_ = 0;
+
+static pthread_mutex_t pending_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static GQueue pending_ = G_QUEUE_INIT;
+
+// Markers for the epoll data of the non-connection descriptors.
+static char listen_marker_;
+static char wakeup_marker_;
+
+static void event_unref(struct event *event) {
+	if (--event->refcount == 0) {
+		free(event->propertyset);
+		free(event);
+	}
+}
+
+static int set_nonblocking(int fd) {
+	const int flags = fcntl(fd, F_GETFL, 0);
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void watch(struct connection *c, int want_write) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static struct connection *new_connection(int fd, enum connection_kind kind,
+					 uint32_t events) {
+	struct connection *c = g_new0(struct connection, 1);
+	c->fd = fd;
+	c->kind = kind;
+	c->in = g_string_new(NULL);
+	c->out = g_string_new(NULL);
+	c->last_active = g_get_monotonic_time();
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+	c->next = connections_;
+	connections_ = c;
+	connection_count_++;
+	return c;
+}
+
+static void close_connection(struct connection *c) {
+	struct connection **it;
+	for (it = &connections_; *it != NULL; it = &(*it)->next) {
+		if (*it == c) {
+			*it = c->next;
+			break;
+		}
+	}
+	connection_count_--;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	if (c->control) {
+		c->control->connection = NULL;  // Answer goes nowhere.
+		c->control = NULL;
+	}
+	if (c->subscriber) {
+		c->subscriber->delivery = NULL;
+		c->subscriber = NULL;
+	}
+	if (c->event) {
+		event_unref(c->event);
+		c->event = NULL;
+	}
+	c->next = closed_connections_;
+	closed_connections_ = c;
+}
+
+static void free_closed_connections(void) {
+	while (closed_connections_) {
+		struct connection *c = closed_connections_;
+		closed_connections_ = c->next;
+		g_string_free(c->in, TRUE);
+		g_string_free(c->out, TRUE);
+		free(c->stream_path);
+		free(c);
+	}
+}
+
+// -- Request parsing
+
+// Returns a newly allocated copy of the value of header "name" in the
+// header block "headers" (after the request line), or NULL.
+static char *get_header(const char *headers, const char *name) {
+	const size_t name_len = strlen(name);
+	const char *line = headers;
+	while (line && *line && !(line[0] == '\r' && line[1] == '\n')) {
+		const char *end = strstr(line, "\r\n");
+		if (end == NULL)
+			break;
+		if ((size_t)(end - line) > name_len && line[name_len] == ':'
+		    && strncasecmp(line, name, name_len) == 0) {
+			const char *value = line + name_len + 1;
+			while (value < end && (*value == ' ' || *value == '\t'))
+				value++;
+			const char *value_end = end;
+			while (value_end > value
+			       && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+				value_end--;
+			return g_strndup(value, value_end - value);
+		}
+		line = end + 2;
+	}
+	return NULL;
+}
+
+static void append_response(struct connection *c, const char *status,
+			    const char *extra_headers,
+			    const char *body, size_t body_len, int head_only) {
+	g_string_append_printf(c->out,
+			       "HTTP/1.1 %s\r\n"
+			       "SERVER: " SERVER_STRING "\r\n"
+			       "CONTENT-LENGTH: %lu\r\n"
+			       "%s%s\r\n",
+			       status, (unsigned long) body_len,
+			       extra_headers ? extra_headers : "",
+			       c->close_after_write
+			       ? "Connection: close\r\n" : "");
+	if (body && !head_only) {
+		g_string_append_len(c->out, body, body_len);
+	}
+}
+
+// Turn the connection into a server-sent events stream, starting with the
+// snapshot. It stays open until the client goes away.
+static void start_stream(struct connection *c, const char *path,
+			 char *snapshot, const int *versions) {
+	c->kind = CONN_STREAM;
+	memcpy(c->stream_versions, versions, sizeof(c->stream_versions));
+	c->stream_path = g_strdup(path);
+	c->close_after_write = 0;
+	g_string_append_printf(c->out,
+			       "HTTP/1.1 200 OK\r\n"
+			       "SERVER: " SERVER_STRING "\r\n"
+			       "CONTENT-TYPE: text/event-stream\r\n"
+			       "CACHE-CONTROL: no-cache\r\n"
+			       "ACCESS-CONTROL-ALLOW-ORIGIN: *\r\n"
+			       "Connection: close\r\n"
+			       "\r\n"
+			       "event: snapshot\ndata: %s\n\n", snapshot);
+	free(snapshot);
+	Log_info("frontend", "State stream %s opened", path);
+}
+
+static void handle_get(struct connection *c, const char *path, int head) {
+	char *snapshot;
+	int versions[HTTP_FRONTEND_STREAM_SOURCES];
+	memset(versions, 0, sizeof(versions));
+	if (!head && handlers_->stream_snapshot
+	    && (snapshot = handlers_->stream_snapshot(path, versions)) != NULL) {
+		start_stream(c, path, snapshot, versions);
+		return;
+	}
+	char *body = NULL;
+	size_t len = 0;
+	const char *content_type = NULL;
+	if (handlers_->get(path, &body, &len, &content_type) != 0) {
+		append_response(c, "404 Not Found", NULL, NULL, 0, head);
+		return;
+	}
+	char *headers = g_strdup_printf("CONTENT-TYPE: %s\r\n", content_type);
+	append_response(c, "200 OK", headers, body, len, head);
+	g_free(headers);
+	free(body);
+}
+
+// Hand the request to the handler; the connection waits for the answer.
+static void handle_control(struct connection *c, const char *path,
+			   const char *body) {
+	struct http_frontend_request *request =
+		g_new0(struct http_frontend_request, 1);
+	request->connection = c;
+	c->control = request;
+	handlers_->control(path, body, &c->peer, request);
+}
+
+static void append_control_response(struct connection *c, int status,
+				    const char *response) {
+	const char *status_line;
+	switch (status) {
+	case 200: status_line = "200 OK"; break;
+	case 404: status_line = "404 Not Found"; break;
+	case 400: status_line = "400 Bad Request"; break;
+	default: status_line = "500 Internal Server Error"; break;
+	}
+	append_response(c, status_line,
+			"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+			"EXT:\r\n",
+			response, response ? strlen(response) : 0, 0);
+}
+
+// -- Eventing
+
+static struct subscriber *find_subscriber(const char *sid) {
+	for (struct subscriber *s = subscribers_; s; s = s->next) {
+		if (strcmp(s->sid, sid) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+static void remove_subscriber(struct subscriber *subscriber) {
+	struct subscriber **it;
+	for (it = &subscribers_; *it != NULL; it = &(*it)->next) {
+		if (*it == subscriber) {
+			*it = subscriber->next;
+			break;
+		}
+	}
+	subscriber_count_--;
+	if (subscriber->delivery) {
+		subscriber->delivery->subscriber = NULL;
+		close_connection(subscriber->delivery);
+	}
+	struct event *event;
+	while ((event = (struct event*) g_queue_pop_head(subscriber->events))) {
+		event_unref(event);
+	}
+	g_queue_free(subscriber->events);
+	free(subscriber->event_path);
+	free(subscriber->callback_host);
+	free(subscriber->callback_path);
+	free(subscriber);
+}
+
+// Take the first http url out of a CALLBACK header "<url1><url2>".
+// Only numeric hosts, so that we don't block on name lookups.
+static int parse_callback(const char *callback, struct subscriber *s) {
+	const char *start = strchr(callback, '<');
+	if (start == NULL || strncasecmp(start + 1, "http://", 7) != 0)
+		return -1;
+	const char *host = start + 8;
+	const char *end = strchr(host, '>');
+	if (end == NULL)
+		return -1;
+	const char *path = memchr(host, '/', end - host);
+	if (path == NULL) path = end;
+	const char *colon = memchr(host, ':', path - host);
+	char *address = g_strndup(host, (colon ? colon : path) - host);
+	int port = 80;
+	if (colon) {
+		port = atoi(colon + 1);
+	}
+	memset(&s->callback_addr, 0, sizeof(s->callback_addr));
+	s->callback_addr.sin_family = AF_INET;
+	s->callback_addr.sin_port = htons(port);
+	const int valid = port > 0 && port < 65536
+		&& inet_pton(AF_INET, address, &s->callback_addr.sin_addr) == 1;
+	g_free(address);
+	if (!valid)
+		return -1;
+	s->callback_host = g_strndup(host, path - host);
+	s->callback_path = (path == end) ? g_strdup("/")
+		: g_strndup(path, end - path);
+	return 0;
+}
+
+static int granted_timeout(const char *requested) {
+	int timeout = limits_.timeout_sec;
+	if (requested && strncasecmp(requested, "Second-", 7) == 0) {
+		const int seconds = atoi(requested + 7);
+		if (seconds > 0 && seconds < timeout)
+			timeout = seconds;
+	}
+	return timeout;
+}
+
+static void start_delivery(struct subscriber *s);
+
+static void enqueue_event(struct subscriber *s, struct event *event) {
+	// A slow subscriber loses its oldest events, not the others theirs.
+	while ((int) g_queue_get_length(s->events) >= limits_.queue_length) {
+		event_unref((struct event*) g_queue_pop_head(s->events));
+		s->seq++;  // the subscriber can tell it missed one.
+	}
+	event->refcount++;
+	g_queue_push_tail(s->events, event);
+	start_delivery(s);
+}
+
+static void handle_subscribe(struct connection *c, const char *path,
+			     const char *headers) {
+	char *sid = get_header(headers, "SID");
+	char *callback = get_header(headers, "CALLBACK");
+	char *nt = get_header(headers, "NT");
+	char *timeout_header = get_header(headers, "TIMEOUT");
+	const int timeout = granted_timeout(timeout_header);
+	char response_headers[256];
+
+	if (sid && (callback || nt)) {
+		append_response(c, "400 Bad Request", NULL, NULL, 0, 0);
+	} else if (sid) {
+		// Renewal.
+		struct subscriber *s = find_subscriber(sid);
+		if (s == NULL || strcmp(s->event_path, path) != 0) {
+			append_response(c, "412 Precondition Failed",
+					NULL, NULL, 0, 0);
+		} else {
+			s->expires = g_get_monotonic_time()
+				+ (gint64) timeout * G_USEC_PER_SEC;
+			snprintf(response_headers, sizeof(response_headers),
+				 "SID: %s\r\nTIMEOUT: Second-%d\r\n",
+				 s->sid, timeout);
+			append_response(c, "200 OK", response_headers,
+					NULL, 0, 0);
+		}
+	} else if (callback == NULL || nt == NULL
+		   || strcmp(nt, "upnp:event") != 0) {
+		append_response(c, "412 Precondition Failed", NULL, NULL, 0, 0);
+	} else if (limits_.max_subscriptions > 0
+		   && subscriber_count_ >= limits_.max_subscriptions) {
+		Log_error("frontend", "Subscription limit reached (%d)",
+			  subscriber_count_);
+		append_response(c, "503 Service Unavailable", NULL, NULL, 0, 0);
+	} else {
+		struct subscriber *s = g_new0(struct subscriber, 1);
+		char *initial = NULL;
+		if (parse_callback(callback, s) != 0
+		    || (initial = handlers_->initial_event(path)) == NULL) {
+			free(s->callback_host);
+			free(s->callback_path);
+			free(s);
+			append_response(c, "412 Precondition Failed",
+					NULL, NULL, 0, 0);
+		} else {
+			snprintf(s->sid, sizeof(s->sid),
+				 "uuid:%08x-%04x-%04x-%04x-%08x%04x",
+				 g_random_int(), g_random_int() & 0xffff,
+				 (g_random_int() & 0x0fff) | 0x4000,
+				 (g_random_int() & 0x3fff) | 0x8000,
+				 g_random_int(), g_random_int() & 0xffff);
+			s->event_path = g_strdup(path);
+			s->expires = g_get_monotonic_time()
+				+ (gint64) timeout * G_USEC_PER_SEC;
+			s->events = g_queue_new();
+			s->next = subscribers_;
+			subscribers_ = s;
+			subscriber_count_++;
+			snprintf(response_headers, sizeof(response_headers),
+				 "SID: %s\r\nTIMEOUT: Second-%d\r\n",
+				 s->sid, timeout);
+			append_response(c, "200 OK", response_headers,
+					NULL, 0, 0);
+			Log_info("frontend", "%s subscribed to %s (%d "
+				 "subscribers)", s->callback_host, path,
+				 subscriber_count_);
+			// The initial event goes out with SEQ 0 after the
+			// response, which is written first below.
+			struct event *event = g_new0(struct event, 1);
+			event->propertyset = initial;
+			enqueue_event(s, event);
+		}
+	}
+	free(sid);
+	free(callback);
+	free(nt);
+	free(timeout_header);
+}
+
+static void handle_unsubscribe(struct connection *c, const char *headers) {
+	char *sid = get_header(headers, "SID");
+	struct subscriber *s = sid ? find_subscriber(sid) : NULL;
+	if (s == NULL) {
+		append_response(c, "412 Precondition Failed", NULL, NULL, 0, 0);
+	} else {
+		remove_subscriber(s);
+		append_response(c, "200 OK", NULL, NULL, 0, 0);
+	}
+	free(sid);
+}
+
+static void delivery_done(struct subscriber *s, int success) {
+	if (success) {
+		s->failures = 0;
+	} else if (++s->failures >= MAX_DELIVERY_FAILURES) {
+		Log_error("frontend", "Dropping subscriber %s at %s after %d "
+			  "failed deliveries", s->sid, s->callback_host,
+			  s->failures);
+		remove_subscriber(s);
+		return;
+	}
+	s->seq = (s->seq == G_MAXUINT32) ? 1 : s->seq + 1;
+	start_delivery(s);
+}
+
+// Connect to the subscriber and send the next queued event, unless one is
+// on its way already.
+static void start_delivery(struct subscriber *s) {
+	if (s->delivery != NULL || g_queue_is_empty(s->events))
+		return;
+	struct event *event = (struct event*) g_queue_pop_head(s->events);
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || set_nonblocking(fd) != 0
+	    || (connect(fd, (struct sockaddr*) &s->callback_addr,
+			sizeof(s->callback_addr)) != 0
+		&& errno != EINPROGRESS)) {
+		if (fd >= 0) close(fd);
+		event_unref(event);
+		delivery_done(s, 0);
+		return;
+	}
+	struct connection *c = new_connection(fd, CONN_NOTIFY,
+					      EPOLLOUT | EPOLLRDHUP);
+	c->subscriber = s;
+	c->event = event;
+	c->close_after_write = 0;
+	s->delivery = c;
+	const size_t len = strlen(event->propertyset);
+	g_string_printf(c->out,
+			"NOTIFY %s HTTP/1.1\r\n"
+			"HOST: %s\r\n"
+			"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+			"NT: upnp:event\r\n"
+			"NTS: upnp:propchange\r\n"
+			"SID: %s\r\n"
+			"SEQ: %u\r\n"
+			"CONTENT-LENGTH: %lu\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			s->callback_path, s->callback_host, s->sid, s->seq,
+			(unsigned long) len);
+	g_string_append_len(c->out, event->propertyset, len);
+}
+
+// The subscriber answered; done once we have the status line.
+static void handle_notify_response(struct connection *c) {
+	if (strstr(c->in->str, "\r\n") == NULL)
+		return;
+	int status = 0;
+	sscanf(c->in->str, "HTTP/%*d.%*d %d", &status);
+	struct subscriber *s = c->subscriber;
+	close_connection(c);
+	if (s) {
+		delivery_done(s, status >= 200 && status < 300);
+	}
+}
+
+static int flush_output(struct connection *c);
+static int process_requests(struct connection *c);
+
+// The handler answered a control request: send the response and go on
+// with requests the client sent meanwhile.
+static void control_done(struct http_frontend_request *request) {
+	struct connection *c = request->connection;
+	if (c != NULL) {
+		c->control = NULL;
+		append_control_response(c, request->status, request->response);
+		c->last_active = g_get_monotonic_time();
+		if ((!c->close_after_write && process_requests(c) != 0)
+		    || flush_output(c) != 0) {
+			close_connection(c);
+		}
+	}
+	free(request->response);
+	g_free(request);
+}
+
+// Append "data" to all streams at "path"; clients that can't keep up are
+// dropped rather than buffered for. Clients whose snapshot was taken after
+// this change already have it.
+static void stream_data(const char *path, const char *data,
+			int source, int version) {
+	struct connection *next;
+	for (struct connection *c = connections_; c; c = next) {
+		next = c->next;
+		if (c->kind != CONN_STREAM || strcmp(c->stream_path, path) != 0)
+			continue;
+		if (version <= c->stream_versions[source])
+			continue;
+		if (c->out->len - c->out_pos > MAX_STREAM_BACKLOG) {
+			Log_error("frontend", "Dropping state stream client "
+				  "that doesn't keep up");
+			close_connection(c);
+			continue;
+		}
+		g_string_append_printf(c->out, "data: %s\n\n", data);
+		c->last_active = g_get_monotonic_time();
+		if (flush_output(c) != 0)
+			close_connection(c);
+	}
+}
+
+static void distribute_pending(void) {
+	uint64_t count;
+	if (read(wakeup_fd_, &count, sizeof(count)) < 0) {
+		// Nothing to do; we're woken up again when there is.
+	}
+	pthread_mutex_lock(&pending_mutex_);
+	GQueue pending = pending_;
+	g_queue_init(&pending_);
+	pthread_mutex_unlock(&pending_mutex_);
+
+	struct pending_notify *p;
+	while ((p = (struct pending_notify*) g_queue_pop_head(&pending))) {
+		if (p->control) {
+			control_done(p->control);
+			g_free(p);
+			continue;
+		}
+		if (p->stream) {
+			stream_data(p->path, p->propertyset,
+				    p->source, p->version);
+			free(p->propertyset);
+			free(p->path);
+			free(p);
+			continue;
+		}
+		struct event *event = g_new0(struct event, 1);
+		event->refcount = 1;
+		event->propertyset = p->propertyset;
+		// Removed subscribers are unlinked; iterate over a copy of next.
+		struct subscriber *next;
+		for (struct subscriber *s = subscribers_; s; s = next) {
+			next = s->next;
+			if (strcmp(s->event_path, p->path) == 0) {
+				enqueue_event(s, event);
+			}
+		}
+		event_unref(event);
+		free(p->path);
+		free(p);
+	}
+}
+
+static void queue_pending(struct pending_notify *p) {
+	pthread_mutex_lock(&pending_mutex_);
+	g_queue_push_tail(&pending_, p);
+	pthread_mutex_unlock(&pending_mutex_);
+	const uint64_t one = 1;
+	if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+		Log_error("frontend", "Can't wake up event loop");
+	}
+}
+
+static void push_pending(int stream, int source, int version,
+			 const char *path, const char *data) {
+	if (wakeup_fd_ < 0)
+		return;
+	struct pending_notify *p = g_new0(struct pending_notify, 1);
+	p->stream = stream;
+	p->source = source;
+	p->version = version;
+	p->path = g_strdup(path);
+	p->propertyset = g_strdup(data);
+	queue_pending(p);
+}
+
+// Also when called from the handler itself: the answer goes through the
+// queue, so it is sent after the request was taken out of the input.
+void http_frontend_control_done(struct http_frontend_request *request,
+				int status, char *response) {
+	request->status = status;
+	request->response = response;
+	struct pending_notify *p = g_new0(struct pending_notify, 1);
+	p->control = request;
+	queue_pending(p);
+}
+
+void http_frontend_notify(const char *path, const char *propertyset) {
+	push_pending(0, 0, 0, path, propertyset);
+}
+
+void http_frontend_stream(const char *path, const char *data,
+			  int source, int version) {
+	if (source < 0 || source >= HTTP_FRONTEND_STREAM_SOURCES)
+		return;
+	push_pending(1, source, version, path, data);
+}
+
+// -- Connection handling
+
+// Handle all complete requests in the input buffer. Returns -1 if the
+// connection is to be closed right away.
+static int process_requests(struct connection *c) {
+	for (;;) {
+		char *header_end = strstr(c->in->str, "\r\n\r\n");
+		if (header_end == NULL) {
+			return c->in->len > MAX_REQUEST_SIZE ? -1 : 0;
+		}
+		char method[16], path[1024], version[16];
+		if (sscanf(c->in->str, "%15s %1023s %15s",
+			   method, path, version) != 3) {
+			return -1;
+		}
+		const char *headers = strstr(c->in->str, "\r\n") + 2;
+		char *content_length = get_header(headers, "CONTENT-LENGTH");
+		char *connection = get_header(headers, "CONNECTION");
+		char *chunked = get_header(headers, "TRANSFER-ENCODING");
+		const long body_len = content_length ? atol(content_length) : 0;
+		free(content_length);
+		const size_t header_len = header_end + 4 - c->in->str;
+		if (body_len < 0 || chunked
+		    || header_len + body_len > MAX_REQUEST_SIZE) {
+			free(connection);
+			free(chunked);
+			c->close_after_write = 1;
+			append_response(c, "413 Request Entity Too Large",
+					NULL, NULL, 0, 0);
+			return 0;
+		}
+		if (c->in->len < header_len + body_len) {
+			free(connection);
+			return 0;  // Body still coming.
+		}
+		if (strcmp(version, "HTTP/1.0") == 0) {
+			c->close_after_write = !(connection &&
+				strcasecmp(connection, "keep-alive") == 0);
+		} else {
+			c->close_after_write = (connection &&
+				strcasecmp(connection, "close") == 0);
+		}
+		free(connection);
+
+		// Terminate the header block and body for the handlers.
+		header_end[2] = '\0';
+		char *body = g_strndup(c->in->str + header_len, body_len);
+		if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
+			handle_get(c, path, method[0] == 'H');
+		} else if (strcmp(method, "POST") == 0) {
+			handle_control(c, path, body);
+		} else if (strcmp(method, "SUBSCRIBE") == 0) {
+			handle_subscribe(c, path, headers);
+		} else if (strcmp(method, "UNSUBSCRIBE") == 0) {
+			handle_unsubscribe(c, headers);
+		} else {
+			append_response(c, "501 Not Implemented",
+					NULL, NULL, 0, 0);
+		}
+		g_free(body);
+		g_string_erase(c->in, 0, header_len + body_len);
+		if (c->close_after_write || c->kind == CONN_STREAM)
+			return 0;  // Ignore anything after.
+		if (c->control != NULL)
+			return 0;  // Answers go out in order.
+	}
+}
+
+// Write what we can. Returns -1 if the connection is done or failed.
+static int flush_output(struct connection *c) {
+	while (c->out_pos < c->out->len) {
+		const ssize_t written = send(c->fd, c->out->str + c->out_pos,
+					     c->out->len - c->out_pos,
+					     MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				watch(c, 1);
+				return 0;
+			}
+			return -1;
+		}
+		c->out_pos += written;
+	}
+	g_string_truncate(c->out, 0);
+	c->out_pos = 0;
+	if (c->kind == CONN_CLIENT && c->close_after_write
+	    && c->control == NULL)
+		return -1;
+	watch(c, 0);
+	return 0;
+}
+
+static void handle_client_io(struct connection *c, uint32_t events) {
+	if (events & EPOLLIN) {
+		char buffer[8192];
+		ssize_t len;
+		while ((len = recv(c->fd, buffer, sizeof(buffer), 0)) > 0) {
+			g_string_append_len(c->in, buffer, len);
+		}
+		if (len == 0 || (len < 0 && errno != EAGAIN
+				 && errno != EWOULDBLOCK)) {
+			close_connection(c);
+			return;
+		}
+		if (c->kind == CONN_STREAM) {
+			g_string_truncate(c->in, 0);  // Nothing to say to us.
+		} else {
+			c->last_active = g_get_monotonic_time();
+		}
+		if (c->kind == CONN_CLIENT && !c->close_after_write
+		    && (c->control == NULL
+			? process_requests(c) != 0
+			: c->in->len > MAX_REQUEST_SIZE)) {
+			close_connection(c);
+			return;
+		}
+	} else if (events & (EPOLLHUP | EPOLLERR)) {
+		close_connection(c);
+		return;
+	}
+	if (flush_output(c) != 0) {
+		close_connection(c);
+	}
+}
+
+static void handle_notify_io(struct connection *c, uint32_t events) {
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+	if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+		error = 1;
+	} else if (c->out->len > 0 && (events & EPOLLOUT)) {
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+		if (error == 0 && flush_output(c) != 0)
+			error = 1;
+	}
+	if (!error && (events & EPOLLIN)) {
+		char buffer[1024];
+		ssize_t len;
+		while ((len = recv(c->fd, buffer, sizeof(buffer), 0)) > 0) {
+			g_string_append_len(c->in, buffer, len);
+		}
+		c->last_active = g_get_monotonic_time();
+		if (len == 0 && strstr(c->in->str, "\r\n") == NULL) {
+			error = 1;
+		} else {
+			handle_notify_response(c);
+			return;
+		}
+	}
+	if (error) {
+		struct subscriber *s = c->subscriber;
+		close_connection(c);
+		if (s) delivery_done(s, 0);
+	}
+}
+
+static void accept_connections(void) {
+	for (;;) {
+		struct sockaddr_storage peer;
+		socklen_t peer_len = sizeof(peer);
+		const int fd = accept(listen_fd_, (struct sockaddr*) &peer,
+				      &peer_len);
+		if (fd < 0)
+			return;
+		if (connection_count_ >= MAX_CONNECTIONS
+		    || set_nonblocking(fd) != 0) {
+			close(fd);
+			continue;
+		}
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct connection *c = new_connection(fd, CONN_CLIENT,
+						      EPOLLIN | EPOLLRDHUP);
+		c->peer = peer;
+	}
+}
+
+// Drop idle keep-alive connections, stuck deliveries and subscriptions
+// that weren't renewed; keep state streams alive.
+static void expire(void) {
+	const gint64 now = g_get_monotonic_time();
+	struct connection *next_c;
+	for (struct connection *c = connections_; c; c = next_c) {
+		next_c = c->next;
+		if (c->kind == CONN_STREAM) {
+			if (now - c->last_active
+			    >= STREAM_HEARTBEAT_SEC * G_USEC_PER_SEC) {
+				g_string_append(c->out, ":\n\n");
+				c->last_active = now;
+				if (flush_output(c) != 0)
+					close_connection(c);
+			}
+			continue;
+		}
+		if (c->control != NULL)
+			continue;  // Waiting for us, not idle.
+		const int timeout = (c->kind == CONN_NOTIFY)
+			? NOTIFY_TIMEOUT_SEC : IDLE_TIMEOUT_SEC;
+		if (now - c->last_active < timeout * G_USEC_PER_SEC)
+			continue;
+		if (c->kind == CONN_NOTIFY) {
+			struct subscriber *s = c->subscriber;
+			close_connection(c);
+			if (s) delivery_done(s, 0);
+			// That may have closed or opened others.
+			return;
+		}
+		close_connection(c);
+	}
+	struct subscriber *next_s;
+	for (struct subscriber *s = subscribers_; s; s = next_s) {
+		next_s = s->next;
+		if (s->expires < now) {
+			Log_info("frontend", "Subscription %s expired", s->sid);
+			remove_subscriber(s);
+		}
+	}
+}
+
+static void *event_loop(void *userdata) {
+	(void)userdata;
+	struct epoll_event events[MAX_EVENTS];
+	gint64 last_expire = g_get_monotonic_time();
+	for (;;) {
+		const int count = epoll_wait(epoll_fd_, events, MAX_EVENTS,
+					     1000);
+		for (int i = 0; i < count; ++i) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &listen_marker_) {
+				accept_connections();
+			} else if (ptr == &wakeup_marker_) {
+				distribute_pending();
+			} else {
+				struct connection *c = (struct connection*) ptr;
+				if (c->fd < 0) {
+					continue;  // closed earlier in this batch.
+				} else if (c->kind != CONN_NOTIFY) {
+					handle_client_io(c, events[i].events);
+				} else {
+					handle_notify_io(c, events[i].events);
+				}
+			}
+		}
+		const gint64 now = g_get_monotonic_time();
+		if (now - last_expire >= G_USEC_PER_SEC) {
+			expire();
+			last_expire = now;
+		}
+		free_closed_connections();
+	}
+	return NULL;
+}
+
+int http_frontend_start(int port, const struct http_frontend_handlers *h,
+			const struct http_frontend_limits *limits) {
+	handlers_ = h;
+	limits_ = *limits;
+	if (limits_.timeout_sec <= 0) limits_.timeout_sec = 1800;
+	if (limits_.queue_length <= 0) limits_.queue_length = 10;
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd_ < 0)
+		return -1;
+	const int one = 1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	    || listen(listen_fd_, 64) != 0
+	    || set_nonblocking(listen_fd_) != 0) {
+		Log_error("frontend", "Can't listen on port %d: %s",
+			  port, strerror(errno));
+		close(listen_fd_);
+		listen_fd_ = -1;
+		return -1;
+	}
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || wakeup_fd_ < 0) {
+		Log_error("frontend", "Can't set up event loop");
+		return -1;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_marker_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+	ev.data.ptr = &wakeup_marker_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, event_loop, NULL) != 0) {
+		return -1;
+	}
+	pthread_detach(thread);
+	Log_info("frontend", "Serving control and eventing on port %d", port);
+	return 0;
+}
+
+#else
+
+int http_frontend_start(int port, const struct http_frontend_handlers *h,
+			const struct http_frontend_limits *limits) {
+	(void)port;
+	(void)h;
+	(void)limits;
+	Log_error("frontend", "Not available on this platform (no epoll)");
+	return -1;
+}
+
+void http_frontend_control_done(struct http_frontend_request *request,
+				int status, char *response) {
+	(void)request;
+	(void)status;
+	free(response);
+}
+
+void http_frontend_notify(const char *path, const char *propertyset) {
+	(void)path;
+	(void)propertyset;
+}
+
+void http_frontend_stream(const char *path, const char *data,
+			  int source, int version) {
+	(void)path;
+	(void)data;
+	(void)source;
+	(void)version;
+}
+
+#endif
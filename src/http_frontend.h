@@ -0,0 +1,94 @@
+/* http_frontend.h - Event driven HTTP server for control and eventing
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _HTTP_FRONTEND_H
+#define _HTTP_FRONTEND_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+// A single thread serving HTTP/1.1 with keep-alive on non-blocking
+// sockets: GET of descriptions and files, SOAP control requests and GENA
+// subscriptions, including delivery of the events to the subscribers, and
+// server-sent event streams for dashboards.
+
+// A control request waiting for its answer.
+struct http_frontend_request;
+
+struct http_frontend_handlers {
+	// Content of "path" for GET and HEAD. Returns 0 and sets a malloc()ed
+	// copy in "body", or -1 if there is no such file.
+	int (*get)(const char *path, char **body, size_t *len,
+		   const char **content_type);
+
+	// SOAP request to the control url "path". Answered, right away or
+	// later, with http_frontend_control_done(); until then the connection
+	// waits, while the others are served. The arguments are only valid
+	// during the call.
+	void (*control)(const char *path, const char *body,
+			const struct sockaddr_storage *peer,
+			struct http_frontend_request *request);
+
+	// Propertyset of the initial event for a new subscription to the
+	// event url "path", malloc()ed; NULL if there is no such url.
+	char *(*initial_event)(const char *path);
+
+	// Snapshot sent first to a client opening the state stream at
+	// "path", malloc()ed; NULL if there is no such stream. Sets the
+	// version of each of the HTTP_FRONTEND_STREAM_SOURCES sources the
+	// snapshot reflects in "versions". May be NULL.
+	char *(*stream_snapshot)(const char *path, int *versions);
+};
+
+// Sources of data on a state stream, e.g. services, each with a version
+// that goes up with every change.
+#define HTTP_FRONTEND_STREAM_SOURCES 8
+
+struct http_frontend_limits {
+	int max_subscriptions;  // 0: no limit.
+	int timeout_sec;        // Longest subscription granted.
+	int queue_length;       // Events held per subscriber.
+};
+
+// Start serving on "port" in a thread of its own. The handlers are called
+// from that thread. Returns 0 on success.
+int http_frontend_start(int port, const struct http_frontend_handlers *h,
+			const struct http_frontend_limits *limits);
+
+// Answer "request" with the HTTP "status" and the malloc()ed response
+// envelope "response", which is taken over. Doesn't block; can be called
+// from any thread, once per request.
+void http_frontend_control_done(struct http_frontend_request *request,
+				int status, char *response);
+
+// Send the "propertyset" to all subscribers of the event url "path".
+// Doesn't block; can be called from any thread.
+void http_frontend_notify(const char *path, const char *propertyset);
+
+// Send "data", a single line, to all clients of the state stream at
+// "path" as a server-sent event. It is the change of "source" to
+// "version"; clients whose snapshot already had that version or a newer
+// one of the source don't get it. Doesn't block; can be called from any
+// thread.
+void http_frontend_stream(const char *path, const char *data,
+			  int source, int version);
+
+#endif /* _HTTP_FRONTEND_H */
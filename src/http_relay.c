@@ -0,0 +1,770 @@
+/* http_relay.c - Local HTTP relay sharing one upstream fetch
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_relay.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// Bytes of each upstream stream kept for players joining late or falling
+// behind.
+#define RELAY_RING_SIZE (4 << 20)
+#define MAX_HEADER_SIZE 8192
+#define MAX_REDIRECTS 5
+
+#define RELAY_PATH "/relay?uri="
+// Answered with RELAY_IDENTITY, so that a renderer finding the port in use
+// can tell whether it is the relay of another renderer on this host.
+#define RELAY_ID_PATH "/relay-id"
+#define RELAY_IDENTITY "gmediarender relay 1\n"
+
+enum stream_state {
+	STREAM_CONNECTING,
+	STREAM_RUNNING,
+	STREAM_DONE,     // upstream finished; readers drain the buffer.
+	STREAM_FAILED,
+};
+
+// A reader's position in the total byte count of its stream.
+struct relay_reader {
+	uint64_t cursor;
+	struct relay_reader *next;
+};
+
+// One upstream fetch, shared by all readers of the same uri. For files, the
+// fetcher waits until the slowest reader has room in the ring, so every
+// reader gets the whole file. Endless streams can't be held back; there a
+// reader that falls more than RELAY_RING_SIZE behind is cut off.
+struct relay_stream {
+	char *uri;
+	// Protected by registry_mutex_.
+	int refcount;          // readers plus the fetcher thread.
+	int readers;
+	struct relay_stream *next;
+
+	// Protected by mutex.
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	enum stream_state state;
+	int abandoned;         // no readers left; fetcher should stop.
+	int upstream_fd;
+	char *content_type;
+	long long content_length;  // -1 for endless (radio) streams.
+	uint64_t written;      // total bytes received from upstream.
+	char *ring;
+	struct relay_reader *cursors;
+};
+
+static pthread_mutex_t registry_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static struct relay_stream *streams_ = NULL;
+static int relay_port_ = 0;
+// Set if relay_port_ is served by this process; otherwise another
+// renderer's relay is used, and taken over if that renderer exits.
+static int relay_owned_ = 0;
+static pthread_mutex_t start_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+static void stream_unref_locked(struct relay_stream *stream) {
+	if (--stream->refcount > 0)
+		return;
+	struct relay_stream **s;
+	for (s = &streams_; *s != NULL; s = &(*s)->next) {
+		if (*s == stream) {
+			*s = stream->next;
+			break;
+		}
+	}
+	pthread_mutex_destroy(&stream->mutex);
+	pthread_cond_destroy(&stream->cond);
+	free(stream->uri);
+	free(stream->content_type);
+	free(stream->ring);
+	free(stream);
+}
+
+static void stream_unref(struct relay_stream *stream) {
+	pthread_mutex_lock(&registry_mutex_);
+	stream_unref_locked(stream);
+	pthread_mutex_unlock(&registry_mutex_);
+}
+
+// -- upstream
+
+// Split "http://host[:port]/path". Returns 0 on success; the out parameters
+// are malloc()ed.
+static int split_http_uri(const char *uri, char **host, char **port,
+			  char **path) {
+	if (strncasecmp(uri, "http://", 7) != 0)
+		return -1;
+	const char *start = uri + 7;
+	const char *host_end;
+	const char *after_host;
+	if (*start == '[') {  // IPv6 literal.
+		host_end = strchr(start, ']');
+		if (host_end == NULL)
+			return -1;
+		start++;
+		after_host = host_end + 1;
+	} else {
+		host_end = start + strcspn(start, ":/?");
+		after_host = host_end;
+	}
+	if (host_end == start)
+		return -1;
+	*host = strndup(start, host_end - start);
+	if (*after_host == ':') {
+		const char *port_start = after_host + 1;
+		const size_t len = strcspn(port_start, "/?");
+		*port = strndup(port_start, len);
+		after_host = port_start + len;
+	} else {
+		*port = strdup("80");
+	}
+	if (*after_host == '/') {
+		*path = strdup(after_host);
+	} else {  // empty path, possibly with query.
+		*path = (char*) malloc(strlen(after_host) + 2);
+		sprintf(*path, "/%s", after_host);
+	}
+	return 0;
+}
+
+static int connect_to(const char *host, const char *port) {
+	struct addrinfo hints, *result, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &result) != 0)
+		return -1;
+	int fd = -1;
+	for (ai = result; ai != NULL && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(result);
+	return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+// Read a HTTP header block up to the empty line into buf (nul-terminated).
+// Reads byte by byte so that no body data is consumed.
+static int read_header(int fd, char *buf, size_t size) {
+	size_t len = 0;
+	while (len + 1 < size) {
+		const ssize_t r = recv(fd, buf + len, 1, 0);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		len++;
+		buf[len] = '\0';
+		if (len >= 4 && strcmp(buf + len - 4, "\r\n\r\n") == 0)
+			return 0;
+		if (len >= 2 && strcmp(buf + len - 2, "\n\n") == 0)
+			return 0;
+	}
+	return -1;
+}
+
+// Returns the malloc()ed value of header "name" in the header block, or NULL.
+static char *find_header(const char *header, const char *name) {
+	const size_t name_len = strlen(name);
+	const char *line = strchr(header, '\n');  // skip status/request line.
+	while (line != NULL && *++line != '\0') {
+		if (strncasecmp(line, name, name_len) == 0
+		    && line[name_len] == ':') {
+			const char *value = line + name_len + 1;
+			while (*value == ' ' || *value == '\t')
+				value++;
+			return strndup(value, strcspn(value, "\r\n"));
+		}
+		line = strchr(line, '\n');
+	}
+	return NULL;
+}
+
+// Connect and send the request for "uri", following redirects. On success,
+// returns the socket positioned at the start of the body and sets
+// stream->content_type and stream->content_length.
+static int open_upstream(struct relay_stream *stream) {
+	char *uri = strdup(stream->uri);
+	char header[MAX_HEADER_SIZE];
+	int redirects;
+	for (redirects = 0; redirects <= MAX_REDIRECTS; ++redirects) {
+		char *host, *port, *path;
+		if (split_http_uri(uri, &host, &port, &path) != 0)
+			break;
+		const int fd = connect_to(host, port);
+		int status = 0;
+		if (fd >= 0) {
+			snprintf(header, sizeof(header),
+				 "GET %s HTTP/1.0\r\n"
+				 "Host: %s\r\n"
+				 "User-Agent: gmediarender\r\n"
+				 "\r\n", path, host);
+			if (send_all(fd, header, strlen(header)) == 0
+			    && read_header(fd, header, sizeof(header)) == 0) {
+				// Shoutcast answers "ICY 200 OK".
+				const char *code = strchr(header, ' ');
+				status = code ? atoi(code + 1) : 0;
+			}
+		}
+		free(host);
+		free(port);
+		free(path);
+		if (status >= 300 && status < 400) {
+			char *location = find_header(header, "Location");
+			close(fd);
+			if (location == NULL)
+				break;
+			free(uri);
+			uri = location;
+			continue;
+		}
+		if (status != 200) {
+			Log_error("relay", "Upstream '%s' failed (status %d)",
+				  uri, status);
+			if (fd >= 0) close(fd);
+			break;
+		}
+		char *length = find_header(header, "Content-Length");
+		stream->content_length = length ? atoll(length) : -1;
+		free(length);
+		stream->content_type = find_header(header, "Content-Type");
+		free(uri);
+		return fd;
+	}
+	free(uri);
+	return -1;
+}
+
+// Position of the slowest reader, or "written" if there is none.
+static uint64_t slowest_cursor_locked(struct relay_stream *stream) {
+	uint64_t slowest = stream->written;
+	struct relay_reader *reader;
+	for (reader = stream->cursors; reader != NULL; reader = reader->next) {
+		if (reader->cursor < slowest)
+			slowest = reader->cursor;
+	}
+	return slowest;
+}
+
+static void *fetch_upstream(void *userdata) {
+	struct relay_stream *stream = (struct relay_stream*) userdata;
+	const int fd = open_upstream(stream);
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->upstream_fd = fd;
+	stream->state = (fd >= 0) ? STREAM_RUNNING : STREAM_FAILED;
+	if (stream->abandoned && fd >= 0)
+		shutdown(fd, SHUT_RDWR);
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+
+	char buf[16384];
+	while (fd >= 0) {
+		if (stream->content_length >= 0) {
+			// Don't overwrite bytes a reader of the file still needs.
+			pthread_mutex_lock(&stream->mutex);
+			while (!stream->abandoned
+			       && stream->written + sizeof(buf)
+			       > slowest_cursor_locked(stream) + RELAY_RING_SIZE) {
+				pthread_cond_wait(&stream->cond, &stream->mutex);
+			}
+			pthread_mutex_unlock(&stream->mutex);
+		}
+		const ssize_t r = recv(fd, buf, sizeof(buf), 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		pthread_mutex_lock(&stream->mutex);
+		if (r <= 0 || stream->abandoned) {
+			stream->state = STREAM_DONE;
+			stream->upstream_fd = -1;
+			pthread_cond_broadcast(&stream->cond);
+			pthread_mutex_unlock(&stream->mutex);
+			break;
+		}
+		const size_t offset = stream->written % RELAY_RING_SIZE;
+		const size_t first = (r < (ssize_t) (RELAY_RING_SIZE - offset))
+			? (size_t) r : RELAY_RING_SIZE - offset;
+		memcpy(stream->ring + offset, buf, first);
+		memcpy(stream->ring, buf + first, r - first);
+		stream->written += r;
+		pthread_cond_broadcast(&stream->cond);
+		pthread_mutex_unlock(&stream->mutex);
+	}
+	if (fd >= 0)
+		close(fd);
+	Log_info("relay", "Stopped fetching '%s'", stream->uri);
+	stream_unref(stream);
+	return NULL;
+}
+
+// Find the running fetch of "uri" or start a new one. Returns the stream
+// with a reader reference held, or NULL.
+static struct relay_stream *stream_subscribe(const char *uri) {
+	pthread_mutex_lock(&registry_mutex_);
+	struct relay_stream *stream;
+	for (stream = streams_; stream != NULL; stream = stream->next) {
+		if (stream->readers > 0 && strcmp(stream->uri, uri) == 0)
+			break;
+	}
+	if (stream == NULL) {
+		stream = (struct relay_stream*) calloc(1, sizeof(*stream));
+		stream->ring = (char*) malloc(RELAY_RING_SIZE);
+		stream->uri = strdup(uri);
+		stream->upstream_fd = -1;
+		stream->content_length = -1;
+		stream->state = STREAM_CONNECTING;
+		pthread_mutex_init(&stream->mutex, NULL);
+		pthread_cond_init(&stream->cond, NULL);
+		stream->refcount = 1;  // fetcher.
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, fetch_upstream, stream) != 0) {
+			stream_unref_locked(stream);
+			pthread_mutex_unlock(&registry_mutex_);
+			return NULL;
+		}
+		pthread_detach(thread);
+		stream->next = streams_;
+		streams_ = stream;
+		Log_info("relay", "Fetching '%s'", uri);
+	}
+	stream->refcount++;
+	stream->readers++;
+	pthread_mutex_unlock(&registry_mutex_);
+	return stream;
+}
+
+static void stream_unsubscribe(struct relay_stream *stream) {
+	pthread_mutex_lock(&registry_mutex_);
+	if (--stream->readers == 0) {
+		pthread_mutex_lock(&stream->mutex);
+		stream->abandoned = 1;
+		if (stream->upstream_fd >= 0)
+			shutdown(stream->upstream_fd, SHUT_RDWR);
+		pthread_cond_broadcast(&stream->cond);
+		pthread_mutex_unlock(&stream->mutex);
+	}
+	stream_unref_locked(stream);
+	pthread_mutex_unlock(&registry_mutex_);
+}
+
+// -- local clients
+
+static void send_redirect(int fd, const char *uri) {
+	char buf[MAX_HEADER_SIZE];
+	snprintf(buf, sizeof(buf),
+		 "HTTP/1.0 302 Found\r\n"
+		 "Location: %s\r\n"
+		 "Content-Length: 0\r\n"
+		 "Connection: close\r\n"
+		 "\r\n", uri);
+	send_all(fd, buf, strlen(buf));
+}
+
+static void send_status(int fd, const char *status) {
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+		 "HTTP/1.0 %s\r\nContent-Length: 0\r\n"
+		 "Connection: close\r\n\r\n", status);
+	send_all(fd, buf, strlen(buf));
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Decode the percent encoded uri of the request line up to the next space.
+static char *decode_uri(const char *in) {
+	const size_t len = strcspn(in, " \r\n");
+	char *result = (char*) malloc(len + 1);
+	char *out = result;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		if (in[i] == '%' && i + 2 < len
+		    && hex_value(in[i+1]) >= 0 && hex_value(in[i+2]) >= 0) {
+			*out++ = hex_value(in[i+1]) << 4 | hex_value(in[i+2]);
+			i += 2;
+		} else {
+			*out++ = in[i];
+		}
+	}
+	*out = '\0';
+	return result;
+}
+
+// Copy the stream to the client, starting at reader->cursor. Advancing the
+// cursor wakes a fetcher waiting for room.
+static void serve_stream(int fd, struct relay_stream *stream,
+			 struct relay_reader *reader) {
+	char buf[65536];
+	for (;;) {
+		pthread_mutex_lock(&stream->mutex);
+		const uint64_t cursor = reader->cursor;
+		while (cursor == stream->written
+		       && stream->state == STREAM_RUNNING) {
+			pthread_cond_wait(&stream->cond, &stream->mutex);
+		}
+		if (stream->written - cursor > RELAY_RING_SIZE) {
+			pthread_mutex_unlock(&stream->mutex);
+			Log_error("relay", "Client fell behind on '%s'",
+				  stream->uri);
+			return;
+		}
+		const size_t offset = cursor % RELAY_RING_SIZE;
+		size_t len = stream->written - cursor;
+		if (len > RELAY_RING_SIZE - offset)
+			len = RELAY_RING_SIZE - offset;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		memcpy(buf, stream->ring + offset, len);
+		reader->cursor += len;
+		pthread_cond_broadcast(&stream->cond);
+		pthread_mutex_unlock(&stream->mutex);
+
+		if (len == 0)   // upstream done and everything sent.
+			return;
+		if (send_all(fd, buf, len) != 0)
+			return;
+	}
+}
+
+static void remove_reader(struct relay_stream *stream,
+			  struct relay_reader *reader) {
+	pthread_mutex_lock(&stream->mutex);
+	struct relay_reader **r;
+	for (r = &stream->cursors; *r != NULL; r = &(*r)->next) {
+		if (*r == reader) {
+			*r = reader->next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+}
+
+// The uri ends up in a Location: header and in the upstream request line,
+// so anything that could end a header line is refused.
+static int is_safe_uri(const char *uri) {
+	for (; *uri; ++uri) {
+		const unsigned char c = *uri;
+		if (c < 0x20 || c == 0x7f)
+			return 0;
+	}
+	return 1;
+}
+
+static void *handle_client(void *userdata) {
+	const int fd = (int) (intptr_t) userdata;
+	char header[MAX_HEADER_SIZE];
+	if (read_header(fd, header, sizeof(header)) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if (strncmp(header, "GET " RELAY_ID_PATH " ",
+		    strlen("GET " RELAY_ID_PATH " ")) == 0) {
+		char response[256];
+		snprintf(response, sizeof(response),
+			 "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+			 "Content-Length: %zu\r\nConnection: close\r\n\r\n"
+			 "%s", strlen(RELAY_IDENTITY), RELAY_IDENTITY);
+		send_all(fd, response, strlen(response));
+		close(fd);
+		return NULL;
+	}
+	if (strncmp(header, "GET " RELAY_PATH, strlen("GET " RELAY_PATH))) {
+		send_status(fd, "404 Not Found");
+		close(fd);
+		return NULL;
+	}
+	char *uri = decode_uri(header + strlen("GET " RELAY_PATH));
+	if (!is_safe_uri(uri)) {
+		send_status(fd, "400 Bad Request");
+		free(uri);
+		close(fd);
+		return NULL;
+	}
+
+	// Seeks are served by the origin.
+	char *range = find_header(header, "Range");
+	const int wants_start = (range == NULL
+				 || strcmp(range, "bytes=0-") == 0);
+	free(range);
+	if (!wants_start) {
+		send_redirect(fd, uri);
+		free(uri);
+		close(fd);
+		return NULL;
+	}
+
+	struct relay_stream *stream = stream_subscribe(uri);
+	if (stream == NULL) {
+		send_redirect(fd, uri);
+		free(uri);
+		close(fd);
+		return NULL;
+	}
+	pthread_mutex_lock(&stream->mutex);
+	while (stream->state == STREAM_CONNECTING)
+		pthread_cond_wait(&stream->cond, &stream->mutex);
+	const int failed = (stream->state == STREAM_FAILED);
+	// Late joiners start at the oldest byte we still have. That is fine
+	// for endless streams, but a file must be served from its start.
+	const uint64_t oldest = (stream->written > RELAY_RING_SIZE)
+		? stream->written - RELAY_RING_SIZE : 0;
+	const int finite = (stream->content_length >= 0);
+	struct relay_reader reader = { oldest, NULL };
+	const int serve = !failed && !(finite && oldest > 0);
+	if (serve) {
+		reader.next = stream->cursors;
+		stream->cursors = &reader;
+	}
+	char response[MAX_HEADER_SIZE];
+	int len = snprintf(response, sizeof(response),
+			   "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n",
+			   stream->content_type ? stream->content_type
+			   : "application/octet-stream");
+	if (finite) {
+		len += snprintf(response + len, sizeof(response) - len,
+				"Content-Length: %lld\r\n",
+				stream->content_length);
+	}
+	snprintf(response + len, sizeof(response) - len,
+		 "Connection: close\r\n\r\n");
+	pthread_mutex_unlock(&stream->mutex);
+
+	if (!serve) {
+		// Let the player talk to the origin itself.
+		send_redirect(fd, uri);
+	} else {
+		if (send_all(fd, response, strlen(response)) == 0)
+			serve_stream(fd, stream, &reader);
+		remove_reader(stream, &reader);
+	}
+	stream_unsubscribe(stream);
+	free(uri);
+	close(fd);
+	return NULL;
+}
+
+static void *accept_clients(void *userdata) {
+	const int listen_fd = (int) (intptr_t) userdata;
+	for (;;) {
+		const int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			Log_error("relay", "accept() failed: %s",
+				  strerror(errno));
+			break;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, handle_client,
+				   (void*) (intptr_t) fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(listen_fd);
+	return NULL;
+}
+
+static void loopback_address(int port, struct sockaddr_in *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// Listen on 127.0.0.1:port and serve clients in a thread of their own.
+// Returns 0 on success, otherwise the errno.
+static int start_listener(int port) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return errno;
+	const int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	loopback_address(port, &addr);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		const int err = errno;
+		close(fd);
+		return err;
+	}
+	pthread_t thread;
+	if (listen(fd, 16) != 0
+	    || pthread_create(&thread, NULL, accept_clients,
+			      (void*) (intptr_t) fd) != 0) {
+		const int err = errno ? errno : EAGAIN;
+		close(fd);
+		return err;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+// Returns 1 if 127.0.0.1:port answers RELAY_ID_PATH with RELAY_IDENTITY.
+static int is_relay_listening(int port) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+	const struct timeval timeout = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	struct sockaddr_in addr;
+	loopback_address(port, &addr);
+	static const char request[] = "GET " RELAY_ID_PATH " HTTP/1.0\r\n\r\n";
+	char header[MAX_HEADER_SIZE];
+	char body[sizeof(RELAY_IDENTITY)];
+	int result = 0;
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0
+	    && send_all(fd, request, strlen(request)) == 0
+	    && read_header(fd, header, sizeof(header)) == 0
+	    && strncmp(header, "HTTP/1.0 200 ", 13) == 0) {
+		size_t len = 0;
+		ssize_t r;
+		while (len < sizeof(body) - 1
+		       && (r = recv(fd, body + len, sizeof(body) - 1 - len,
+				    0)) > 0) {
+			len += r;
+		}
+		body[len] = '\0';
+		result = (strcmp(body, RELAY_IDENTITY) == 0);
+	}
+	close(fd);
+	return result;
+}
+
+int http_relay_start(int port) {
+	pthread_mutex_lock(&start_mutex_);
+	const int err = start_listener(port);
+	int result = 0;
+	if (err == 0) {
+		relay_port_ = port;
+		relay_owned_ = 1;
+		Log_info("relay", "Relaying http streams on 127.0.0.1:%d",
+			 port);
+	} else if (err == EADDRINUSE && is_relay_listening(port)) {
+		relay_port_ = port;
+		relay_owned_ = 0;
+		Log_info("relay", "Sharing the relay of another renderer on "
+			 "127.0.0.1:%d", port);
+	} else {
+		Log_error("relay", "Can't listen on port %d: %s%s", port,
+			  strerror(err), (err == EADDRINUSE)
+			  ? " (and it is not a gmediarender relay)" : "");
+		result = -1;
+	}
+	pthread_mutex_unlock(&start_mutex_);
+	return result;
+}
+
+// The relay of another renderer we use is gone if its port is free; then
+// serve it ourselves. Falls back to direct fetches if the port was taken by
+// something else. Returns the port to use, 0 for none.
+static int ensure_relay(void) {
+	pthread_mutex_lock(&start_mutex_);
+	if (relay_port_ != 0 && !relay_owned_) {
+		const int err = start_listener(relay_port_);
+		if (err == 0) {
+			relay_owned_ = 1;
+			Log_info("relay", "Took over the relay on "
+				 "127.0.0.1:%d", relay_port_);
+		} else if (err != EADDRINUSE
+			   || !is_relay_listening(relay_port_)) {
+			Log_error("relay", "Relay on 127.0.0.1:%d is gone; "
+				  "fetching streams directly.", relay_port_);
+			relay_port_ = 0;
+		}
+	}
+	const int port = relay_port_;
+	pthread_mutex_unlock(&start_mutex_);
+	return port;
+}
+
+char *http_relay_rewrite_uri(const char *uri) {
+	if (strncasecmp(uri, "http://", 7) != 0)
+		return strdup(uri);
+	const int port = ensure_relay();
+	if (port == 0)
+		return strdup(uri);
+	char prefix[64];
+	snprintf(prefix, sizeof(prefix), "http://127.0.0.1:%d/", port);
+	if (strncmp(uri, prefix, strlen(prefix)) == 0)
+		return strdup(uri);  // already relayed.
+
+	char *result = (char*) malloc(strlen(prefix) + strlen(RELAY_PATH)
+				      + 3 * strlen(uri) + 1);
+	char *out = result + sprintf(result, "%s%s", prefix, RELAY_PATH + 1);
+	const char *in;
+	for (in = uri; *in; ++in) {
+		const unsigned char c = *in;
+		if (isalnum(c) || strchr("-._~", c) != NULL) {
+			*out++ = c;
+		} else {
+			out += sprintf(out, "%%%02X", c);
+		}
+	}
+	*out = '\0';
+	return result;
+}
@@ -0,0 +1,41 @@
+/* http_relay.h - Local HTTP relay sharing one upstream fetch
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _HTTP_RELAY_H
+#define _HTTP_RELAY_H
+
+// Start the relay on 127.0.0.1:port. Each upstream http uri requested
+// through the relay is fetched once; all local players asking for it get
+// the bytes from a shared buffer.
+// If another renderer on this host already runs its relay on that port,
+// streams go through that one, so renderers given the same port share one
+// fetch per stream; if that renderer exits, the next stream takes the
+// port over.
+// Returns 0 on success; -1 if the port can't be used (e.g. something else
+// listens on it), in which case uris are left unchanged.
+int http_relay_start(int port);
+
+// Returns the uri the player should open for "uri": a relay uri for plain
+// http streams if the relay is running, an unchanged copy otherwise.
+// The caller has to free() the result.
+char *http_relay_rewrite_uri(const char *uri);
+
+#endif /* _HTTP_RELAY_H */
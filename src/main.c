@@ -54,6 +54,9 @@
 #include "git-version.h"
 #include "logging.h"
 #include "output.h"
+#include "state_export.h"
+#include "state_loop.h"
+#include "unix_control.h"
 #include "upnp_service.h"
 #include "upnp_control.h"
 #include "upnp_device.h"
@@ -68,6 +71,16 @@ static gboolean show_control_scpd = FALSE;
 static gboolean show_transport_scpd = FALSE;
 static gboolean show_outputs = FALSE;
 static gboolean daemon_mode = FALSE;
+static gboolean multicast_events = FALSE;
+static int max_subscriptions = 0;
+static int subscription_timeout = 0;
+static int event_queue_length = 0;
+static int event_queue_age = 0;
+static double action_rate_limit = 0;
+static int http_frontend_port = 0;
+static gboolean state_stream = FALSE;
+static const gchar *control_socket = NULL;
+static const gchar *state_shm = NULL;
 
 static const gchar *interface_name = NULL;
 static int listen_port = 49494;
@@ -105,6 +118,44 @@ static GOptionEntry option_entries[] = {
 	  "File the process ID should be written to.", NULL },
 	{ "daemon", 'd', 0, G_OPTION_ARG_NONE, &daemon_mode,
 	  "Run as daemon.", NULL },
+	{ "multicast-events", 0, 0, G_OPTION_ARG_NONE, &multicast_events,
+	  "Also send LastChange events to the UPnP 2.0 multicast eventing "
+	  "group; subscribers still get them by unicast.", NULL },
+	{ "max-subscriptions", 0, 0, G_OPTION_ARG_INT, &max_subscriptions,
+	  "Maximum number of event subscriptions accepted per service "
+	  "(default: no limit).", NULL },
+	{ "subscription-timeout", 0, 0, G_OPTION_ARG_INT, &subscription_timeout,
+	  "Maximum subscription lifetime in seconds; controllers that "
+	  "vanish without unsubscribing are dropped after this long, with "
+	  "--http-frontend-port already after 3 failed deliveries "
+	  "(default: as requested).", NULL },
+	{ "event-queue-length", 0, 0, G_OPTION_ARG_INT, &event_queue_length,
+	  "Maximum number of events queued per subscriber (default 10).",
+	  NULL },
+	{ "event-queue-age", 0, 0, G_OPTION_ARG_INT, &event_queue_age,
+	  "Maximum age in seconds of events queued per subscriber "
+	  "(default 30).", NULL },
+	{ "action-rate-limit", 0, 0, G_OPTION_ARG_DOUBLE, &action_rate_limit,
+	  "Actions per second and controller; Get* queries beyond that are "
+	  "answered from the last response, even if the state changed "
+	  "since (default 0: no limit).",
+	  NULL },
+	{ "http-frontend-port", 0, 0, G_OPTION_ARG_INT, &http_frontend_port,
+	  "Serve description, control and eventing on this port from an "
+	  "event driven server with keep-alive; libupnp then only does "
+	  "discovery (default 0: off).", NULL },
+	{ "state-stream", 0, 0, G_OPTION_ARG_NONE, &state_stream,
+	  "With --http-frontend-port, stream the state as JSON server-sent "
+	  "events at /state-stream for dashboards.", NULL },
+	{ "control-socket", 0, 0, G_OPTION_ARG_STRING, &control_socket,
+	  "Accept the compact binary control protocol of unix_control.h on "
+	  "this Unix socket, for local automation daemons. The socket "
+	  "gets mode 0600: only the user running gmediarender can "
+	  "connect.", NULL },
+	{ "state-shm", 0, 0, G_OPTION_ARG_STRING, &state_shm,
+	  "Publish track, position, state and volume in this POSIX shared "
+	  "memory segment (e.g. /gmediarender) for local monitors; see "
+	  "state_export.h.", NULL },
 	{ "mime-filter", 0, 0, G_OPTION_ARG_STRING, &mime_filter,
 	  "Filter the supported media types. "
 		"e.g. Audio only: '--mime-filter audio'. Disable FLAC: '--mime-filter -audio/x-flac'.", NULL },
@@ -181,10 +232,11 @@ static gboolean process_cmdline(int argc, char **argv)
 	return TRUE;
 }
 
-static void log_variable_change(void *userdata, int var_num,
+static void log_variable_change(void *userdata, int version, int var_num,
 				const char *variable_name,
 				const char *old_value,
 				const char *variable_value) {
+	(void)version;
 	(void)var_num;
 	(void)old_value;
 
@@ -297,6 +349,23 @@ int main(int argc, char **argv)
 			  listen_port);
 		return EXIT_FAILURE;
 	}
+	if (multicast_events) {
+		upnp_device_enable_multicast_events();
+	}
+	upnp_device_set_subscription_limits(max_subscriptions,
+					    subscription_timeout,
+					    event_queue_length,
+					    event_queue_age);
+	upnp_device_set_action_rate_limit(action_rate_limit);
+	if (http_frontend_port > 0) {
+		upnp_device_set_http_frontend(http_frontend_port);
+		upnp_device_set_state_stream(state_stream);
+	} else if (state_stream) {
+		fprintf(stderr, "--state-stream needs --http-frontend-port\n");
+		return EXIT_FAILURE;
+	}
+	// Actions coming in from now on wait for output_loop() below.
+	state_loop_init();
 	device = upnp_device_init(upnp_renderer, interface_name, listen_port);
 	if (device == NULL) {
 		Log_error("main", "ERROR: Failed to initialize UPnP device");
@@ -306,6 +375,16 @@ int main(int argc, char **argv)
 	upnp_transport_init(device);
 	upnp_control_init(device);
 
+	if (control_socket != NULL
+	    && unix_control_start(control_socket, device) != 0) {
+		Log_error("main", "ERROR: Failed to open control socket");
+		return EXIT_FAILURE;
+	}
+	if (state_shm != NULL && state_export_start(state_shm) != 0) {
+		Log_error("main", "ERROR: Failed to export state");
+		return EXIT_FAILURE;
+	}
+
 	if (show_devicedesc) {
 		// This can only be run after all services have been
 		// initialized.
@@ -316,10 +395,10 @@ int main(int argc, char **argv)
 	}
 
 	if (Log_info_enabled()) {
-		upnp_transport_register_variable_listener(log_variable_change,
-							  (void*) "transport");
-		upnp_control_register_variable_listener(log_variable_change,
-							(void*) "control");
+		upnp_transport_register_async_variable_listener(
+			log_variable_change, (void*) "transport");
+		upnp_control_register_async_variable_listener(
+			log_variable_change, (void*) "control");
 	}
 
 	// Write both to the log (which might be disabled) and console.
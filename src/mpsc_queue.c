@@ -0,0 +1,72 @@
+/* mpsc_queue.c - Lock-free multi-producer single-consumer queue
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mpsc_queue.h"
+
+#include <stddef.h>
+#include <glib.h>
+
+void mpsc_queue_init(struct mpsc_queue *queue) {
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node) {
+	g_atomic_pointer_set(&node->next, NULL);
+	struct mpsc_node *prev;
+	do {
+		prev = (struct mpsc_node*) g_atomic_pointer_get(&queue->head);
+	} while (!g_atomic_pointer_compare_and_exchange(&queue->head,
+							 prev, node));
+	g_atomic_pointer_set(&prev->next, node);
+}
+
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue) {
+	struct mpsc_node *tail = queue->tail;
+	struct mpsc_node *next
+		= (struct mpsc_node*) g_atomic_pointer_get(&tail->next);
+	if (tail == &queue->stub) {
+		if (next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = (struct mpsc_node*) g_atomic_pointer_get(&next->next);
+	}
+	if (next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+	if (tail != g_atomic_pointer_get(&queue->head))
+		return NULL;
+	// "tail" is the last one; put the stub behind it so it can go.
+	mpsc_queue_push(queue, &queue->stub);
+	next = (struct mpsc_node*) g_atomic_pointer_get(&tail->next);
+	if (next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+	return NULL;
+}
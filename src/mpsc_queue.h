@@ -0,0 +1,49 @@
+/* mpsc_queue.h - Lock-free multi-producer single-consumer queue
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _MPSC_QUEUE_H
+#define _MPSC_QUEUE_H
+
+// Intrusive multi-producer single-consumer queue after Dmitry Vyukov:
+// producers swap their node in as the head, then link the previous head
+// to it; the single consumer pops from the tail. Neither side takes a lock.
+// Embed a struct mpsc_node in the queued objects.
+
+struct mpsc_node {
+	struct mpsc_node *next;  // accessed atomically.
+};
+
+struct mpsc_queue {
+	struct mpsc_node stub;
+	struct mpsc_node *head;  // Last pushed; all producers.
+	struct mpsc_node *tail;  // Next to pop; consumer only.
+};
+
+void mpsc_queue_init(struct mpsc_queue *queue);
+
+// Can be called from any thread.
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node);
+
+// Consumer only. Returns NULL when empty, but also while a producer is
+// between swapping the head and linking it; retry once it's done.
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue);
+
+#endif /* _MPSC_QUEUE_H */
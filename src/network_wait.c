@@ -0,0 +1,169 @@
+/* network_wait.c - Wait until the network interface has an address
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "network_wait.h"
+
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "logging.h"
+
+gboolean network_is_ready(const char *interface_name) {
+	struct ifaddrs *addrs;
+	if (getifaddrs(&addrs) != 0)
+		return FALSE;
+	gboolean ready = FALSE;
+	for (struct ifaddrs *it = addrs; it && !ready; it = it->ifa_next) {
+		if (it->ifa_addr == NULL || it->ifa_addr->sa_family != AF_INET
+		    || !(it->ifa_flags & IFF_UP))
+			continue;
+		if (interface_name != NULL) {
+			ready = strcmp(it->ifa_name, interface_name) == 0;
+		} else {
+			ready = !(it->ifa_flags & IFF_LOOPBACK);
+		}
+	}
+	freeifaddrs(addrs);
+	return ready;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+// Whether the link of the interface (any but loopback if NULL) is running.
+static gboolean link_is_running(const char *interface_name) {
+	struct ifaddrs *addrs;
+	if (getifaddrs(&addrs) != 0)
+		return FALSE;
+	gboolean running = FALSE;
+	for (struct ifaddrs *it = addrs; it && !running; it = it->ifa_next) {
+		if (!(it->ifa_flags & IFF_RUNNING)
+		    || (it->ifa_flags & IFF_LOOPBACK))
+			continue;
+		running = (interface_name == NULL
+			   || strcmp(it->ifa_name, interface_name) == 0);
+	}
+	freeifaddrs(addrs);
+	return running;
+}
+
+// Returns TRUE if the link in the RTM_NEWLINK message "info" is one we
+// wait for.
+static gboolean is_our_link(const struct ifinfomsg *info,
+			    const char *interface_name) {
+	if (info->ifi_flags & IFF_LOOPBACK)
+		return FALSE;
+	if (interface_name == NULL)
+		return TRUE;
+	char name[IF_NAMESIZE];
+	return if_indextoname(info->ifi_index, name) != NULL
+		&& strcmp(name, interface_name) == 0;
+}
+
+gint64 network_wait_ready(const char *interface_name) {
+	// Subscribe first, so that we don't miss a change between looking
+	// and listening.
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			      NETLINK_ROUTE);
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		Log_error("network", "Can't listen to rtnetlink: %s; polling",
+			  strerror(errno));
+		if (fd >= 0) close(fd);
+		if (network_is_ready(interface_name))
+			return 0;
+		const gint64 start = g_get_monotonic_time();
+		while (!network_is_ready(interface_name)) {
+			sleep(1);
+		}
+		return start;
+	}
+	if (network_is_ready(interface_name)) {
+		close(fd);
+		return 0;
+	}
+	Log_info("network", "Waiting for an address on %s",
+		 interface_name ? interface_name : "any interface");
+	// If the link is up already, all we know is that it was before now.
+	// Otherwise it comes up with the first running RTM_NEWLINK.
+	gint64 link_up = g_get_monotonic_time();
+	gboolean link_down = !link_is_running(interface_name);
+	char buffer[8192];
+	while (!network_is_ready(interface_name)) {
+		ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+		if (len < 0) {
+			// ENOBUFS: we lost messages, but look anyway.
+			if (errno != EINTR && errno != ENOBUFS) {
+				Log_error("network", "rtnetlink: %s",
+					  strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+		for (struct nlmsghdr *msg = (struct nlmsghdr*) buffer;
+		     NLMSG_OK(msg, (size_t) len);
+		     msg = NLMSG_NEXT(msg, len)) {
+			if (msg->nlmsg_type != RTM_NEWLINK)
+				continue;
+			const struct ifinfomsg *info =
+				(const struct ifinfomsg*) NLMSG_DATA(msg);
+			if (!is_our_link(info, interface_name))
+				continue;
+			if (!(info->ifi_flags & IFF_RUNNING)) {
+				link_down = TRUE;
+			} else if (link_down) {
+				link_up = g_get_monotonic_time();
+				link_down = FALSE;
+			}
+		}
+	}
+	close(fd);
+	return link_up;
+}
+
+#else
+
+gint64 network_wait_ready(const char *interface_name) {
+	if (network_is_ready(interface_name))
+		return 0;
+	const gint64 start = g_get_monotonic_time();
+	while (!network_is_ready(interface_name)) {
+		sleep(1);
+	}
+	return start;
+}
+
+#endif
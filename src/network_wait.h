@@ -0,0 +1,38 @@
+/* network_wait.h - Wait until the network interface has an address
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _NETWORK_WAIT_H
+#define _NETWORK_WAIT_H
+
+#include <glib.h>
+
+// Returns TRUE if "interface_name", or any interface but loopback if it
+// is NULL, is up and has an IPv4 address, as UpnpInit2() needs it.
+gboolean network_is_ready(const char *interface_name);
+
+// Block until network_is_ready(), without a timeout; returns at once if it
+// is ready already. Woken up by rtnetlink as soon as an address appears;
+// polls once a second where there is no rtnetlink.
+// Returns the monotonic time the link came up (or we started waiting, if
+// it was up already), 0 if we didn't have to wait.
+gint64 network_wait_ready(const char *interface_name);
+
+#endif /* _NETWORK_WAIT_H */
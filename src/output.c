@@ -147,14 +147,15 @@ int output_add_options(GOptionContext *ctx)
 	return 0;
 }
 
-void output_set_uri(const char *uri, output_update_meta_cb_t meta_cb) {
+void output_set_uri(const char *uri, const char *didl,
+		    output_update_meta_cb_t meta_cb) {
 	if (output_module && output_module->set_uri) {
-		output_module->set_uri(uri, meta_cb);
+		output_module->set_uri(uri, didl, meta_cb);
 	}
 }
-void output_set_next_uri(const char *uri) {
+void output_set_next_uri(const char *uri, const char *didl) {
 	if (output_module && output_module->set_next_uri) {
-		output_module->set_next_uri(uri);
+		output_module->set_next_uri(uri, didl);
 	}
 }
 
@@ -217,3 +218,9 @@ int output_set_mute(int value) {
 	}
 	return -1;
 }
+int output_is_group_follower(void) {
+	if (output_module && output_module->is_group_follower) {
+		return output_module->is_group_follower();
+	}
+	return 0;
+}
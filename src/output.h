@@ -32,6 +32,8 @@
 enum PlayFeedback {
 	PLAY_STOPPED,
 	PLAY_STARTED_NEXT_STREAM,
+	PLAY_RECOVERING,   // Stream stalled or failed; trying to reopen it.
+	PLAY_RECOVERED,    // Playing again after PLAY_RECOVERING.
 };
 typedef void (*output_transition_cb_t)(enum PlayFeedback);
 
@@ -45,8 +47,11 @@ void output_dump_modules(void);
 
 int output_loop(void);
 
-void output_set_uri(const char *uri, output_update_meta_cb_t meta_info);
-void output_set_next_uri(const char *uri);
+// Set the uri to play. The DIDL-Lite meta data sent by the controller (might
+// be empty) gives the output hints about the resource, such as its size.
+void output_set_uri(const char *uri, const char *didl,
+		    output_update_meta_cb_t meta_info);
+void output_set_next_uri(const char *uri, const char *didl);
 
 int output_play(output_transition_cb_t done_callback);
 int output_stop(void);
@@ -58,5 +63,6 @@ int output_get_volume(float *v);
 int output_set_volume(float v);
 int output_get_mute(int *m);
 int output_set_mute(int m);
+int output_is_group_follower(void);
 
 #endif /* _OUTPUT_H */
@@ -37,12 +37,24 @@
 #include <unistd.h>
 #include <inttypes.h>
 
+#include "http_relay.h"
 #include "logging.h"
 #include "upnp_connmgr.h"
 #include "output_module.h"
 #include "output_gstreamer.h"
+#ifdef HAVE_GST_NET
+#include "output_gstreamer_group.h"
+#endif
 
 static double buffer_duration = 0.0; /* Buffer disbled by default, see #182 */
+static double buffer_max_duration = 0.0;
+static int buffer_low_watermark = 10;    /* percent */
+static int buffer_high_watermark = 100;  /* percent */
+static int download_max_mb = 0;          /* progressive download disabled */
+static double rewind_seconds = 0.0;      /* no rewind window */
+static int relay_port = 0;               /* no local relay */
+static int stall_timeout = 10;           /* seconds */
+static int idle_timeout = 0;             /* keep pipeline ready */
 
 static void scan_mime_list(void)
 {
@@ -123,8 +135,13 @@ static void scan_mime_list(void)
 }
 
 static GstElement *player_ = NULL;
+// Where volume and mute apply: the playbin, or the local receiver path in a
+// group.
+static GstElement *volume_element_ = NULL;
 static char *gsuri_ = NULL;         // locally strdup()ed
 static char *gs_next_uri_ = NULL;   // locally strdup()ed
+static struct SongResource uri_resource_;       // from DIDL of gsuri_
+static struct SongResource next_uri_resource_;  // from DIDL of gs_next_uri_
 static struct SongMetaData song_meta_;
 
 static output_transition_cb_t play_trans_callback_ = NULL;
@@ -136,6 +153,681 @@ struct track_time_info {
 };
 static struct track_time_info last_known_time_ = {0, 0};
 
+// Set while the controller wants us to play; buffering must not resume
+// playback if the user paused or stopped in the meantime.
+static gboolean play_requested_ = FALSE;
+
+// Rebuffering state. Once the fill level drops below the low watermark, we
+// pause and only resume when it is back to the high watermark; a level
+// hovering around a single threshold would otherwise flip the pipeline state
+// on every message.
+struct buffering_state {
+	gboolean active;          // Paused, waiting for the buffer to fill.
+	gboolean stream_started;  // Initial fill done; later stalls count.
+	gboolean stalled_in_stream;
+	gint64 stall_start;       // monotonic usec.
+	int rebuffer_count;
+	gint64 total_stall_usec;
+	double current_duration;  // Effective buffer duration in seconds.
+};
+static struct buffering_state buffering_ = { FALSE, FALSE, FALSE, 0, 0, 0, 0 };
+
+// Estimate of the network throughput, fed by the bytes leaving the source
+// element. Updated from the streaming thread, read from the main loop.
+// Only windows in which the source could push freely count: not those
+// spanning a pause in the data, nor those while the buffer was full and
+// throttled the source down to the bitrate of the stream.
+struct throughput_estimator {
+	GMutex mutex;
+	gint64 window_start;      // monotonic usec; 0 to start a new one.
+	gint64 window_bytes;
+	gint64 last_bytes_time;   // monotonic usec.
+	gboolean buffer_full;
+	gboolean window_throttled;  // Buffer was full during the window.
+	double bytes_per_sec;     // Smoothed; 0 if not known yet.
+	guint64 total_bytes;      // Ever received; tells the watchdog we
+				  // are still getting data.
+};
+static struct throughput_estimator throughput_;
+
+// The watchdog notices when a stream we should play makes no progress -
+// neither the position moves nor data arrives - for --gstout-stall-timeout
+// seconds, or when it fails with an error. It then reopens the uri with
+// exponential backoff and seeks back to where we were.
+struct recovery_state {
+	int attempts;             // > 0 while recovering.
+	guint retry_source;       // Pending reopen timer; 0 if none.
+	gboolean seek_pending;    // Seek to resume_position after preroll.
+	gint64 resume_position;
+	gint64 last_progress;     // monotonic usec.
+	gint64 last_position;
+	guint64 last_bytes;
+};
+static struct recovery_state recovery_ = { 0, 0, FALSE, 0, 0, -1, 0 };
+
+// Gapless transition to the next uri: playbin asks for it in about-to-finish,
+// but the new stream only becomes audible when its STREAM_START reaches the
+// sinks. We tell the controller then, and keep track of how far apart the
+// two are.
+struct transition_state {
+	gboolean pending;         // about-to-finish seen, waiting for start.
+	gint64 requested;         // monotonic usec of about-to-finish.
+	int count;
+	gint64 last_delay_usec;
+	gint64 total_delay_usec;
+};
+static struct transition_state transition_ = { FALSE, 0, 0, 0, 0 };
+
+// Not exported in a public header. Enables progressive download in
+// playbin, which lets uridecodebin keep the whole stream in a local buffer.
+#define GST_PLAY_FLAG_DOWNLOAD (1 << 7)
+
+// Bytes of the current stream we pull in completely; 0 if streamed normally.
+static gint64 download_size_ = 0;
+
+// Application messages the streaming threads post on the bus for the main
+// loop, which owns the state.
+static const char kNextStreamMessage[] = "gmrender-next-stream";
+static const char kDownloadSizeMessage[] = "gmrender-download-size";
+
+// Position of the current request's start in the track after a DLNA time
+// seek; the player's own positions are relative to it.
+static gint64 time_seek_offset_ = 0;
+// Time seek to request from the next http source set up; -1 if none.
+static gint64 pending_time_seek_ = -1;
+
+// Seeks while a rewind window is configured, and how many of them landed
+// in data we still had.
+struct rewind_stats {
+	int seeks;
+	int hits;
+};
+static struct rewind_stats rewind_stats_ = { 0, 0 };
+
+static void buffering_reset_stream(void) {
+	buffering_.active = FALSE;
+	buffering_.stream_started = FALSE;
+	buffering_.stalled_in_stream = FALSE;
+}
+
+static double get_throughput(void) {
+	g_mutex_lock(&throughput_.mutex);
+	const double result = throughput_.bytes_per_sec;
+	g_mutex_unlock(&throughput_.mutex);
+	return result;
+}
+
+static const gint64 kThroughputWindowUsec = 500000;
+
+static void throughput_restart_window_locked(gint64 now) {
+	throughput_.window_start = now;
+	throughput_.window_bytes = 0;
+	throughput_.window_throttled = throughput_.buffer_full;
+}
+
+// A stream starts or resumes; don't count the time data didn't flow.
+static void throughput_restart_window(void) {
+	g_mutex_lock(&throughput_.mutex);
+	throughput_.window_start = 0;
+	g_mutex_unlock(&throughput_.mutex);
+}
+
+// From buffering messages: whether the buffer is full, so the source can
+// only push as fast as we play.
+static void throughput_set_buffer_full(gboolean full) {
+	g_mutex_lock(&throughput_.mutex);
+	throughput_.buffer_full = full;
+	if (full) {
+		throughput_.window_throttled = TRUE;
+	}
+	g_mutex_unlock(&throughput_.mutex);
+}
+
+static void throughput_add_bytes(gsize bytes) {
+	static const double kSmoothing = 0.3;  // weight of newest window.
+	const gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&throughput_.mutex);
+	throughput_.total_bytes += bytes;
+	if (throughput_.window_start == 0
+	    || now - throughput_.last_bytes_time > kThroughputWindowUsec) {
+		// First data after a start or a gap.
+		throughput_restart_window_locked(now);
+	}
+	throughput_.last_bytes_time = now;
+	throughput_.window_bytes += bytes;
+	const gint64 elapsed = now - throughput_.window_start;
+	if (elapsed >= kThroughputWindowUsec) {
+		const double rate = 1e6 * throughput_.window_bytes / elapsed;
+		// A throttled window tells the bitrate, not the network.
+		if (!throughput_.window_throttled) {
+			throughput_.bytes_per_sec = (throughput_.bytes_per_sec <= 0)
+				? rate
+				: (kSmoothing * rate
+				   + (1 - kSmoothing) * throughput_.bytes_per_sec);
+		}
+		throughput_restart_window_locked(now);
+	}
+	g_mutex_unlock(&throughput_.mutex);
+}
+
+// How the player is set up for one stream. Worked out on the main loop and
+// applied wherever the uri is set: on the main loop, or for the next stream
+// in the streaming thread that emits about-to-finish. Immutable once
+// planned and reference counted, so threads can share them without locks.
+struct stream_settings {
+	gint refcount;
+	char *uri;                    // As given by the controller.
+	struct SongResource resource;
+	gint64 download_size;         // 0 if streamed.
+	gint64 download_in_use;       // Held by the stream still playing.
+	guint64 ring_size;            // Rewind window if streamed; 0 if none.
+	double buffer_duration;       // Seconds; <= 0 for playbin defaults.
+	gint buffer_size;             // Bytes; -1 for the playbin default.
+	double throughput;            // Bytes/sec the size is based on.
+};
+
+static struct stream_settings *
+stream_settings_ref(struct stream_settings *settings) {
+	g_atomic_int_inc(&settings->refcount);
+	return settings;
+}
+
+static void stream_settings_unref(struct stream_settings *settings) {
+	if (settings == NULL || !g_atomic_int_dec_and_test(&settings->refcount))
+		return;
+	free(settings->uri);
+	SongResource_clear(&settings->resource);
+	free(settings);
+}
+
+// Boxed type, so that bus messages can hold a reference.
+static GType stream_settings_get_type(void) {
+	static gsize type = 0;
+	if (g_once_init_enter(&type)) {
+		g_once_init_leave(&type, g_boxed_type_register_static(
+				  "GMRenderStreamSettings",
+				  (GBoxedCopyFunc) stream_settings_ref,
+				  (GBoxedFreeFunc) stream_settings_unref));
+	}
+	return type;
+}
+
+// Set while the source of the stream being set up has no res@size, so that
+// we learn the Content-Length from the server, with the download bytes
+// still held by the stream playing before it. Read in source-setup, which
+// may run in a streaming thread.
+static struct {
+	GMutex mutex;
+	gboolean enabled;
+	gint64 in_use;
+} content_length_probe_;
+
+// Buffer duration for the stream about to be started. It grows after streams
+// that stalled (up to --gstout-buffer-max-duration) and shrinks back after
+// clean ones.
+static double next_buffer_duration(void) {
+	double duration = buffering_.current_duration;
+	if (duration < buffer_duration) {
+		duration = buffer_duration;
+	}
+	if (buffer_max_duration > buffer_duration) {
+		if (buffering_.stalled_in_stream) {
+			duration *= 1.5;
+		} else if (buffering_.stream_started) {
+			duration *= 0.9;
+		}
+		duration = CLAMP(duration, buffer_duration,
+				 buffer_max_duration);
+	}
+	return duration;
+}
+
+// Returns the number of bytes a finite stream of the given size may use to
+// be downloaded completely, or 0 if it should be streamed. Streams of 2 GiB
+// or more are always streamed. The limit of
+// --gstout-download-max-mb is shared with the "in_use" bytes of a stream
+// that is still playing while the next one starts.
+static gint64 download_budget(gint64 size, gint64 in_use) {
+	if (download_max_mb <= 0 || size <= 0)
+		return 0;
+	const gint64 limit = (gint64)download_max_mb * 1024 * 1024;
+	// The buffer-size property of queue2 is a gint.
+	return (size <= limit - in_use && size <= G_MAXINT) ? size : 0;
+}
+
+// Size the buffer of "element" (playbin, or the uridecodebin inside it) to
+// hold the complete stream.
+static void configure_download(GstElement *element, gint64 size) {
+	g_object_set(G_OBJECT(element),
+		     "buffer-size", (gint) size,
+		     // No time limit; the size alone bounds the buffer.
+		     "buffer-duration", (gint64) 0,
+		     "ring-buffer-max-size", (guint64) size,
+		     NULL);
+}
+
+// Size in bytes of the ring buffer that keeps --gstout-rewind-seconds of
+// already played data of a stream with the given resource.
+static guint64 rewind_buffer_size(const struct SongResource *resource) {
+	if (rewind_seconds <= 0.0)
+		return 0;
+	// Without a hint, assume CD quality PCM, which no compressed
+	// stream exceeds.
+	double bytes_per_sec = 44100 * 2 * 2;
+	if (resource->size > 0 && resource->duration_ms > 0) {
+		bytes_per_sec = 1000.0 * resource->size
+			/ resource->duration_ms;
+	}
+	return (guint64) (rewind_seconds * bytes_per_sec);
+}
+
+// Work out the settings for "uri". Streams are downloaded completely or
+// streamed based on the res@size of their DIDL meta data; streams without
+// a size hint are decided in check_content_length() once the server told
+// us. "in_use" are the bytes still held by a previous stream that keeps
+// playing.
+//
+// Streams that are not downloaded completely keep a window of the most
+// recent data in a ring buffer if --gstout-rewind-seconds is set
+// ("timeshift" buffering), so seeking back within it does not refetch
+// from the server. Their buffer is sized to hold the buffer duration at
+// the currently measured throughput.
+static struct stream_settings *plan_stream(const char *uri,
+					   const struct SongResource *resource,
+					   gint64 in_use) {
+	struct stream_settings *settings =
+		(struct stream_settings*) calloc(1, sizeof(*settings));
+	settings->refcount = 1;
+	settings->uri = uri ? strdup(uri) : NULL;
+	settings->resource.size = resource->size;
+	settings->resource.duration_ms = resource->duration_ms;
+	settings->resource.protocol_info = (resource->protocol_info
+					    ? strdup(resource->protocol_info)
+					    : NULL);
+	settings->download_size = download_budget(resource->size, in_use);
+	settings->download_in_use = in_use;
+	settings->ring_size = rewind_buffer_size(resource);
+	settings->buffer_duration = -1;
+	settings->buffer_size = -1;  // playbin default.
+	if (settings->download_size == 0 && buffer_duration > 0.0) {
+		settings->buffer_duration = next_buffer_duration();
+		settings->throughput = get_throughput();
+		if (settings->throughput > 0) {
+			static const double kMinSize = 64 * 1024;
+			static const double kMaxSize = 64 * 1024 * 1024;
+			// Some headroom, as the rate is measured while
+			// catching up.
+			settings->buffer_size =
+				CLAMP(1.5 * settings->throughput
+				      * settings->buffer_duration,
+				      kMinSize, kMaxSize);
+		}
+	}
+	return settings;
+}
+
+// Point the player to the stream. Only sets properties of playbin, so it
+// can be called from any thread.
+static void apply_stream_settings(const struct stream_settings *settings) {
+	if (download_max_mb > 0 || rewind_seconds > 0.0) {
+		gint flags = 0;
+		g_object_get(G_OBJECT(player_), "flags", &flags, NULL);
+		if (settings->download_size > 0) {
+			Log_info("gstreamer", "Downloading %" PRId64 " bytes "
+				 "completely.", settings->download_size);
+			configure_download(player_, settings->download_size);
+			flags |= GST_PLAY_FLAG_DOWNLOAD;
+		} else if (settings->ring_size > 0) {
+			g_object_set(G_OBJECT(player_), "ring-buffer-max-size",
+				     settings->ring_size, NULL);
+			flags |= GST_PLAY_FLAG_DOWNLOAD;
+		} else {
+			g_object_set(G_OBJECT(player_),
+				     "ring-buffer-max-size", (guint64) 0, NULL);
+			flags &= ~GST_PLAY_FLAG_DOWNLOAD;
+		}
+		g_object_set(G_OBJECT(player_), "flags", flags, NULL);
+	}
+	if (settings->download_size == 0) {
+		if (settings->buffer_duration <= 0.0) {
+			g_object_set(G_OBJECT(player_),
+				     "buffer-duration", (gint64) -1,
+				     "buffer-size", (gint) -1,
+				     NULL);
+		} else {
+			const gint64 duration_ns =
+				round(settings->buffer_duration * 1.0e9);
+			Log_info("gstreamer", "Buffer for next stream: %"
+				 PRId64 "ms, %d bytes (throughput %.0f "
+				 "kbit/s)", duration_ns / 1000000,
+				 settings->buffer_size,
+				 settings->throughput * 8 / 1000);
+			g_object_set(G_OBJECT(player_),
+				     "buffer-duration", duration_ns,
+				     "buffer-size", settings->buffer_size,
+				     NULL);
+		}
+	}
+	g_mutex_lock(&content_length_probe_.mutex);
+	content_length_probe_.enabled =
+		download_max_mb > 0 && settings->resource.size < 0;
+	content_length_probe_.in_use = settings->download_in_use;
+	g_mutex_unlock(&content_length_probe_.mutex);
+	char *uri = http_relay_rewrite_uri(settings->uri);
+	g_object_set(G_OBJECT(player_), "uri", uri, NULL);
+	free(uri);
+}
+
+// Main loop state of the stream the settings were applied for.
+static void commit_stream_settings(const struct stream_settings *settings) {
+	download_size_ = settings->download_size;
+	if (settings->buffer_duration > 0.0) {
+		buffering_.current_duration = settings->buffer_duration;
+	}
+	buffering_reset_stream();
+}
+
+// The next stream, planned ahead on the main loop for about-to-finish,
+// which playbin emits from a streaming thread. The slot holds a reference;
+// it is only ever exchanged as a whole, and whoever takes a plan out owns
+// that reference. So the main loop can replace the plan at any time, even
+// while the streaming thread takes it, without either side locking or
+// touching a plan the other one freed.
+static struct stream_settings *next_stream_ = NULL;
+
+static struct stream_settings *
+exchange_next_stream(struct stream_settings *replacement) {
+#if GLIB_CHECK_VERSION(2, 74, 0)
+	return (struct stream_settings*)
+		g_atomic_pointer_exchange(&next_stream_, replacement);
+#else
+	struct stream_settings *old;
+	do {
+		old = (struct stream_settings*)
+			g_atomic_pointer_get(&next_stream_);
+	} while (!g_atomic_pointer_compare_and_exchange(&next_stream_, old,
+							replacement));
+	return old;
+#endif
+}
+
+// (Re)plan the next stream with what we know now. Called when it is set,
+// when the current one changes, and periodically as the measured
+// throughput moves.
+static void plan_next_stream(void) {
+	struct stream_settings *settings = NULL;
+	if (gs_next_uri_ != NULL) {
+		settings = plan_stream(gs_next_uri_, &next_uri_resource_,
+				       download_size_);
+	}
+	stream_settings_unref(exchange_next_stream(settings));
+}
+
+// Point the player to gsuri_ and configure buffering for it. "download_in_use"
+// are the bytes still held by a previous stream that keeps playing.
+static void set_player_uri(gint64 download_in_use) {
+	struct stream_settings *settings =
+		plan_stream(gsuri_, &uri_resource_, download_in_use);
+	apply_stream_settings(settings);
+	commit_stream_settings(settings);
+	stream_settings_unref(settings);
+	time_seek_offset_ = 0;
+	plan_next_stream();
+}
+
+// The watermarks are percentages of the buffer size. In download mode the
+// buffer holds the whole track, so scale them to still only wait for about
+// --gstout-buffer-duration worth of data.
+static void get_buffer_watermarks(int *low, int *high) {
+	*low = buffer_low_watermark;
+	*high = buffer_high_watermark;
+	if (download_size_ <= 0)
+		return;
+	static const double kAssumedTrackSeconds = 300;
+	const double track_seconds = (uri_resource_.duration_ms > 0
+				      ? uri_resource_.duration_ms / 1000.0
+				      : kAssumedTrackSeconds);
+	*high = CLAMP(ceil(100 * buffer_duration / track_seconds), 1, 100);
+	*low = *high * buffer_low_watermark / buffer_high_watermark;
+}
+
+// Called for each buffering message with the current fill level.
+static void handle_buffering_level(gint percent) {
+	throughput_set_buffer_full(percent >= 100);
+	int low_watermark, high_watermark;
+	get_buffer_watermarks(&low_watermark, &high_watermark);
+	if (!buffering_.active) {
+		if (percent >= low_watermark || !play_requested_)
+			return;
+		buffering_.active = TRUE;
+		buffering_.stall_start = g_get_monotonic_time();
+		if (buffering_.stream_started) {
+			buffering_.rebuffer_count++;
+			buffering_.stalled_in_stream = TRUE;
+		}
+		Log_info("gstreamer", "Buffer at %d%%; pausing until %d%%",
+			 percent, high_watermark);
+		gst_element_set_state(player_, GST_STATE_PAUSED);
+	} else if (percent >= high_watermark) {
+		buffering_.active = FALSE;
+		const gint64 stall = (g_get_monotonic_time()
+				      - buffering_.stall_start);
+		if (buffering_.stream_started) {
+			buffering_.total_stall_usec += stall;
+			Log_info("gstreamer", "Rebuffered after %.1fs "
+				 "(rebuffers: %d; total stall time: %.1fs)",
+				 stall / 1e6, buffering_.rebuffer_count,
+				 buffering_.total_stall_usec / 1e6);
+		} else {
+			Log_info("gstreamer", "Initial buffering took %.1fs",
+				 stall / 1e6);
+		}
+		buffering_.stream_started = TRUE;
+		if (play_requested_) {
+			gst_element_set_state(player_, GST_STATE_PLAYING);
+		}
+	}
+}
+
+#if (GST_VERSION_MAJOR >= 1)
+static GstPadProbeReturn count_source_bytes(GstPad *pad,
+					    GstPadProbeInfo *info,
+					    gpointer userdata) {
+	(void)pad;
+	(void)userdata;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if (buffer != NULL) {
+		throughput_add_bytes(gst_buffer_get_size(buffer));
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+// The HTTP session of souphttpsrc, published by the first source that
+// created one. Handing it to every new source lets connections to the
+// media server be reused across tracks and seeks instead of resolving and
+// connecting again each time.
+static const char kHttpSessionContext[] = "gst.soup.session";
+static GMutex http_session_mutex_;
+static GstContext *http_session_ = NULL;
+
+static void remember_http_session(GstMessage *msg) {
+	GstContext *context = NULL;
+	gst_message_parse_have_context(msg, &context);
+	if (context == NULL)
+		return;
+	if (strcmp(gst_context_get_context_type(context),
+		   kHttpSessionContext) == 0) {
+		g_mutex_lock(&http_session_mutex_);
+		if (http_session_ == NULL) {
+			http_session_ = gst_context_ref(context);
+		}
+		g_mutex_unlock(&http_session_mutex_);
+	}
+	gst_context_unref(context);
+}
+
+// Let a newly created http source use the shared session and keep its
+// connection open after the request.
+static void share_http_session(GstElement *source) {
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(source),
+					 "keep-alive") == NULL) {
+		return;  // Not an http source.
+	}
+	g_object_set(G_OBJECT(source), "keep-alive", TRUE, NULL);
+	g_mutex_lock(&http_session_mutex_);
+	if (http_session_ != NULL) {
+		gst_element_set_context(source, http_session_);
+	}
+	g_mutex_unlock(&http_session_mutex_);
+}
+
+// One-shot probe on the first buffer of a stream without a res@size hint:
+// by now the server told the source the Content-Length. The uridecodebin
+// around the source has not set up its buffer yet, so we can still switch
+// it to download mode.
+static GstPadProbeReturn check_content_length(GstPad *pad,
+					      GstPadProbeInfo *info,
+					      gpointer userdata) {
+	(void)info;
+	const gint64 in_use = *(const gint64*) userdata;
+	GstElement *source = gst_pad_get_parent_element(pad);
+	if (source == NULL)
+		return GST_PAD_PROBE_REMOVE;
+	gint64 length = -1;
+	GstObject *decodebin = gst_object_get_parent(GST_OBJECT(source));
+	if (decodebin != NULL
+	    && gst_element_query_duration(source, GST_FORMAT_BYTES, &length)) {
+		const gint64 size = download_budget(length, in_use);
+		if (size > 0) {
+			Log_info("gstreamer", "Content-Length %" PRId64
+				 "; downloading completely.", size);
+			configure_download(GST_ELEMENT(decodebin), size);
+			g_object_set(G_OBJECT(decodebin), "download", TRUE,
+				     NULL);
+			gst_element_post_message(
+				player_, gst_message_new_application(
+					GST_OBJECT(player_),
+					gst_structure_new(kDownloadSizeMessage,
+							  "size", G_TYPE_INT64,
+							  size, NULL)));
+		}
+	}
+	if (decodebin != NULL) gst_object_unref(decodebin);
+	gst_object_unref(source);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+// Ask the server to start the stream at the given position.
+static void request_time_seek(GstElement *source, gint64 position_nanos) {
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(source),
+					 "extra-headers") == NULL) {
+		return;
+	}
+	char range[32];
+	snprintf(range, sizeof(range), "npt=%.3f-", position_nanos / 1e9);
+	GstStructure *headers =
+		gst_structure_new("extra-headers",
+				  "TimeSeekRange.dlna.org", G_TYPE_STRING, range,
+				  NULL);
+	g_object_set(G_OBJECT(source), "extra-headers", headers, NULL);
+	gst_structure_free(headers);
+}
+
+// playbin created the source element for a new uri. Hook into it to
+// measure how fast data arrives.
+static void setup_source(GstElement *playbin, GstElement *source,
+			 gpointer userdata) {
+	(void)playbin;
+	(void)userdata;
+	GstPad *pad = gst_element_get_static_pad(source, "src");
+	if (pad == NULL)
+		return;
+	throughput_restart_window();
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+			  count_source_bytes, NULL, NULL);
+	g_mutex_lock(&content_length_probe_.mutex);
+	if (content_length_probe_.enabled) {
+		gint64 *in_use = g_new(gint64, 1);
+		*in_use = content_length_probe_.in_use;
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				  check_content_length, in_use, g_free);
+	}
+	g_mutex_unlock(&content_length_probe_.mutex);
+	gst_object_unref(pad);
+	share_http_session(source);
+	if (pending_time_seek_ >= 0) {
+		request_time_seek(source, pending_time_seek_);
+		pending_time_seek_ = -1;
+	}
+}
+
+// Pipeline sending a HEAD request for the next uri while the current track
+// still plays. It leaves a resolved and connected keep-alive connection in
+// the shared session, so the next track does not wait for the server to
+// accept a new one. Only touched from the main loop.
+static GstElement *prewarm_ = NULL;
+
+static void prewarm_stop(void) {
+	if (prewarm_ == NULL)
+		return;
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(prewarm_));
+	gst_bus_remove_watch(bus);
+	gst_object_unref(bus);
+	gst_element_set_state(prewarm_, GST_STATE_NULL);
+	gst_object_unref(prewarm_);
+	prewarm_ = NULL;
+}
+
+static gboolean prewarm_bus_callback(GstBus *bus, GstMessage *msg,
+				     gpointer data) {
+	(void)bus;
+	(void)data;
+	switch (GST_MESSAGE_TYPE(msg)) {
+	case GST_MESSAGE_HAVE_CONTEXT:
+		remember_http_session(msg);
+		break;
+	case GST_MESSAGE_EOS:
+	case GST_MESSAGE_ERROR:  // e.g. server refusing HEAD; still connected.
+		prewarm_stop();
+		return FALSE;
+	default:
+		break;
+	}
+	return TRUE;
+}
+
+// Idle callback; takes ownership of the strdup()ed uri.
+static gboolean prewarm_connection(gpointer userdata) {
+	char *uri = (char *) userdata;
+	prewarm_stop();
+	GstElement *source = gst_element_make_from_uri(GST_URI_SRC, uri,
+							NULL, NULL);
+	free(uri);
+	if (source == NULL)
+		return FALSE;
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(source),
+					 "method") == NULL) {
+		gst_object_unref(source);  // Can't just ask for headers.
+		return FALSE;
+	}
+	share_http_session(source);
+	g_object_set(G_OBJECT(source), "method", "HEAD", NULL);
+	GstElement *sink = gst_element_factory_make("fakesink", NULL);
+	if (sink == NULL) {
+		gst_object_unref(source);
+		return FALSE;
+	}
+	prewarm_ = gst_pipeline_new("prewarm");
+	gst_bin_add_many(GST_BIN(prewarm_), source, sink, NULL);
+	gst_element_link(source, sink);
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(prewarm_));
+	gst_bus_add_watch(bus, prewarm_bus_callback, NULL);
+	gst_object_unref(bus);
+	gst_element_set_state(prewarm_, GST_STATE_PLAYING);
+	return FALSE;
+}
+#endif
+
 static GstState get_current_player_state() {
 	GstState state = GST_STATE_PLAYING;
 	GstState pending = GST_STATE_NULL;
@@ -143,30 +835,289 @@ static GstState get_current_player_state() {
 	return state;
 }
 
-static void output_gstreamer_set_next_uri(const char *uri) {
+static void output_gstreamer_set_next_uri(const char *uri, const char *didl) {
 	Log_info("gstreamer", "Set next uri to '%s'", uri);
 	free(gs_next_uri_);
 	gs_next_uri_ = (uri && *uri) ? strdup(uri) : NULL;
+	SongResource_clear(&next_uri_resource_);
+	SongResource_parse_DIDL(&next_uri_resource_, didl);
+	plan_next_stream();
+#if (GST_VERSION_MAJOR >= 1)
+	if (gs_next_uri_ != NULL && g_str_has_prefix(gs_next_uri_, "http")) {
+		g_idle_add(prewarm_connection, strdup(gs_next_uri_));
+	}
+#endif
 }
 
-static void output_gstreamer_set_uri(const char *uri,
+static void output_gstreamer_set_uri(const char *uri, const char *didl,
 				     output_update_meta_cb_t meta_cb) {
 	Log_info("gstreamer", "Set uri to '%s'", uri);
 	free(gsuri_);
 	gsuri_ = (uri && *uri) ? strdup(uri) : NULL;
+	SongResource_clear(&uri_resource_);
+	SongResource_parse_DIDL(&uri_resource_, didl);
 	meta_update_callback_ = meta_cb;
 	SongMetaData_clear(&song_meta_);
 }
 
-static int output_gstreamer_play(output_transition_cb_t callback) {
-	play_trans_callback_ = callback;
+static gboolean query_position(gint64 *position) {
+#if (GST_VERSION_MAJOR < 1)
+	GstFormat fmt = GST_FORMAT_TIME;
+	return gst_element_query_position(player_, &fmt, position);
+#else
+	return gst_element_query_position(player_, GST_FORMAT_TIME, position);
+#endif
+}
+
+static gboolean query_duration(gint64 *duration) {
+#if (GST_VERSION_MAJOR < 1)
+	GstFormat fmt = GST_FORMAT_TIME;
+	return gst_element_query_duration(player_, &fmt, duration);
+#else
+	return gst_element_query_duration(player_, GST_FORMAT_TIME, duration);
+#endif
+}
+
+// The position at a point in monotonic time and how fast it advances from
+// there, so that the position can be computed without asking the pipeline.
+// Writers are serialized by the mutex; readers don't lock but retry while
+// the sequence number is odd (being written) or changed under them.
+struct position_anchor {
+	GMutex write_mutex;
+	volatile gint seq;
+	gint64 position;          // nanoseconds.
+	gint64 duration;          // nanoseconds; 0 if unknown.
+	gint64 mono_usec;
+	double rate;              // 0 while not playing.
+};
+static struct position_anchor anchor_;
+
+static void write_position_anchor(gint64 position, gint64 duration,
+				  double rate) {
+	g_mutex_lock(&anchor_.write_mutex);
+	g_atomic_int_inc(&anchor_.seq);
+	anchor_.position = position;
+	anchor_.duration = duration;
+	anchor_.mono_usec = g_get_monotonic_time();
+	anchor_.rate = rate;
+	g_atomic_int_inc(&anchor_.seq);
+	g_mutex_unlock(&anchor_.write_mutex);
+}
+
+static void read_position_anchor(gint64 *position, gint64 *duration,
+				 double *rate) {
+	gint seq;
+	gint64 anchor_position, mono_usec;
+	do {
+		seq = g_atomic_int_get(&anchor_.seq);
+		anchor_position = anchor_.position;
+		*duration = anchor_.duration;
+		mono_usec = anchor_.mono_usec;
+		*rate = anchor_.rate;
+	} while ((seq & 1) || seq != g_atomic_int_get(&anchor_.seq));
+	*position = anchor_position
+		+ (gint64) (*rate * (g_get_monotonic_time() - mono_usec) * 1000);
+	if (*duration > 0 && *position > *duration)
+		*position = *duration;
+}
+
+// Duration announced in the DIDL of the current uri; 0 if unknown.
+static gint64 resource_duration(void) {
+	return (uri_resource_.duration_ms > 0)
+		? uri_resource_.duration_ms * GST_MSECOND : 0;
+}
+
+// Re-anchor to the pipeline. It only answers position queries reliably
+// while playing; otherwise we stop where we extrapolated to.
+static void update_position_anchor(void) {
+	gint64 position, duration;
+	double rate;
+	read_position_anchor(&position, &duration, &rate);
+	const gboolean playing =
+		(get_current_player_state() == GST_STATE_PLAYING);
+	if (playing) {
+		gint64 value;
+		if (query_position(&value)) position = value;
+		if (query_duration(&value) && value > 0) duration = value;
+	}
+	write_position_anchor(position, duration, playing ? 1.0 : 0.0);
+}
+
+// Jump to a new position in the current stream, e.g. after a seek.
+static void move_position_anchor(gint64 position) {
+	gint64 old_position, duration;
+	double rate;
+	read_position_anchor(&old_position, &duration, &rate);
+	write_position_anchor(position, duration, rate);
+}
+
+static gboolean resync_position(gpointer userdata) {
+	(void)userdata;
+	if (get_current_player_state() == GST_STATE_PLAYING) {
+		update_position_anchor();
+	}
+	if (gs_next_uri_ != NULL) {
+		plan_next_stream();  // Throughput or stalls may have changed.
+	}
+	return TRUE;
+}
+
+// After --gstout-idle-timeout seconds stopped, the pipeline goes to NULL,
+// which closes the audio device and frees decoders and buffers. The next
+// play brings it back.
+static gboolean pipeline_idle_ = FALSE;
+static guint idle_source_ = 0;
+
+// Resident set size in kB, or -1 if not available.
+static long resident_kb(void) {
+	long size = 0, resident = -1;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm == NULL)
+		return -1;
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(statm);
+	return (resident < 0) ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static gboolean go_idle(gpointer userdata) {
+	(void)userdata;
+	idle_source_ = 0;
+	if (play_requested_ || pipeline_idle_)
+		return FALSE;
+	const long active_kb = resident_kb();
+	if (gst_element_set_state(player_, GST_STATE_NULL) ==
+	    GST_STATE_CHANGE_FAILURE) {
+		return FALSE;
+	}
+	pipeline_idle_ = TRUE;
+	Log_info("gstreamer", "Idle; released pipeline. Resident memory "
+		 "active: %ld kB, idle: %ld kB", active_kb, resident_kb());
+	return FALSE;
+}
+
+static void cancel_idle(void) {
+	if (idle_source_ != 0) {
+		g_source_remove(idle_source_);
+		idle_source_ = 0;
+	}
+}
+
+static void schedule_idle(void) {
+	if (idle_timeout <= 0)
+		return;
+	cancel_idle();
+	idle_source_ = g_timeout_add_seconds(idle_timeout, go_idle, NULL);
+}
+
+static void cancel_recovery(void) {
+	if (recovery_.retry_source != 0) {
+		g_source_remove(recovery_.retry_source);
+		recovery_.retry_source = 0;
+	}
+	recovery_.attempts = 0;
+	recovery_.seek_pending = FALSE;
+	recovery_.last_progress = g_get_monotonic_time();
+}
+
+static gboolean reopen_stream(gpointer userdata) {
+	(void)userdata;
+	recovery_.retry_source = 0;
+	recovery_.last_progress = g_get_monotonic_time();
+	if (gsuri_ == NULL || !play_requested_) {
+		cancel_recovery();
+		return FALSE;
+	}
+	Log_info("gstreamer", "Reopening '%s' (attempt %d)",
+		 gsuri_, recovery_.attempts);
+	gst_element_set_state(player_, GST_STATE_READY);
+	set_player_uri(0);
+	// Endless streams have no duration; nothing to go back to.
+	recovery_.seek_pending = (recovery_.resume_position > 0
+				  && last_known_time_.duration > 0);
+	gst_element_set_state(player_, recovery_.seek_pending
+			      ? GST_STATE_PAUSED : GST_STATE_PLAYING);
+	return FALSE;
+}
+
+static void schedule_recovery(void) {
+	static const int kMaxAttempts = 8;
+	static const guint kMaxDelaySeconds = 30;
+	if (recovery_.attempts >= kMaxAttempts) {
+		Log_error("gstreamer", "Giving up on '%s'", gsuri_);
+		cancel_recovery();
+		play_requested_ = FALSE;
+		gst_element_set_state(player_, GST_STATE_READY);
+		schedule_idle();
+		if (play_trans_callback_) {
+			play_trans_callback_(PLAY_STOPPED);
+		}
+		return;
+	}
+	if (recovery_.attempts == 0) {
+		recovery_.resume_position = last_known_time_.position;
+		if (play_trans_callback_) {
+			play_trans_callback_(PLAY_RECOVERING);
+		}
+	}
+	const guint delay = MIN(1u << recovery_.attempts, kMaxDelaySeconds);
+	recovery_.attempts++;
+	Log_info("gstreamer", "Reopening stream in %us", delay);
+	recovery_.retry_source = g_timeout_add_seconds(delay, reopen_stream,
+						       NULL);
+}
+
+static gboolean watchdog_tick(gpointer userdata) {
+	(void)userdata;
+	const gint64 now = g_get_monotonic_time();
+	if (!play_requested_ || recovery_.retry_source != 0) {
+		recovery_.last_progress = now;
+		return TRUE;
+	}
+	g_mutex_lock(&throughput_.mutex);
+	const guint64 bytes = throughput_.total_bytes;
+	g_mutex_unlock(&throughput_.mutex);
+	gint64 position = -1;
+	const gboolean moving = (get_current_player_state() == GST_STATE_PLAYING
+				 && query_position(&position)
+				 && position != recovery_.last_position);
+	if (moving) {
+		recovery_.last_position = position;
+		if (recovery_.attempts > 0) {
+			Log_info("gstreamer", "Stream recovered.");
+			cancel_recovery();
+			if (play_trans_callback_) {
+				play_trans_callback_(PLAY_RECOVERED);
+			}
+		}
+	}
+	if (moving || bytes != recovery_.last_bytes) {
+		recovery_.last_bytes = bytes;
+		recovery_.last_progress = now;
+	} else if (now - recovery_.last_progress
+		   >= stall_timeout * G_USEC_PER_SEC) {
+		Log_error("gstreamer", "No progress for %ds.", stall_timeout);
+		schedule_recovery();
+	}
+	return TRUE;
+}
+
+static int start_playback(void) {
 	if (get_current_player_state() != GST_STATE_PAUSED) {
 		if (gst_element_set_state(player_, GST_STATE_READY) ==
 		    GST_STATE_CHANGE_FAILURE) {
 			Log_error("gstreamer", "setting play state failed (1)");
 			// Error, but continue; can't get worse :)
 		}
-		g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
+		transition_.pending = FALSE;
+		set_player_uri(0);
+		write_position_anchor(0, resource_duration(), 0);
+#ifdef HAVE_GST_NET
+		output_gstreamer_group_flush();
+#endif
+	} else if (buffering_.active) {
+		// Still filling up; handle_buffering_level() resumes.
+		return 0;
 	}
 	if (gst_element_set_state(player_, GST_STATE_PLAYING) ==
 	    GST_STATE_CHANGE_FAILURE) {
@@ -176,7 +1127,47 @@ static int output_gstreamer_play(output_transition_cb_t callback) {
 	return 0;
 }
 
+static gboolean wake_from_idle(gpointer userdata) {
+	(void)userdata;
+	if (!pipeline_idle_ || !play_requested_)
+		return FALSE;
+	pipeline_idle_ = FALSE;
+	Log_info("gstreamer", "Waking up pipeline.");
+	start_playback();
+	return FALSE;
+}
+
+static int output_gstreamer_play(output_transition_cb_t callback) {
+#ifdef HAVE_GST_NET
+	output_gstreamer_group_play();
+#endif
+	play_trans_callback_ = callback;
+	play_requested_ = TRUE;
+	throughput_restart_window();
+	cancel_recovery();
+	cancel_idle();
+	if (pipeline_idle_) {
+		// Opening the audio device again can take a while; answer the
+		// action first. This still runs on the main loop, so actions
+		// arriving meanwhile wait for it.
+		g_idle_add(wake_from_idle, NULL);
+		return 0;
+	}
+	return start_playback();
+}
+
 static int output_gstreamer_stop(void) {
+#ifdef HAVE_GST_NET
+	output_gstreamer_group_stop();
+#endif
+	play_requested_ = FALSE;
+	transition_.pending = FALSE;
+	cancel_recovery();
+	buffering_.active = FALSE;
+	if (pipeline_idle_) {
+		return 0;
+	}
+	schedule_idle();
 	if (gst_element_set_state(player_, GST_STATE_READY) ==
 	    GST_STATE_CHANGE_FAILURE) {
 		return -1;
@@ -186,6 +1177,15 @@ static int output_gstreamer_stop(void) {
 }
 
 static int output_gstreamer_pause(void) {
+#ifdef HAVE_GST_NET
+	output_gstreamer_group_pause();
+#endif
+	play_requested_ = FALSE;
+	cancel_recovery();
+	// Paused holds the pipeline again: a queued wake-up must not restart
+	// it, and a later Stop must take it back down to READY.
+	cancel_idle();
+	pipeline_idle_ = FALSE;
 	if (gst_element_set_state(player_, GST_STATE_PAUSED) ==
 	    GST_STATE_CHANGE_FAILURE) {
 		return -1;
@@ -194,15 +1194,127 @@ static int output_gstreamer_pause(void) {
 	}
 }
 
-static int output_gstreamer_seek(gint64 position_nanos) {
+// Returns whether the given position is still held in the player's buffer.
+static gboolean is_position_buffered(gint64 position_nanos) {
+	// After a time seek, the player only holds the rest of the track.
+	const gint64 duration = last_known_time_.duration - time_seek_offset_;
+	position_nanos -= time_seek_offset_;
+	if (duration <= 0 || position_nanos < 0 || position_nanos > duration)
+		return FALSE;
+	// Ranges are reliably reported in percent only.
+	const gint64 position = gst_util_uint64_scale(position_nanos,
+						      GST_FORMAT_PERCENT_MAX,
+						      duration);
+	gboolean result = FALSE;
+	GstQuery *query = gst_query_new_buffering(GST_FORMAT_PERCENT);
+	if (gst_element_query(player_, query)) {
+		const guint count = gst_query_get_n_buffering_ranges(query);
+		for (guint i = 0; i < count && !result; ++i) {
+			gint64 start = 0, stop = 0;
+			if (gst_query_parse_nth_buffering_range(query, i,
+								&start, &stop)) {
+				result = (position >= start && position <= stop);
+			}
+		}
+	}
+	gst_query_unref(query);
+	return result;
+}
+
+#if (GST_VERSION_MAJOR >= 1)
+// Restart the stream with the server positioning it, using a single
+// request with a TimeSeekRange.dlna.org header. The relay does not forward
+// that header, so this goes to the server directly.
+static int seek_by_time_request(gint64 position_nanos) {
+	const GstState state = get_current_player_state();
+	if (gst_element_set_state(player_, GST_STATE_READY) ==
+	    GST_STATE_CHANGE_FAILURE) {
+		return -1;
+	}
+	pipeline_idle_ = FALSE;  // Brought back below, if it was released.
+	Log_info("gstreamer", "Time seek request to %.1fs",
+		 position_nanos / 1e9);
+	pending_time_seek_ = position_nanos;
+	time_seek_offset_ = position_nanos;
+	move_position_anchor(0);
+	buffering_reset_stream();
+	g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
+	if (gst_element_set_state(player_, (state == GST_STATE_PLAYING)
+				  ? GST_STATE_PLAYING : GST_STATE_PAUSED) ==
+	    GST_STATE_CHANGE_FAILURE) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+// Seek to the byte offset the position corresponds to at the average bit
+// rate of the resource. The source serves this with one range request;
+// a time seek would have the demuxer search for the position instead.
+static int seek_by_byte_offset(gint64 position_nanos) {
+	const gint64 offset = gst_util_uint64_scale(position_nanos,
+						    uri_resource_.size,
+						    uri_resource_.duration_ms
+						    * GST_MSECOND);
+	Log_info("gstreamer", "Byte seek to %.1fs (offset %" PRId64 ")",
+		 position_nanos / 1e9, offset);
+	if (!gst_element_seek(player_, 1.0, GST_FORMAT_BYTES,
+			      GST_SEEK_FLAG_FLUSH,
+			      GST_SEEK_TYPE_SET, offset,
+			      GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int seek_player(gint64 position_nanos) {
+	const gboolean buffered = is_position_buffered(position_nanos);
+	if (rewind_seconds > 0.0) {
+		const gboolean hit = buffered;
+		rewind_stats_.seeks++;
+		if (hit) rewind_stats_.hits++;
+		Log_info("gstreamer", "Seek to %.1fs %s; %d of %d seeks "
+			 "served from buffer (%d%%)",
+			 position_nanos / 1e9,
+			 hit ? "in buffer" : "refetches",
+			 rewind_stats_.hits, rewind_stats_.seeks,
+			 100 * rewind_stats_.hits / rewind_stats_.seeks);
+	}
+	// Unless we already have the data, let the server find the position.
+	if (!buffered) {
+		const int ops = SongResource_get_seek_ops(&uri_resource_);
+#if (GST_VERSION_MAJOR >= 1)
+		if (ops & SONG_RESOURCE_TIME_SEEK) {
+			return seek_by_time_request(position_nanos);
+		}
+#endif
+		if ((ops & SONG_RESOURCE_BYTE_SEEK)
+		    && uri_resource_.size > 0 && uri_resource_.duration_ms > 0
+		    && seek_by_byte_offset(position_nanos) == 0) {
+			time_seek_offset_ = 0;
+			move_position_anchor(position_nanos);
+			return 0;
+		}
+	}
 	if (gst_element_seek(player_, 1.0, GST_FORMAT_TIME,
 			     GST_SEEK_FLAG_FLUSH,
-			     GST_SEEK_TYPE_SET, position_nanos,
+			     GST_SEEK_TYPE_SET, position_nanos - time_seek_offset_,
 			     GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
-		return -1;
-	} else {
+		move_position_anchor(position_nanos - time_seek_offset_);
 		return 0;
+	} else {
+		return -1;
+	}
+}
+
+static int output_gstreamer_seek(gint64 position_nanos) {
+	const int result = seek_player(position_nanos);
+#ifdef HAVE_GST_NET
+	if (result == 0) {
+		output_gstreamer_group_flush();
 	}
+#endif
+	return result;
 }
 
 #if 0
@@ -261,6 +1373,57 @@ static void MetaModify_add_tag(const GstTagList *list, const gchar *tag,
 	}
 }
 
+// The streaming thread switched playbin to the next stream in
+// prepare_next_stream(); make it the current one.
+static void next_stream_started(const GstStructure *message) {
+	const struct stream_settings *next = (const struct stream_settings*)
+		g_value_get_boxed(gst_structure_get_value(message, "settings"));
+	gint64 requested = 0;
+	gst_structure_get(message, "requested", G_TYPE_INT64, &requested,
+			  NULL);
+
+	free(gsuri_);
+	gsuri_ = next->uri ? strdup(next->uri) : NULL;
+	SongResource_clear(&uri_resource_);
+	uri_resource_.size = next->resource.size;
+	uri_resource_.duration_ms = next->resource.duration_ms;
+	uri_resource_.protocol_info = (next->resource.protocol_info
+				       ? strdup(next->resource.protocol_info)
+				       : NULL);
+	// Unless the controller already set another one in the meantime.
+	if (gs_next_uri_ != NULL && next->uri != NULL
+	    && strcmp(gs_next_uri_, next->uri) == 0) {
+		free(gs_next_uri_);
+		gs_next_uri_ = NULL;
+		SongResource_clear(&next_uri_resource_);
+	}
+	commit_stream_settings(next);
+#if (GST_VERSION_MAJOR >= 1)
+	// The current stream is still playing from its buffer; keep
+	// reporting its position until the new one starts.
+	transition_.pending = TRUE;
+	transition_.requested = requested;
+#else
+	// No STREAM_START message to wait for.
+	time_seek_offset_ = 0;
+	if (play_trans_callback_) {
+		play_trans_callback_(PLAY_STARTED_NEXT_STREAM);
+	}
+#endif
+	plan_next_stream();
+}
+
+static void handle_application_message(GstMessage *msg) {
+	const GstStructure *message = gst_message_get_structure(msg);
+	if (gst_structure_has_name(message, kNextStreamMessage)) {
+		next_stream_started(message);
+	} else if (gst_structure_has_name(message, kDownloadSizeMessage)) {
+		gst_structure_get(message, "size", G_TYPE_INT64,
+				  &download_size_, NULL);
+		plan_next_stream();
+	}
+}
+
 static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 				gpointer data)
 {
@@ -284,14 +1447,21 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 			free(gsuri_);
 			gsuri_ = gs_next_uri_;
 			gs_next_uri_ = NULL;
+			SongResource_clear(&uri_resource_);
+			uri_resource_ = next_uri_resource_;
+			SongResource_init(&next_uri_resource_);
 			gst_element_set_state(player_, GST_STATE_READY);
-			g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
+			set_player_uri(0);
 			gst_element_set_state(player_, GST_STATE_PLAYING);
 			if (play_trans_callback_) {
 				play_trans_callback_(PLAY_STARTED_NEXT_STREAM);
 			}
-		} else if (play_trans_callback_) {
-			play_trans_callback_(PLAY_STOPPED);
+		} else {
+			play_requested_ = FALSE;
+			schedule_idle();
+			if (play_trans_callback_) {
+				play_trans_callback_(PLAY_STOPPED);
+			}
 		}
 		break;
 
@@ -306,12 +1476,20 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 		g_error_free(err);
 		g_free(debug);
 
+		if (stall_timeout > 0 && play_requested_
+		    && recovery_.retry_source == 0) {
+			schedule_recovery();
+		}
+
 		break;
 	}
 	case GST_MESSAGE_STATE_CHANGED: {
 		GstState oldstate, newstate, pending;
 		gst_message_parse_state_changed(msg, &oldstate, &newstate,
 						&pending);
+		if (msgSrc == GST_OBJECT(player_)) {
+			update_position_anchor();
+		}
 		/*
 		g_print("GStreamer: %s: State change: '%s' -> '%s', "
 			"PENDING: '%s'\n", msgSrcName,
@@ -322,6 +1500,44 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 		break;
 	}
 
+#if (GST_VERSION_MAJOR >= 1)
+	case GST_MESSAGE_STREAM_START:
+		if (transition_.pending) {
+			transition_.pending = FALSE;
+			const gint64 delay = (g_get_monotonic_time()
+					      - transition_.requested);
+			transition_.count++;
+			transition_.last_delay_usec = delay;
+			transition_.total_delay_usec += delay;
+			Log_info("gstreamer", "Next stream started %.2fs after "
+				 "about-to-finish (average %.2fs over %d)",
+				 delay / 1e6,
+				 transition_.total_delay_usec / 1e6
+				 / transition_.count,
+				 transition_.count);
+			time_seek_offset_ = 0;
+			write_position_anchor(0, resource_duration(), 1.0);
+			if (play_trans_callback_) {
+				play_trans_callback_(PLAY_STARTED_NEXT_STREAM);
+			}
+		}
+		break;
+#endif
+
+	case GST_MESSAGE_APPLICATION:
+		handle_application_message(msg);
+		break;
+
+	case GST_MESSAGE_ASYNC_DONE:
+		update_position_anchor();  // Seek done.
+		// Reopened stream prerolled; go back to where it failed.
+		if (recovery_.seek_pending) {
+			recovery_.seek_pending = FALSE;
+			output_gstreamer_seek(recovery_.resume_position);
+			gst_element_set_state(player_, GST_STATE_PLAYING);
+		}
+		break;
+
 	case GST_MESSAGE_TAG: {
 		GstTagList *tags = NULL;
 
@@ -342,19 +1558,19 @@ static gboolean my_bus_callback(GstBus * bus, GstMessage * msg,
 		break;
 	}
 
+#if (GST_VERSION_MAJOR >= 1)
+	case GST_MESSAGE_HAVE_CONTEXT:
+		remember_http_session(msg);
+		break;
+#endif
+
 	case GST_MESSAGE_BUFFERING:
         {
                 if (buffer_duration <= 0.0) break;  /* nothing to buffer */
 
                 gint percent = 0;
                 gst_message_parse_buffering (msg, &percent);
-
-
-                /* Pause playback until buffering is complete. */
-                if (percent < 100)
-                        gst_element_set_state(player_, GST_STATE_PAUSED);
-                else
-                        gst_element_set_state(player_, GST_STATE_PLAYING);
+		handle_buffering_level(percent);
 		break;
         }
 	default:
@@ -394,6 +1610,39 @@ static GOptionEntry option_entries[] = {
         { "gstout-buffer-duration", 0, 0, G_OPTION_ARG_DOUBLE, &buffer_duration,
           "The size of the buffer in seconds. Set to zero to disable buffering.",
           NULL },
+        { "gstout-buffer-max-duration", 0, 0, G_OPTION_ARG_DOUBLE, &buffer_max_duration,
+          "Grow the buffer up to this many seconds for streams that stalled "
+          "(default: no growth).",
+          NULL },
+        { "gstout-buffer-low-watermark", 0, 0, G_OPTION_ARG_INT, &buffer_low_watermark,
+          "Pause for rebuffering when the buffer drops below this percentage.",
+          NULL },
+        { "gstout-buffer-high-watermark", 0, 0, G_OPTION_ARG_INT, &buffer_high_watermark,
+          "Resume playback when the buffer is filled to this percentage.",
+          NULL },
+        { "gstout-download-max-mb", 0, 0, G_OPTION_ARG_INT, &download_max_mb,
+          "Pull finite tracks up to this size completely into the buffer "
+          "as fast as the network allows (0 = disabled). The limit applies "
+          "to current and upcoming track together.",
+          NULL },
+        { "gstout-rewind-seconds", 0, 0, G_OPTION_ARG_DOUBLE, &rewind_seconds,
+          "Keep this many seconds of already played data, so that seeking "
+          "back does not refetch from the server (0 = disabled).",
+          NULL },
+        { "gstout-relay-port", 0, 0, G_OPTION_ARG_INT, &relay_port,
+          "Fetch http streams through a relay on this localhost port, "
+          "so each stream is fetched only once. Renderers on this host "
+          "given the same port share one relay; falls back to fetching "
+          "directly if something else uses the port (0 = disabled).",
+          NULL },
+        { "gstout-stall-timeout", 0, 0, G_OPTION_ARG_INT, &stall_timeout,
+          "Reopen a stream that made no progress for this many seconds "
+          "or failed, with backoff (0 = disabled).",
+          NULL },
+        { "gstout-idle-timeout", 0, 0, G_OPTION_ARG_INT, &idle_timeout,
+          "Release the audio device, decoders and buffers after being "
+          "stopped this many seconds (0 = never).",
+          NULL },
         { "gstout-initial-volume-db", 0, 0, G_OPTION_ARG_DOUBLE, &initial_db,
           "GStreamer initial volume in decibel (e.g. 0.0 = max; -6 = 1/2 max) ",
 	  NULL },
@@ -410,6 +1659,9 @@ static int output_gstreamer_add_options(GOptionContext *ctx)
 	g_option_group_add_entries(option_group, option_entries);
 
 	g_option_context_add_group (ctx, option_group);
+#ifdef HAVE_GST_NET
+	output_gstreamer_group_add_options(ctx);
+#endif
 
 	g_option_context_add_group (ctx, gst_init_get_option_group ());
 	return 0;
@@ -420,73 +1672,81 @@ static int output_gstreamer_get_position(gint64 *track_duration,
 	*track_duration = last_known_time_.duration;
 	*track_pos = last_known_time_.position;
 
-	int rc = 0;
-	if (get_current_player_state() != GST_STATE_PLAYING) {
-		return rc;  // playbin2 only returns valid values then.
+	if (recovery_.attempts > 0) {
+		*track_pos = recovery_.resume_position;
+		return 0;  // Don't report the reopened stream starting over.
 	}
-#if (GST_VERSION_MAJOR < 1)
-	GstFormat fmt = GST_FORMAT_TIME;
-	GstFormat* query_type = &fmt;
-#else
-	GstFormat query_type = GST_FORMAT_TIME;
-#endif
-	if (!gst_element_query_duration(player_, query_type, track_duration)) {
-		Log_error("gstreamer", "Failed to get track duration.");
-		rc = -1;
-	}
-	if (!gst_element_query_position(player_, query_type, track_pos)) {
-		Log_error("gstreamer", "Failed to get track pos");
-		rc = -1;
+	// Extrapolated from the last anchor; no pipeline query needed.
+	double rate;
+	read_position_anchor(track_pos, track_duration, &rate);
+	if (time_seek_offset_ > 0) {
+		// We only play the rest of the track from the offset.
+		*track_pos += time_seek_offset_;
+		*track_duration = (uri_resource_.duration_ms > 0)
+			? uri_resource_.duration_ms * GST_MSECOND
+			: *track_duration + time_seek_offset_;
 	}
-	// playbin2 does not allow to query while paused. Remember in case
-	// we're asked then (it actually returns something, but it is bogus).
 	last_known_time_.duration = *track_duration;
 	last_known_time_.position = *track_pos;
-	return rc;
+	return 0;
+}
+
+static int output_gstreamer_is_group_follower(void) {
+#ifdef HAVE_GST_NET
+	return output_gstreamer_group_is_follower();
+#else
+	return 0;
+#endif
 }
 
 static int output_gstreamer_get_volume(float *v) {
 	double volume;
-	g_object_get(player_, "volume", &volume, NULL);
+	g_object_get(volume_element_, "volume", &volume, NULL);
 	Log_info("gstreamer", "Query volume fraction: %f", volume);
 	*v = volume;
 	return 0;
 }
 static int output_gstreamer_set_volume(float value) {
 	Log_info("gstreamer", "Set volume fraction to %f", value);
-	g_object_set(player_, "volume", (double) value, NULL);
+	g_object_set(volume_element_, "volume", (double) value, NULL);
 	return 0;
 }
 static int output_gstreamer_get_mute(int *m) {
 	gboolean val;
-	g_object_get(player_, "mute", &val, NULL);
+	g_object_get(volume_element_, "mute", &val, NULL);
 	*m = val;
 	return 0;
 }
 static int output_gstreamer_set_mute(int m) {
 	Log_info("gstreamer", "Set mute to %s", m ? "on" : "off");
-	g_object_set(player_, "mute", (gboolean) m, NULL);
+	g_object_set(volume_element_, "mute", (gboolean) m, NULL);
 	return 0;
 }
 
+// about-to-finish; called from a streaming thread, which must set the uri
+// of the next stream right away for a gapless transition. It takes the
+// settings the main loop prepared and leaves the rest to it.
 static void prepare_next_stream(GstElement *obj, gpointer userdata) {
 	(void)obj;
 	(void)userdata;
 
-	Log_info("gstreamer", "about-to-finish cb: setting uri %s",
-		 gs_next_uri_);
-	free(gsuri_);
-	gsuri_ = gs_next_uri_;
-	gs_next_uri_ = NULL;
-	if (gsuri_ != NULL) {
-		g_object_set(G_OBJECT(player_), "uri", gsuri_, NULL);
-		if (play_trans_callback_) {
-			// TODO(hzeller): can we figure out when we _actually_
-			// start playing this ? there are probably a couple
-			// of seconds between now and actual start.
-			play_trans_callback_(PLAY_STARTED_NEXT_STREAM);
-		}
+	struct stream_settings *next = exchange_next_stream(NULL);
+	if (next == NULL) {
+		Log_info("gstreamer", "about-to-finish cb: no next uri");
+		return;
 	}
+	Log_info("gstreamer", "about-to-finish cb: setting uri %s", next->uri);
+	apply_stream_settings(next);
+	// On the bus, the main loop sees this before the STREAM_START of the
+	// new stream. The message holds its own reference to the plan.
+	GstStructure *s = gst_structure_new(
+		kNextStreamMessage,
+		"settings", stream_settings_get_type(), next,
+		"requested", G_TYPE_INT64, g_get_monotonic_time(),
+		NULL);
+	gst_element_post_message(player_, gst_message_new_application(
+					 GST_OBJECT(player_), s));
+	stream_settings_unref(next);
 }
 
 static int output_gstreamer_init(void)
@@ -494,6 +1754,14 @@ static int output_gstreamer_init(void)
 	GstBus *bus;
 
 	SongMetaData_init(&song_meta_);
+	SongResource_init(&uri_resource_);
+	SongResource_init(&next_uri_resource_);
+	g_mutex_init(&throughput_.mutex);
+	g_mutex_init(&content_length_probe_.mutex);
+	g_mutex_init(&anchor_.write_mutex);
+#if (GST_VERSION_MAJOR >= 1)
+	g_mutex_init(&http_session_mutex_);
+#endif
 	scan_mime_list();
 
 #if (GST_VERSION_MAJOR < 1)
@@ -504,6 +1772,7 @@ static int output_gstreamer_init(void)
 
 	player_ = gst_element_factory_make(player_element_name, "play");
 	assert(player_ != NULL);
+	volume_element_ = player_;
 
         /* set buffer size */
         if (buffer_duration > 0) {
@@ -515,11 +1784,22 @@ static int output_gstreamer_init(void)
                              "buffer-duration",
                              buffer_duration_ns,
                              NULL);
+		buffering_.current_duration = buffer_duration;
+		if (buffer_low_watermark >= buffer_high_watermark) {
+			Log_error("gstreamer", "--gstout-buffer-low-watermark "
+				  "needs to be below the high watermark.");
+			return 1;
+		}
         } else {
                 Log_info("gstreamer",
 			 "Buffering disabled (--gstout-buffer-duration)");
         }
 
+	if (relay_port > 0 && http_relay_start(relay_port) != 0) {
+		Log_error("gstreamer", "Couldn't start relay; fetching streams "
+			  "directly.");
+	}
+
 	bus = gst_pipeline_get_bus(GST_PIPELINE(player_));
 	gst_bus_add_watch(bus, my_bus_callback, NULL);
 	gst_object_unref(bus);
@@ -529,32 +1809,40 @@ static int output_gstreamer_init(void)
 		return 1;
 	}
 
+	GstElement *audio_out = NULL;
 	if (audio_sink != NULL) {
-		GstElement *sink = NULL;
 		Log_info("gstreamer", "Setting audio sink to %s; device=%s\n",
 			 audio_sink, audio_device ? audio_device : "");
-		sink = gst_element_factory_make (audio_sink, "sink");
-		if (sink == NULL) {
+		audio_out = gst_element_factory_make (audio_sink, "sink");
+		if (audio_out == NULL) {
 		  Log_error("gstreamer", "Couldn't create sink '%s'",
 			    audio_sink);
-		} else {
-		  if (audio_device != NULL) {
-		    g_object_set (G_OBJECT(sink), "device", audio_device, NULL);
-		  }
-		  g_object_set (G_OBJECT (player_), "audio-sink", sink, NULL);
+		} else if (audio_device != NULL) {
+		  g_object_set (G_OBJECT(audio_out), "device", audio_device, NULL);
 		}
 	}
 	if (audio_pipe != NULL) {
-		GstElement *sink = NULL;
 		Log_info("gstreamer", "Setting audio sink-pipeline to %s\n",audio_pipe);
-		sink = gst_parse_bin_from_description(audio_pipe, TRUE, NULL);
+		audio_out = gst_parse_bin_from_description(audio_pipe, TRUE, NULL);
 
-		if (sink == NULL) {
+		if (audio_out == NULL) {
 			Log_error("gstreamer", "Could not create pipeline.");
-		} else {
-			g_object_set (G_OBJECT (player_), "audio-sink", sink, NULL);
 		}
 	}
+#ifdef HAVE_GST_NET
+	// In a group, the local sink plays the group stream instead.
+	const int grouped = output_gstreamer_group_init(player_, audio_out);
+	if (grouped < 0) {
+		return 1;
+	}
+	if (grouped) {
+		audio_out = NULL;
+		volume_element_ = output_gstreamer_group_volume();
+	}
+#endif
+	if (audio_out != NULL) {
+		g_object_set (G_OBJECT (player_), "audio-sink", audio_out, NULL);
+	}
 	if (videosink != NULL) {
 		GstElement *sink = NULL;
 		Log_info("gstreamer", "Setting video sink to %s", videosink);
@@ -567,8 +1855,17 @@ static int output_gstreamer_init(void)
 		Log_error("gstreamer", "Error: pipeline doesn't become ready.");
 	}
 
+	if (stall_timeout > 0) {
+		g_timeout_add_seconds(1, watchdog_tick, NULL);
+	}
+	g_timeout_add_seconds(2, resync_position, NULL);
+
 	g_signal_connect(G_OBJECT(player_), "about-to-finish",
 			 G_CALLBACK(prepare_next_stream), NULL);
+#if (GST_VERSION_MAJOR >= 1)
+	g_signal_connect(G_OBJECT(player_), "source-setup",
+			 G_CALLBACK(setup_source), NULL);
+#endif
 	output_gstreamer_set_mute(0);
 	if (initial_db < 0) {
 		output_gstreamer_set_volume(exp(initial_db / 20 * log(10)));
@@ -595,4 +1892,5 @@ struct output_module gstreamer_output = {
 	.set_volume  = output_gstreamer_set_volume,
 	.get_mute  = output_gstreamer_get_mute,
 	.set_mute  = output_gstreamer_set_mute,
+	.is_group_follower = output_gstreamer_is_group_follower,
 };
@@ -0,0 +1,451 @@
+/* output_gstreamer_group.c - Synchronized multiroom playback
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "output_gstreamer_group.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gst/net/net.h>
+
+#include "logging.h"
+
+// The leader sends 16 bit PCM; decoded once, no codec on the members.
+#define RTP_CLOCK_RATE 44100
+#define RTP_CAPS "application/x-rtp,media=audio,clock-rate=44100," \
+	"encoding-name=L16,encoding-params=2,channels=2,payload=96"
+
+// Offsets from --gstout-group-port.
+enum {
+	PORT_RTP,
+	PORT_RTCP,
+	PORT_CLOCK,
+	PORT_CONTROL,
+};
+
+static gchar *group_role = NULL;
+static gchar *group_address = NULL;
+static gchar *group_leader = NULL;
+static int group_port = 5004;
+static int group_latency_ms = 300;
+
+static GOptionEntry option_entries[] = {
+        { "gstout-group-role", 0, 0, G_OPTION_ARG_STRING, &group_role,
+          "Synchronized multiroom: 'leader' decodes and sends to the group, "
+          "'follower' plays what the leader sends.",
+          NULL },
+        { "gstout-group-address", 0, 0, G_OPTION_ARG_STRING, &group_address,
+          "Multicast address of the group (default 239.255.77.77).",
+          NULL },
+        { "gstout-group-port", 0, 0, G_OPTION_ARG_INT, &group_port,
+          "First of four UDP ports of the group: RTP, RTCP, clock, control.",
+          NULL },
+        { "gstout-group-leader", 0, 0, G_OPTION_ARG_STRING, &group_leader,
+          "Host of the group leader; followers sync their clock to it.",
+          NULL },
+        { "gstout-group-latency", 0, 0, G_OPTION_ARG_INT, &group_latency_ms,
+          "Playout delay of the group in milliseconds. Has to cover the "
+          "network and audio device latency of every member.",
+          NULL },
+        { NULL }
+};
+
+static gboolean is_leader_ = FALSE;
+static GstClock *clock_ = NULL;
+static GstNetTimeProvider *time_provider_ = NULL;
+static GstElement *receiver_ = NULL;
+static GstElement *volume_ = NULL;
+static GstElement *local_sink_ = NULL;
+static int control_fd_ = -1;
+static struct sockaddr_in control_addr_;
+static gchar *zone_name_ = NULL;
+
+// The RTP timestamp of the last buffer that went to the depayloader, and
+// its stream time. Together with the position the local sink reports, this
+// tells which RTP timestamp is audible right now.
+static GMutex anchor_mutex_;
+static gboolean mapping_valid_ = FALSE;
+static guint32 mapping_rtp_time_ = 0;
+static gint64 mapping_stream_time_ = 0;
+static GstSegment segment_;
+
+void output_gstreamer_group_add_options(GOptionContext *ctx) {
+	GOptionGroup *option_group;
+	option_group = g_option_group_new("gstgroup",
+					  "GStreamer Multiroom Group Options",
+					  "Show GStreamer Multiroom Group Options",
+					  NULL, NULL);
+	g_option_group_add_entries(option_group, option_entries);
+	g_option_context_add_group(ctx, option_group);
+}
+
+gboolean output_gstreamer_group_is_follower(void) {
+	return receiver_ != NULL && !is_leader_;
+}
+
+static void send_control(const char *message) {
+	if (control_fd_ < 0)
+		return;
+	sendto(control_fd_, message, strlen(message), 0,
+	       (struct sockaddr*) &control_addr_, sizeof(control_addr_));
+}
+
+GstElement *output_gstreamer_group_volume(void) {
+	return volume_;
+}
+
+void output_gstreamer_group_play(void) {
+	if (is_leader_) {
+		send_control("PLAY");
+	}
+}
+
+void output_gstreamer_group_pause(void) {
+	if (is_leader_) {
+		send_control("PAUSE");
+	}
+}
+
+void output_gstreamer_group_stop(void) {
+	if (is_leader_) {
+		send_control("STOP");
+	}
+}
+
+void output_gstreamer_group_flush(void) {
+	if (is_leader_) {
+		send_control("FLUSH");
+	}
+}
+
+static void forget_mapping(void) {
+	g_mutex_lock(&anchor_mutex_);
+	mapping_valid_ = FALSE;
+	g_mutex_unlock(&anchor_mutex_);
+}
+
+// Start over after the leader's stream jumped or resumed, so that the
+// jitterbuffer doesn't hold on to the old timing.
+static void restart_receiver(void) {
+	gst_element_set_state(receiver_, GST_STATE_READY);
+	gst_element_set_state(receiver_, GST_STATE_PLAYING);
+	forget_mapping();
+}
+
+// Stop the local output right away instead of playing out the latency.
+static void halt_receiver(void) {
+	gst_element_set_state(receiver_, GST_STATE_READY);
+	forget_mapping();
+}
+
+static GstPadProbeReturn track_mapping(GstPad *pad, GstPadProbeInfo *info,
+				       gpointer userdata) {
+	(void)pad;
+	(void)userdata;
+	if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+			g_mutex_lock(&anchor_mutex_);
+			gst_event_copy_segment(event, &segment_);
+			mapping_valid_ = FALSE;
+			g_mutex_unlock(&anchor_mutex_);
+		}
+		return GST_PAD_PROBE_OK;
+	}
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	const GstClockTime pts = GST_BUFFER_PTS(buffer);
+	GstMapInfo map;
+	if (!GST_CLOCK_TIME_IS_VALID(pts)
+	    || !gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+		return GST_PAD_PROBE_OK;
+	}
+	if (map.size >= 8) {
+		const guint32 rtp_time = ((guint32) map.data[4] << 24
+					  | (guint32) map.data[5] << 16
+					  | (guint32) map.data[6] << 8
+					  | (guint32) map.data[7]);
+		g_mutex_lock(&anchor_mutex_);
+		const guint64 stream_time = gst_segment_to_stream_time(
+			&segment_, GST_FORMAT_TIME, pts);
+		if (GST_CLOCK_TIME_IS_VALID(stream_time)) {
+			mapping_rtp_time_ = rtp_time;
+			mapping_stream_time_ = stream_time;
+			mapping_valid_ = TRUE;
+		}
+		g_mutex_unlock(&anchor_mutex_);
+	}
+	gst_buffer_unmap(buffer, &map);
+	return GST_PAD_PROBE_OK;
+}
+
+// Clock time at which RTP timestamp 0 of the group stream is audible here,
+// from what the local sink reports as playing now. It includes the real
+// output delay of this room, so the difference between two members is
+// their skew.
+static gboolean get_anchor(gint64 *anchor) {
+	gint64 position;
+	if (!gst_element_query_position(local_sink_, GST_FORMAT_TIME,
+					&position)) {
+		return FALSE;
+	}
+	const gint64 now = gst_clock_get_time(clock_);
+	g_mutex_lock(&anchor_mutex_);
+	const gboolean valid = mapping_valid_;
+	const gint64 mapped_rtp = (gint64) gst_util_uint64_scale(
+		mapping_rtp_time_, GST_SECOND, RTP_CLOCK_RATE);
+	const gint64 audible_rtp = mapped_rtp
+		+ (position - mapping_stream_time_);
+	g_mutex_unlock(&anchor_mutex_);
+	*anchor = now - audible_rtp;
+	return valid;
+}
+
+static gboolean send_anchor(gpointer userdata) {
+	(void)userdata;
+	gint64 anchor;
+	if (get_anchor(&anchor)) {
+		char message[256];
+		snprintf(message, sizeof(message), "ANCHOR %s %" G_GINT64_FORMAT,
+			 zone_name_, anchor);
+		send_control(message);
+	}
+	return TRUE;
+}
+
+static gboolean receive_control(GIOChannel *channel, GIOCondition cond,
+				gpointer userdata) {
+	(void)channel;
+	(void)cond;
+	(void)userdata;
+	char message[256];
+	const ssize_t len = recv(control_fd_, message, sizeof(message) - 1, 0);
+	if (len <= 0)
+		return TRUE;
+	message[len] = '\0';
+	if (strcmp(message, "FLUSH") == 0) {
+		if (!is_leader_) {
+			Log_info("group", "Leader stream restarted.");
+		}
+		restart_receiver();
+	} else if (strcmp(message, "PLAY") == 0) {
+		restart_receiver();
+	} else if (strcmp(message, "PAUSE") == 0
+		   || strcmp(message, "STOP") == 0) {
+		if (!is_leader_) {
+			Log_info("group", "Leader: %s", message);
+		}
+		halt_receiver();
+	} else if (strncmp(message, "ANCHOR ", 7) == 0) {
+		char zone[200];
+		gint64 other, own;
+		if (sscanf(message + 7, "%199s %" G_GINT64_FORMAT,
+			   zone, &other) == 2
+		    && strcmp(zone, zone_name_) != 0 && get_anchor(&own)) {
+			Log_info("group", "Skew to %s: %+" G_GINT64_FORMAT " us",
+				 zone, (other - own) / 1000);
+		}
+	}
+	return TRUE;
+}
+
+// Bind the control socket and join the group's multicast address.
+static int join_control_group(int fd) {
+	const int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&control_addr_, 0, sizeof(control_addr_));
+	control_addr_.sin_family = AF_INET;
+	control_addr_.sin_port = htons(group_port + PORT_CONTROL);
+	control_addr_.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr*) &control_addr_,
+		 sizeof(control_addr_)) != 0) {
+		return -1;
+	}
+	struct ip_mreq mreq;
+	if (inet_pton(AF_INET, group_address, &mreq.imr_multiaddr) != 1)
+		return -1;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		       &mreq, sizeof(mreq)) != 0) {
+		return -1;
+	}
+	// Several members on one host must hear each other.
+	const unsigned char loop = 1;
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	control_addr_.sin_addr = mreq.imr_multiaddr;
+	return 0;
+}
+
+static int open_control_socket(void) {
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	if (join_control_group(fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	control_fd_ = fd;
+	GIOChannel *channel = g_io_channel_unix_new(control_fd_);
+	g_io_add_watch(channel, G_IO_IN, receive_control, NULL);
+	g_io_channel_unref(channel);
+	return 0;
+}
+
+// Audio sink for the leader's playbin: 16 bit PCM as RTP to the group,
+// with RTCP sender reports mapping it to the group clock.
+static GstElement *make_sender(void) {
+	gchar *description = g_strdup_printf(
+		"rtpbin name=rtpbin ntp-time-source=clock-time "
+		"rtcp-sync-send-time=false "
+		"audioconvert ! audioresample "
+		"! audio/x-raw,format=S16BE,layout=interleaved,rate=%d,channels=2 "
+		"! rtpL16pay pt=96 ! rtpbin.send_rtp_sink_0 "
+		"rtpbin.send_rtp_src_0 ! udpsink host=%s port=%d "
+		"auto-multicast=true "
+		"rtpbin.send_rtcp_src_0 ! udpsink host=%s port=%d "
+		"auto-multicast=true sync=false async=false",
+		RTP_CLOCK_RATE,
+		group_address, group_port + PORT_RTP,
+		group_address, group_port + PORT_RTCP);
+	GError *error = NULL;
+	GstElement *sender = gst_parse_bin_from_description(description, TRUE,
+							    &error);
+	if (sender == NULL) {
+		Log_error("group", "Can't create sender: %s",
+			  error ? error->message : "?");
+		if (error) g_error_free(error);
+	}
+	g_free(description);
+	return sender;
+}
+
+// Plays the group stream at the time given by the RTCP sender reports on
+// the shared clock, plus the fixed group latency.
+static GstElement *make_receiver(GstElement *local_sink) {
+	gchar *description = g_strdup_printf(
+		"rtpbin name=rtpbin buffer-mode=synced ntp-sync=true "
+		"latency=%d "
+		"udpsrc address=%s port=%d auto-multicast=true caps=\"%s\" "
+		"! rtpbin.recv_rtp_sink_0 "
+		"udpsrc address=%s port=%d auto-multicast=true "
+		"! rtpbin.recv_rtcp_sink_0 "
+		"rtpbin. ! rtpL16depay name=depay ! audioconvert "
+		"! audioresample ! volume name=volume",
+		group_latency_ms,
+		group_address, group_port + PORT_RTP, RTP_CAPS,
+		group_address, group_port + PORT_RTCP);
+	GError *error = NULL;
+	GstElement *receiver = gst_parse_launch(description, &error);
+	g_free(description);
+	if (receiver == NULL) {
+		Log_error("group", "Can't create receiver: %s",
+			  error ? error->message : "?");
+		if (error) g_error_free(error);
+		return NULL;
+	}
+	if (local_sink == NULL) {
+		local_sink = gst_element_factory_make("autoaudiosink", NULL);
+	}
+	// Volume and mute of this room apply here, after the group stream.
+	volume_ = gst_bin_get_by_name(GST_BIN(receiver), "volume");
+	gst_bin_add(GST_BIN(receiver), local_sink);
+	gst_element_link(volume_, local_sink);
+	local_sink_ = local_sink;
+
+	GstElement *depay = gst_bin_get_by_name(GST_BIN(receiver), "depay");
+	GstPad *pad = gst_element_get_static_pad(depay, "sink");
+	gst_segment_init(&segment_, GST_FORMAT_TIME);
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER
+			  | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+			  track_mapping, NULL, NULL);
+	gst_object_unref(pad);
+	gst_object_unref(depay);
+
+	gst_pipeline_use_clock(GST_PIPELINE(receiver), clock_);
+	gst_pipeline_set_latency(GST_PIPELINE(receiver),
+				 group_latency_ms * GST_MSECOND);
+	return receiver;
+}
+
+int output_gstreamer_group_init(GstElement *playbin, GstElement *local_sink) {
+	if (group_role == NULL)
+		return 0;
+	if (strcmp(group_role, "leader") == 0) {
+		is_leader_ = TRUE;
+	} else if (strcmp(group_role, "follower") != 0) {
+		Log_error("group", "--gstout-group-role is 'leader' or "
+			  "'follower'");
+		return -1;
+	}
+	if (group_address == NULL) {
+		group_address = g_strdup("239.255.77.77");
+	}
+	g_mutex_init(&anchor_mutex_);
+	zone_name_ = g_strdup_printf("%s/%d", g_get_host_name(), getpid());
+
+	if (is_leader_) {
+		// Publish our clock; the playbin and every member runs on it.
+		clock_ = gst_system_clock_obtain();
+		time_provider_ = gst_net_time_provider_new(
+			clock_, NULL, group_port + PORT_CLOCK);
+		if (time_provider_ == NULL) {
+			Log_error("group", "Can't publish clock on port %d",
+				  group_port + PORT_CLOCK);
+			return -1;
+		}
+		GstElement *sender = make_sender();
+		if (sender == NULL)
+			return -1;
+		g_object_set(G_OBJECT(playbin), "audio-sink", sender, NULL);
+		gst_pipeline_use_clock(GST_PIPELINE(playbin), clock_);
+	} else {
+		if (group_leader == NULL) {
+			Log_error("group", "Followers need --gstout-group-leader");
+			return -1;
+		}
+		clock_ = gst_net_client_clock_new("group-clock", group_leader,
+						  group_port + PORT_CLOCK, 0);
+	}
+
+	// The leader plays through a receiver like everyone else, so that
+	// all rooms have the same path and latency.
+	receiver_ = make_receiver(local_sink);
+	if (receiver_ == NULL)
+		return -1;
+	if (open_control_socket() != 0) {
+		Log_error("group", "Can't join control group %s:%d",
+			  group_address, group_port + PORT_CONTROL);
+		return -1;
+	}
+	g_timeout_add_seconds(2, send_anchor, NULL);
+	gst_element_set_state(receiver_, GST_STATE_PLAYING);
+	Log_info("group", "Joined group %s:%d as %s (%s)", group_address,
+		 group_port, is_leader_ ? "leader" : "follower", zone_name_);
+	return 1;
+}
@@ -0,0 +1,57 @@
+/* output_gstreamer_group.h - Synchronized multiroom playback
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _OUTPUT_GSTREAMER_GROUP_H
+#define _OUTPUT_GSTREAMER_GROUP_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+// In a group, the leader decodes the stream and multicasts it as RTP to
+// all members; every member, the leader included, plays it back at the
+// same time of a network clock published by the leader.
+
+void output_gstreamer_group_add_options(GOptionContext *ctx);
+
+// Set up the group role given on the command line. A leader's playbin gets
+// an audio sink sending to the group. Members play the group stream to
+// "local_sink" (or the default sink if NULL), taking ownership of it.
+// Returns 1 if we are in a group, 0 if not, -1 on error.
+int output_gstreamer_group_init(GstElement *playbin, GstElement *local_sink);
+
+// Whether we only play what the group leader sends. Followers can't be
+// controlled themselves; transport actions go to the leader.
+gboolean output_gstreamer_group_is_follower(void);
+
+// The element with the "volume" and "mute" properties for this room: the
+// volume of the local receiver path, so that it doesn't change what the
+// leader sends to everyone. NULL if we are not in a group.
+GstElement *output_gstreamer_group_volume(void);
+
+// Leader: tell all members, the leader's own receiver included, what the
+// transport does. Flush when the stream restarts or jumps; members drop
+// what they buffered.
+void output_gstreamer_group_play(void);
+void output_gstreamer_group_pause(void);
+void output_gstreamer_group_stop(void);
+void output_gstreamer_group_flush(void);
+
+#endif /* _OUTPUT_GSTREAMER_GROUP_H */
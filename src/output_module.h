@@ -33,8 +33,9 @@ struct output_module {
 
 	// Commands.
 	int (*init)(void);
-	void (*set_uri)(const char *uri, output_update_meta_cb_t meta_info);
-	void (*set_next_uri)(const char *uri);
+	void (*set_uri)(const char *uri, const char *didl,
+			output_update_meta_cb_t meta_info);
+	void (*set_next_uri)(const char *uri, const char *didl);
 	int (*play)(output_transition_cb_t transition_callback);
 	int (*stop)(void);
 	int (*pause)(void);
@@ -46,6 +47,10 @@ struct output_module {
 	int (*set_volume)(float);
 	int (*get_mute)(int *);
 	int (*set_mute)(int);
+
+	// Non-zero if playback is driven by someone else (e.g. a group
+	// leader), so transport actions can't be served here.
+	int (*is_group_follower)(void);
 };
 
 #endif
@@ -156,6 +156,80 @@ int SongMetaData_parse_DIDL(struct SongMetaData *object, const char *xml) {
 	return 1;
 }
 
+void SongResource_init(struct SongResource *value) {
+	value->size = -1;
+	value->duration_ms = -1;
+	value->protocol_info = NULL;
+}
+
+void SongResource_clear(struct SongResource *value) {
+	free(value->protocol_info);
+	SongResource_init(value);
+}
+
+// Parse the DIDL-Lite duration format H+:MM:SS[.F+]. Returns -1 on failure.
+static long long parse_duration_ms(const char *duration) {
+	int hour = 0, minute = 0;
+	double second = 0;
+	if (sscanf(duration, "%d:%d:%lf", &hour, &minute, &second) != 3)
+		return -1;
+	return (hour * 3600LL + minute * 60LL) * 1000 + (long long)(second * 1000);
+}
+
+int SongResource_parse_DIDL(struct SongResource *object, const char *xml) {
+	if (xml == NULL || strlen(xml) == 0)
+		return 0;
+	struct xmldoc *doc = xmldoc_parsexml(xml);
+	if (doc == NULL)
+		return 0;
+
+	int result = 0;
+	struct xmlelement *didl_node = find_element_in_doc(doc, "DIDL-Lite");
+	struct xmlelement *item_node = NULL;
+	struct xmlelement *res_node = NULL;
+	if (didl_node)
+		item_node = find_element_in_element(didl_node, "item");
+	if (item_node)
+		res_node = find_element_in_element(item_node, "res");
+	if (res_node) {
+		char *value = xmlelement_get_attribute(res_node, "size");
+		if (value) object->size = strtoll(value, NULL, 10);
+		free(value);
+
+		value = xmlelement_get_attribute(res_node, "duration");
+		if (value) object->duration_ms = parse_duration_ms(value);
+		free(value);
+
+		free(object->protocol_info);
+		object->protocol_info = xmlelement_get_attribute(res_node,
+								 "protocolInfo");
+		result = 1;
+	}
+
+	xmldoc_free(doc);
+	return result;
+}
+
+int SongResource_get_seek_ops(const struct SongResource *object) {
+	// protocol:network:contentFormat:additionalInfo
+	const char *info = object->protocol_info;
+	int i;
+	for (i = 0; i < 3 && info != NULL; ++i) {
+		info = strchr(info, ':');
+		if (info) info++;
+	}
+	if (info == NULL)
+		return 0;
+	const char *op = strstr(info, "DLNA.ORG_OP=");
+	if (op == NULL)
+		return 0;
+	op += strlen("DLNA.ORG_OP=");
+	int result = 0;
+	if (op[0] == '1') result |= SONG_RESOURCE_TIME_SEEK;
+	if (op[0] != '\0' && op[1] == '1') result |= SONG_RESOURCE_BYTE_SEEK;
+	return result;
+}
+
 // TODO: actually use some XML library for this, but spending too much time
 // with XML is not good for the brain :) Worst thing that came out of the 90ies.
 char *SongMetaData_to_DIDL(const struct SongMetaData *object,
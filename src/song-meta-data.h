@@ -48,4 +48,27 @@ char *SongMetaData_to_DIDL(const struct SongMetaData *object,
 // Parse DIDL-Lite and fill SongMetaData struct. Returns 1 when successful.
 int SongMetaData_parse_DIDL(struct SongMetaData *object, const char *xml);
 
+// The media resource (the <res> element) a DIDL-Lite item points to. Unlike
+// the song meta data, this describes the stream itself.
+struct SongResource {
+	long long size;          // res@size in bytes; -1 if unknown.
+	long long duration_ms;   // res@duration; -1 if unknown.
+	char *protocol_info;     // res@protocolInfo; NULL if unknown.
+};
+
+void SongResource_init(struct SongResource *object);
+void SongResource_clear(struct SongResource *object);
+
+// Parse the first <res> element of the DIDL-Lite document. Returns 1 when
+// successful.
+int SongResource_parse_DIDL(struct SongResource *object, const char *xml);
+
+// Seek requests the server supports for the resource, as announced by
+// DLNA.ORG_OP in the fourth field of the protocolInfo.
+enum {
+	SONG_RESOURCE_BYTE_SEEK = 1 << 0,  // Range: bytes=...
+	SONG_RESOURCE_TIME_SEEK = 1 << 1,  // TimeSeekRange.dlna.org: npt=...
+};
+int SongResource_get_seek_ops(const struct SongResource *object);
+
 #endif  // _SONG_META_DATA_H
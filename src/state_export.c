@@ -0,0 +1,196 @@
+/* state_export.c - Read-only state in shared memory for local monitors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "state_export.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <upnp.h>
+#include <ithread.h>
+
+#include "logging.h"
+#include "song-meta-data.h"
+#include "upnp_control.h"
+#include "upnp_service.h"
+#include "upnp_transport.h"
+#include "variable-container.h"
+
+static struct state_export *shared_ = NULL;
+// The state as we know it; changes are applied here first and then
+// published. Listeners of both services update it.
+static struct state_export current_;
+static pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+// An exported service. Changes arrive late from the listener thread; the
+// ones the initial values already had are skipped.
+struct exported_service {
+	int seeded_version;  // VariableContainer_get_version() of the values.
+};
+static struct exported_service transport_;
+static struct exported_service control_;
+
+static void copy_string(char *dest, size_t size, const char *value) {
+	strncpy(dest, value, size - 1);
+	dest[size - 1] = '\0';
+}
+
+static uint32_t parse_seconds(const char *upnp_time) {
+	int hour = 0, minute = 0, second = 0;
+	sscanf(upnp_time, "%d:%02d:%02d", &hour, &minute, &second);
+	return hour * 3600 + minute * 60 + second;
+}
+
+// Seqlock writer: make "seq" odd, write, make it even again. Only called
+// with mutex_ held, so there is one writer at a time.
+static void publish(void) {
+	const size_t start = offsetof(struct state_export, position_sec);
+	const uint32_t seq = shared_->seq;
+	__atomic_store_n(&shared_->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char*) shared_ + start, (const char*) &current_ + start,
+	       sizeof(current_) - start);
+	__atomic_store_n(&shared_->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Returns 1 if "name" is one of the exported variables.
+static int apply_change(const char *name, const char *value) {
+	if (strcmp(name, "TransportState") == 0) {
+		copy_string(current_.transport_state,
+			    sizeof(current_.transport_state), value);
+	} else if (strcmp(name, "CurrentTrackURI") == 0) {
+		copy_string(current_.track_uri, sizeof(current_.track_uri),
+			    value);
+	} else if (strcmp(name, "CurrentTrackMetaData") == 0) {
+		struct SongMetaData meta;
+		SongMetaData_init(&meta);
+		SongMetaData_parse_DIDL(&meta, value);
+		copy_string(current_.title, sizeof(current_.title),
+			    meta.title ? meta.title : "");
+		copy_string(current_.artist, sizeof(current_.artist),
+			    meta.artist ? meta.artist : "");
+		copy_string(current_.album, sizeof(current_.album),
+			    meta.album ? meta.album : "");
+		SongMetaData_clear(&meta);
+	} else if (strcmp(name, "RelativeTimePosition") == 0) {
+		current_.position_sec = parse_seconds(value);
+	} else if (strcmp(name, "CurrentTrackDuration") == 0) {
+		current_.duration_sec = parse_seconds(value);
+	} else if (strcmp(name, "Volume") == 0) {
+		current_.volume = atoi(value);
+	} else if (strcmp(name, "Mute") == 0) {
+		current_.mute = atoi(value) != 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+// Asynchronous listener: parsing the meta data doesn't hold up changes.
+static void export_variable_change(void *userdata, int version,
+				   int var_num, const char *var_name,
+				   const char *old_value,
+				   const char *new_value) {
+	struct exported_service *exported =
+		(struct exported_service*) userdata;
+	(void)var_num;
+	(void)old_value;
+	pthread_mutex_lock(&mutex_);
+	if (version > exported->seeded_version
+	    && apply_change(var_name, new_value)) {
+		publish();
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+// Listen to the changes of "srv", then take its current values. Changes
+// queued before that are older than these values and are skipped when
+// they arrive; only the ones after are applied.
+static void export_service(struct exported_service *exported,
+			   struct service *srv) {
+	exported->seeded_version = 0;
+	VariableContainer_register_async_callback(srv->variable_container,
+						  export_variable_change,
+						  exported);
+	ithread_mutex_lock(srv->service_mutex);
+	pthread_mutex_lock(&mutex_);
+	exported->seeded_version =
+		VariableContainer_get_version(srv->variable_container);
+	const int var_count =
+		VariableContainer_get_num_vars(srv->variable_container);
+	for (int i = 0; i < var_count; ++i) {
+		const char *name;
+		const char *value =
+			VariableContainer_get(srv->variable_container, i, &name);
+		if (value) {
+			apply_change(name, value);
+		}
+	}
+	publish();
+	pthread_mutex_unlock(&mutex_);
+	ithread_mutex_unlock(srv->service_mutex);
+}
+
+int state_export_start(const char *name) {
+	const int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		Log_error("export", "Can't open shared memory %s: %s",
+			  name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(struct state_export)) != 0) {
+		Log_error("export", "Can't size shared memory %s: %s",
+			  name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	void *mem = mmap(NULL, sizeof(struct state_export),
+			 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		Log_error("export", "Can't map shared memory %s: %s",
+			  name, strerror(errno));
+		return -1;
+	}
+	shared_ = (struct state_export*) mem;
+	memset(&current_, 0, sizeof(current_));
+	memset(shared_, 0, sizeof(*shared_));
+	shared_->size = sizeof(*shared_);
+	__atomic_store_n(&shared_->magic, STATE_EXPORT_MAGIC,
+			 __ATOMIC_RELEASE);
+
+	export_service(&transport_, upnp_transport_get_service());
+	export_service(&control_, upnp_control_get_service());
+	Log_info("export", "Exporting state to shared memory %s", name);
+	return 0;
+}
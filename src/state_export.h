@@ -0,0 +1,81 @@
+/* state_export.h - Read-only state in shared memory for local monitors
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _STATE_EXPORT_H
+#define _STATE_EXPORT_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The renderer publishes the current track, position, state and volume in
+// a POSIX shared memory segment. Readers on the same host map it read-only
+// and take snapshots with state_export_read(), without system calls and
+// without touching any lock of the renderer. This header is all they need.
+
+#define STATE_EXPORT_MAGIC 0x676d7231  // "gmr1"
+
+struct state_export {
+	uint32_t magic;             // STATE_EXPORT_MAGIC
+	uint32_t size;              // sizeof(struct state_export)
+	uint32_t seq;               // Odd while the renderer is writing.
+	uint32_t position_sec;
+	uint32_t duration_sec;
+	int32_t volume;             // 0..100
+	int32_t mute;               // 0 or 1
+	// NUL terminated, cut if longer.
+	char transport_state[32];   // "PLAYING", "STOPPED", ...
+	char track_uri[1024];
+	char title[256];
+	char artist[256];
+	char album[256];
+};
+
+// Attempts state_export_read() makes before giving up.
+#define STATE_EXPORT_READ_TRIES 1000000
+
+// Copy a consistent snapshot of the segment "shared" to "copy". A reader
+// that finds the renderer in the middle of an update (a seqlock) retries.
+// Returns 0 on success, -1 if no consistent snapshot could be taken in
+// STATE_EXPORT_READ_TRIES attempts: an update takes microseconds, so the
+// renderer most likely died while writing and "seq" stays odd until it
+// is restarted. Readers should then try again later, not spin.
+static inline int state_export_read(const struct state_export *shared,
+				    struct state_export *copy) {
+	for (long tries = 0; tries < STATE_EXPORT_READ_TRIES; ++tries) {
+		const uint32_t seq = __atomic_load_n(&shared->seq,
+						     __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;  // Being written; updates are short.
+		memcpy(copy, shared, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
+
+// Create the segment "name" (such as "/gmediarender"), fill it with the
+// current state and keep it updated on every change of the transport
+// and control variables. Call after the services are initialized.
+// Returns 0 on success.
+int state_export_start(const char *name);
+
+#endif /* _STATE_EXPORT_H */
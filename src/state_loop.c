@@ -0,0 +1,141 @@
+/* state_loop.c - Run state changes on the main loop
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "state_loop.h"
+#include "mpsc_queue.h"
+
+#include <glib.h>
+
+// Signalled by the main loop once it ran the function.
+struct completion {
+	GMutex mutex;
+	GCond cond;
+	gboolean done;
+};
+
+struct message {
+	struct mpsc_node node;  // first, so the node is the message.
+	state_loop_func_t function;
+	void *userdata;
+	struct completion *completion;  // NULL if posted.
+};
+
+// The messages of state_loop_call() live on the stack of the callers
+// waiting for them; posted ones are allocated and freed once run.
+static struct mpsc_queue queue_;
+static gint pending_ = 0;               // Pushed, not yet popped.
+static GMainContext *context_ = NULL;
+
+static gboolean queue_prepare(GSource *source, gint *timeout) {
+	(void)source;
+	*timeout = -1;
+	return g_atomic_int_get(&pending_) > 0;
+}
+
+static gboolean queue_check(GSource *source) {
+	(void)source;
+	return g_atomic_int_get(&pending_) > 0;
+}
+
+static gboolean queue_dispatch(GSource *source, GSourceFunc callback,
+			       gpointer userdata) {
+	(void)source;
+	(void)callback;
+	(void)userdata;
+	struct message *msg;
+	while ((msg = (struct message*) mpsc_queue_pop(&queue_)) != NULL) {
+		g_atomic_int_add(&pending_, -1);
+		// The caller's stack, with "msg", is gone once it's woken up.
+		struct completion *completion = msg->completion;
+		msg->function(msg->userdata);
+		if (completion == NULL) {
+			g_free(msg);
+			continue;
+		}
+		g_mutex_lock(&completion->mutex);
+		completion->done = TRUE;
+		g_cond_signal(&completion->cond);
+		g_mutex_unlock(&completion->mutex);
+	}
+	return TRUE;
+}
+
+static GSourceFuncs queue_funcs = {
+	queue_prepare,
+	queue_check,
+	queue_dispatch,
+	NULL,
+};
+
+void state_loop_init(void) {
+	mpsc_queue_init(&queue_);
+	context_ = g_main_context_default();
+	GSource *source = g_source_new(&queue_funcs, sizeof(GSource));
+	g_source_attach(source, context_);
+	g_source_unref(source);
+}
+
+static void push_message(struct message *msg) {
+	mpsc_queue_push(&queue_, &msg->node);
+	g_atomic_int_inc(&pending_);
+	g_main_context_wakeup(context_);
+}
+
+void state_loop_call(state_loop_func_t function, void *userdata) {
+	if (context_ == NULL || g_main_context_is_owner(context_)) {
+		function(userdata);
+		return;
+	}
+	struct completion completion;
+	g_mutex_init(&completion.mutex);
+	g_cond_init(&completion.cond);
+	completion.done = FALSE;
+	struct message msg;
+	msg.function = function;
+	msg.userdata = userdata;
+	msg.completion = &completion;
+	push_message(&msg);
+
+	g_mutex_lock(&completion.mutex);
+	while (!completion.done) {
+		g_cond_wait(&completion.cond, &completion.mutex);
+	}
+	g_mutex_unlock(&completion.mutex);
+	g_mutex_clear(&completion.mutex);
+	g_cond_clear(&completion.cond);
+}
+
+void state_loop_post(state_loop_func_t function, void *userdata) {
+	if (context_ == NULL) {
+		// No loop; nothing to be in order with.
+		function(userdata);
+		return;
+	}
+	struct message *msg = g_new0(struct message, 1);
+	msg->function = function;
+	msg->userdata = userdata;
+	msg->completion = NULL;
+	push_message(msg);
+}
@@ -0,0 +1,46 @@
+/* state_loop.h - Run state changes on the main loop
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _STATE_LOOP_H
+#define _STATE_LOOP_H
+
+// The player and service state is owned by the thread running the GLib
+// main loop: GStreamer bus messages and timers run there anyway, and other
+// threads hand their work to it through a lock-free queue.
+
+typedef void (*state_loop_func_t)(void *userdata);
+
+// Attach the queue to the default main context. Call before starting
+// anything that might call state_loop_call().
+void state_loop_init(void);
+
+// Run "function" on the main loop, in order with everything else queued,
+// and wait for it to finish. Runs it right away if called from the main
+// loop itself. Must not be called from a thread the main loop may be
+// waiting for.
+void state_loop_call(state_loop_func_t function, void *userdata);
+
+// Like state_loop_call(), but returns right away; "function" runs later,
+// even if called from the main loop. Whatever it needs to report, it
+// hands back itself.
+void state_loop_post(state_loop_func_t function, void *userdata);
+
+#endif /* _STATE_LOOP_H */
@@ -0,0 +1,345 @@
+/* test_http_server.c - Loopback HTTP media server for the tests
+ *
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "test_http_server.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#define MAX_REQUESTS 256
+#define MAX_HEADER_SIZE 8192
+
+static char *file_ = NULL;
+static long file_size_ = 0;
+static int connect_delay_msec_ = 0;
+static int keep_alive_ = 1;
+
+static pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static struct test_http_request requests_[MAX_REQUESTS];
+static int request_count_ = 0;
+static int connection_count_ = 0;   // Since the last clear.
+static int connection_number_ = 0;  // Ever.
+
+static void put_le16(char *out, unsigned value) {
+	out[0] = value & 0xff;
+	out[1] = (value >> 8) & 0xff;
+}
+
+static void put_le32(char *out, unsigned long value) {
+	put_le16(out, value & 0xffff);
+	put_le16(out + 2, (value >> 16) & 0xffff);
+}
+
+// Canonical 44 byte header for "data_size" bytes of samples.
+static void write_wav_header(char *out, unsigned long data_size) {
+	memcpy(out, "RIFF", 4);
+	put_le32(out + 4, 36 + data_size);
+	memcpy(out + 8, "WAVEfmt ", 8);
+	put_le32(out + 16, 16);
+	put_le16(out + 20, 1);                        // PCM
+	put_le16(out + 22, 1);                        // mono
+	put_le32(out + 24, TEST_HTTP_WAV_RATE);
+	put_le32(out + 28, TEST_HTTP_WAV_RATE * 2);   // bytes per second
+	put_le16(out + 32, 2);                        // block align
+	put_le16(out + 34, 16);                       // bits per sample
+	memcpy(out + 36, "data", 4);
+	put_le32(out + 40, data_size);
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+// Value of header "name" in the header block, or an empty string.
+static void get_header(const char *header, const char *name,
+		       char *value, size_t size) {
+	const size_t name_len = strlen(name);
+	value[0] = '\0';
+	const char *line = strchr(header, '\n');
+	while (line != NULL && *++line != '\0') {
+		if (strncasecmp(line, name, name_len) == 0
+		    && line[name_len] == ':') {
+			const char *start = line + name_len + 1;
+			while (*start == ' ' || *start == '\t')
+				start++;
+			size_t len = strcspn(start, "\r\n");
+			if (len >= size)
+				len = size - 1;
+			memcpy(value, start, len);
+			value[len] = '\0';
+			return;
+		}
+		line = strchr(line, '\n');
+	}
+}
+
+static void record(const struct test_http_request *request) {
+	pthread_mutex_lock(&mutex_);
+	if (request_count_ < MAX_REQUESTS)
+		requests_[request_count_] = *request;
+	request_count_++;
+	pthread_mutex_unlock(&mutex_);
+}
+
+// Answer one request. Returns -1 if the connection is to be closed.
+static int respond(int fd, const char *header, int head_only) {
+	char range[64], time_seek[64], connection[32];
+	get_header(header, "Range", range, sizeof(range));
+	get_header(header, "TimeSeekRange.dlna.org", time_seek,
+		   sizeof(time_seek));
+	get_header(header, "Connection", connection, sizeof(connection));
+	pthread_mutex_lock(&mutex_);
+	const int keep_alive = keep_alive_
+		&& strcasecmp(connection, "close") != 0;
+	pthread_mutex_unlock(&mutex_);
+	const char *closing = keep_alive ? "" : "Connection: close\r\n";
+
+	char response[512];
+	const char *body = file_;
+	long body_len = file_size_;
+	char *seek_file = NULL;
+	double npt = 0;
+	long long first = 0;
+	if (time_seek[0] && sscanf(time_seek, "npt=%lf-", &npt) == 1) {
+		const double duration = (double) (file_size_
+						  - TEST_HTTP_WAV_HEADER)
+			/ (TEST_HTTP_WAV_RATE * 2);
+		long offset = TEST_HTTP_WAV_HEADER
+			+ 2 * (long) (npt * TEST_HTTP_WAV_RATE);
+		if (offset > file_size_)
+			offset = file_size_;
+		body_len = TEST_HTTP_WAV_HEADER + file_size_ - offset;
+		seek_file = (char*) malloc(body_len);
+		write_wav_header(seek_file, file_size_ - offset);
+		memcpy(seek_file + TEST_HTTP_WAV_HEADER, file_ + offset,
+		       file_size_ - offset);
+		body = seek_file;
+		snprintf(response, sizeof(response),
+			 "HTTP/1.1 200 OK\r\n"
+			 "Content-Type: audio/x-wav\r\n"
+			 "Content-Length: %ld\r\n"
+			 "TimeSeekRange.dlna.org: npt=%.3f-%.3f/%.3f\r\n"
+			 "%s\r\n", body_len, npt, duration, duration, closing);
+	} else if (range[0] && sscanf(range, "bytes=%lld-", &first) == 1) {
+		if (first >= file_size_) {
+			snprintf(response, sizeof(response),
+				 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+				 "Content-Length: 0\r\n%s\r\n", closing);
+			body_len = 0;
+		} else {
+			body = file_ + first;
+			body_len = file_size_ - first;
+			snprintf(response, sizeof(response),
+				 "HTTP/1.1 206 Partial Content\r\n"
+				 "Content-Type: audio/x-wav\r\n"
+				 "Content-Length: %ld\r\n"
+				 "Content-Range: bytes %lld-%ld/%ld\r\n"
+				 "Accept-Ranges: bytes\r\n"
+				 "%s\r\n", body_len, first, file_size_ - 1,
+				 file_size_, closing);
+		}
+	} else {
+		snprintf(response, sizeof(response),
+			 "HTTP/1.1 200 OK\r\n"
+			 "Content-Type: audio/x-wav\r\n"
+			 "Content-Length: %ld\r\n"
+			 "Accept-Ranges: bytes\r\n"
+			 "%s\r\n", body_len, closing);
+	}
+	int result = send_all(fd, response, strlen(response));
+	if (result == 0 && !head_only)
+		result = send_all(fd, body, body_len);
+	free(seek_file);
+	if (!keep_alive)
+		result = -1;
+	return result;
+}
+
+static void *serve_connection(void *userdata) {
+	const int fd = (int) (intptr_t) userdata;
+	pthread_mutex_lock(&mutex_);
+	const int number = ++connection_number_;
+	connection_count_++;
+	const int delay_msec = connect_delay_msec_;
+	pthread_mutex_unlock(&mutex_);
+	if (delay_msec > 0)
+		g_usleep(delay_msec * 1000);
+
+	char buf[MAX_HEADER_SIZE];
+	size_t len = 0;
+	int served = 0;
+	for (;;) {
+		char *end;
+		buf[len] = '\0';
+		while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+			if (len + 1 >= sizeof(buf))
+				goto done;
+			const ssize_t r = recv(fd, buf + len,
+					       sizeof(buf) - 1 - len, 0);
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR)
+					continue;
+				goto done;
+			}
+			len += r;
+			buf[len] = '\0';
+		}
+		end[2] = '\0';  // Header block for the parsers.
+
+		struct test_http_request request;
+		memset(&request, 0, sizeof(request));
+		request.connection = number;
+		request.reused = served > 0;
+		request.received_usec = g_get_monotonic_time();
+		sscanf(buf, "%7s %255s", request.method, request.path);
+		get_header(buf, "Range", request.range, sizeof(request.range));
+		get_header(buf, "TimeSeekRange.dlna.org", request.time_seek,
+			   sizeof(request.time_seek));
+		record(&request);
+		served++;
+
+		const int head_only = strcmp(request.method, "HEAD") == 0;
+		if (respond(fd, buf, head_only) != 0)
+			break;
+		// No request bodies expected; keep what was pipelined.
+		const size_t used = end + 4 - buf;
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+done:
+	close(fd);
+	return NULL;
+}
+
+static void *accept_connections(void *userdata) {
+	const int listen_fd = (int) (intptr_t) userdata;
+	for (;;) {
+		const int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, serve_connection,
+				   (void*) (intptr_t) fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(listen_fd);
+	return NULL;
+}
+
+int test_http_server_start(int seconds) {
+	const unsigned long data_size = 2UL * TEST_HTTP_WAV_RATE * seconds;
+	file_size_ = TEST_HTTP_WAV_HEADER + data_size;
+	file_ = (char*) calloc(1, file_size_);
+	write_wav_header(file_, data_size);
+
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;  // Any free one.
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	pthread_t thread;
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	    || listen(fd, 16) != 0
+	    || getsockname(fd, (struct sockaddr*) &addr, &addr_len) != 0
+	    || pthread_create(&thread, NULL, accept_connections,
+			      (void*) (intptr_t) fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	return ntohs(addr.sin_port);
+}
+
+long test_http_server_size(void) {
+	return file_size_;
+}
+
+void test_http_server_set_keep_alive(int keep_alive) {
+	pthread_mutex_lock(&mutex_);
+	keep_alive_ = keep_alive;
+	pthread_mutex_unlock(&mutex_);
+}
+
+void test_http_server_set_connect_delay(int msec) {
+	pthread_mutex_lock(&mutex_);
+	connect_delay_msec_ = msec;
+	pthread_mutex_unlock(&mutex_);
+}
+
+int test_http_server_requests(struct test_http_request *requests, int max) {
+	pthread_mutex_lock(&mutex_);
+	const int count = request_count_;
+	const int stored = count < MAX_REQUESTS ? count : MAX_REQUESTS;
+	memcpy(requests, requests_,
+	       (stored < max ? stored : max) * sizeof(*requests));
+	pthread_mutex_unlock(&mutex_);
+	return count;
+}
+
+int test_http_server_connections(void) {
+	pthread_mutex_lock(&mutex_);
+	const int count = connection_count_;
+	pthread_mutex_unlock(&mutex_);
+	return count;
+}
+
+void test_http_server_clear(void) {
+	pthread_mutex_lock(&mutex_);
+	request_count_ = 0;
+	connection_count_ = 0;
+	pthread_mutex_unlock(&mutex_);
+}
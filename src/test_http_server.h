@@ -0,0 +1,73 @@
+/* test_http_server.h - Loopback HTTP media server for the tests
+ *
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _TEST_HTTP_SERVER_H
+#define _TEST_HTTP_SERVER_H
+
+#include <stdint.h>
+
+// A media server on 127.0.0.1 for the tests of the GStreamer output. It
+// serves a silent WAV file under every path, keeps connections alive,
+// answers Range requests and DLNA time seeks, and records what it was
+// asked on which connection.
+
+#define TEST_HTTP_WAV_RATE 22050     // Samples per second, mono, 16 bit.
+#define TEST_HTTP_WAV_HEADER 44      // Bytes before the samples.
+
+// A request as the server saw it.
+struct test_http_request {
+	int connection;            // Connections are numbered from 1.
+	int reused;                // Not the first request on its connection.
+	char method[8];
+	char path[256];
+	char range[64];            // "Range" header; empty if none.
+	char time_seek[64];        // "TimeSeekRange.dlna.org"; empty if none.
+	int64_t received_usec;     // g_get_monotonic_time()
+};
+
+// Start serving a file of "seconds" on a free port. A time seek
+// ("npt=<seconds>-") gets a WAV file of the rest of it, as a transcoding
+// server would send. Returns the port, or -1.
+int test_http_server_start(int seconds);
+
+// Size of the file in bytes.
+long test_http_server_size(void);
+
+// Wait "msec" before reading the first request of a new connection, like
+// a server further away, or one that is slow to accept.
+void test_http_server_set_connect_delay(int msec);
+
+// Whether to keep connections open after a response (the default), or
+// close them as old servers do.
+void test_http_server_set_keep_alive(int keep_alive);
+
+// Copy up to "max" of the requests since the last clear to "requests";
+// returns how many there were.
+int test_http_server_requests(struct test_http_request *requests, int max);
+
+// Connections accepted since the last clear.
+int test_http_server_connections(void);
+
+// Forget the requests and connections so far.
+void test_http_server_clear(void);
+
+#endif /* _TEST_HTTP_SERVER_H */
@@ -0,0 +1,228 @@
+/* test_http_session.c - Connection reuse across tracks
+ *
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+// Plays from a loopback server that is slow to accept connections: a
+// track, then the next one pre-warmed by SetNextAVTransportURI, then the
+// first one again. The later requests must go out on a connection the
+// shared http session kept open, and the track start on a kept connection
+// is compared with one that had to connect. Run by "make check".
+
+// The session sharing is static in the module; test it where it lives.
+#include "output_gstreamer.c"
+
+#include "test_http_server.h"
+
+#define MAX_SEEN 64
+
+static const int kTrackSeconds = 2;
+static const int kConnectDelayMsec = 50;
+static const int kTimeoutSec = 20;
+
+static int stopped_ = 0;
+static int next_started_ = 0;
+
+static void transition(enum PlayFeedback feedback) {
+	switch (feedback) {
+	case PLAY_STOPPED:
+		stopped_ = 1;
+		break;
+	case PLAY_STARTED_NEXT_STREAM:
+		next_started_++;
+		break;
+	default:
+		break;
+	}
+}
+
+static void make_uri(char *uri, size_t size, int port, const char *path) {
+	snprintf(uri, size, "http://127.0.0.1:%d%s", port, path);
+}
+
+// Run the main loop, which handles the bus, until the player is playing.
+// Returns the microseconds that took, or -1 on timeout.
+static gint64 wait_playing(gint64 start) {
+	const gint64 deadline = start + kTimeoutSec * G_USEC_PER_SEC;
+	while (get_current_player_state() != GST_STATE_PLAYING) {
+		if (g_get_monotonic_time() > deadline)
+			return -1;
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+		g_usleep(1000);
+	}
+	return g_get_monotonic_time() - start;
+}
+
+// Run the main loop until the player reports the end of the playlist.
+static int wait_stopped(void) {
+	const gint64 deadline = (g_get_monotonic_time()
+				 + kTimeoutSec * G_USEC_PER_SEC);
+	while (!stopped_) {
+		if (g_get_monotonic_time() > deadline)
+			return -1;
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+		g_usleep(1000);
+	}
+	return 0;
+}
+
+static const struct test_http_request *
+find_request(const struct test_http_request *seen, int count,
+	     const char *method, const char *path) {
+	for (int i = 0; i < count && i < MAX_SEEN; ++i) {
+		if (strcmp(seen[i].method, method) == 0
+		    && strcmp(seen[i].path, path) == 0) {
+			return &seen[i];
+		}
+	}
+	return NULL;
+}
+
+static void print_requests(const struct test_http_request *seen,
+			   int count) {
+	for (int i = 0; i < count && i < MAX_SEEN; ++i) {
+		fprintf(stderr, "  connection %d%s: %s %s\n",
+			seen[i].connection, seen[i].reused ? " (kept)" : "",
+			seen[i].method, seen[i].path);
+	}
+}
+
+// Start "path" playing and return the microseconds until it did.
+static gint64 start_track(int port, const char *path, const char *next) {
+	char uri[64];
+	make_uri(uri, sizeof(uri), port, path);
+	output_gstreamer_set_uri(uri, NULL, NULL);
+	if (next != NULL) {
+		make_uri(uri, sizeof(uri), port, next);
+		output_gstreamer_set_next_uri(uri, NULL);
+	}
+	stopped_ = 0;
+	const gint64 start = g_get_monotonic_time();
+	if (output_gstreamer_play(transition) != 0)
+		return -1;
+	return wait_playing(start);
+}
+
+int main(int argc, char **argv) {
+	gst_init(&argc, &argv);
+#if (GST_VERSION_MAJOR < 1)
+	fprintf(stderr, "No shared http session before GStreamer 1.0; "
+		"skipped.\n");
+	return 77;  // automake: skipped.
+#endif
+	static const char *const needed[] = {
+		"playbin", "souphttpsrc", "wavparse", "fakesink", NULL
+	};
+	for (int i = 0; needed[i] != NULL; ++i) {
+		GstElementFactory *factory =
+			gst_element_factory_find(needed[i]);
+		if (factory == NULL) {
+			fprintf(stderr, "No %s; skipped.\n", needed[i]);
+			return 77;  // automake: skipped.
+		}
+		gst_object_unref(factory);
+	}
+	const int port = test_http_server_start(kTrackSeconds);
+	if (port < 0) {
+		fprintf(stderr, "Can't listen on 127.0.0.1; skipped.\n");
+		return 77;
+	}
+	test_http_server_set_connect_delay(kConnectDelayMsec);
+
+	audio_pipe = g_strdup("fakesink sync=true");
+	stall_timeout = 0;  // No watchdog; the loop below never blocks.
+	if (output_gstreamer_init() != 0) {
+		fprintf(stderr, "Couldn't set up the player.\n");
+		return 1;
+	}
+
+	int result = 0;
+	struct test_http_request seen[MAX_SEEN];
+	const struct test_http_request *request;
+
+	// Load the plugins and get the http session published, without
+	// leaving a connection behind.
+	test_http_server_set_keep_alive(0);
+	if (start_track(port, "/warmup", NULL) < 0 || wait_stopped() != 0) {
+		fprintf(stderr, "Warm-up track didn't play.\n");
+		return 1;
+	}
+	test_http_server_set_keep_alive(1);
+
+	// A track on a new connection, and the next one pre-warmed.
+	test_http_server_clear();
+	next_started_ = 0;
+	const gint64 cold_usec = start_track(port, "/track1", "/track2");
+	if (cold_usec < 0 || wait_stopped() != 0) {
+		fprintf(stderr, "Tracks didn't play through.\n");
+		return 1;
+	}
+	int count = test_http_server_requests(seen, MAX_SEEN);
+	if (next_started_ != 1) {
+		fprintf(stderr, "Next track started %d times.\n", next_started_);
+		result = 1;
+	}
+	request = find_request(seen, count, "GET", "/track1");
+	if (request == NULL || request->reused) {
+		fprintf(stderr, "Expected /track1 on a new connection.\n");
+		result = 1;
+	}
+	if (find_request(seen, count, "HEAD", "/track2") == NULL) {
+		fprintf(stderr, "/track2 wasn't pre-warmed.\n");
+		result = 1;
+	}
+	request = find_request(seen, count, "GET", "/track2");
+	if (request == NULL || !request->reused) {
+		fprintf(stderr, "Expected /track2 on a kept connection.\n");
+		result = 1;
+	}
+	if (result != 0)
+		print_requests(seen, count);
+	printf("Gapless transition: next stream after %.1fms\n",
+	       transition_.last_delay_usec / 1e3);
+
+	// The same track again; the session still holds the connection.
+	test_http_server_clear();
+	const gint64 warm_usec = start_track(port, "/track1", NULL);
+	if (warm_usec < 0 || wait_stopped() != 0) {
+		fprintf(stderr, "Track didn't play again.\n");
+		return 1;
+	}
+	count = test_http_server_requests(seen, MAX_SEEN);
+	request = find_request(seen, count, "GET", "/track1");
+	if (request == NULL || !request->reused
+	    || test_http_server_connections() != 0) {
+		fprintf(stderr, "Expected /track1 again on a kept "
+			"connection, with no new one.\n");
+		print_requests(seen, count);
+		result = 1;
+	}
+
+	printf("Track start: %.1fms connecting (%dms to accept), "
+	       "%.1fms on a kept connection, %.1fms saved\n",
+	       cold_usec / 1e3, kConnectDelayMsec, warm_usec / 1e3,
+	       (cold_usec - warm_usec) / 1e3);
+
+	gst_element_set_state(player_, GST_STATE_NULL);
+	gst_object_unref(player_);
+	return result;
+}
@@ -0,0 +1,230 @@
+/* test_seek.c - Seeks answered by the media server
+ *
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+// Seeks beyond what the player holds, against the loopback media server:
+// with DLNA.ORG_OP=10 each must be a single request with a
+// TimeSeekRange.dlna.org header, and the positions reported after it must
+// count from the requested time; with DLNA.ORG_OP=01 it must be a single
+// Range request near the offset estimated from res@size and
+// res@duration. Prints how long each seek took. Run by "make check".
+
+// The seeks are static in the module; test them where they live.
+#include "output_gstreamer.c"
+
+#include "test_http_server.h"
+
+#define MAX_SEEN 16
+
+static const int kTrackSeconds = 120;
+static const int kTimeoutSec = 20;
+// The player runs on after the seek while we look at it.
+static const gint64 kPositionSlack = 5 * GST_SECOND;
+
+static void transition(enum PlayFeedback feedback) {
+	(void)feedback;
+}
+
+static void run_main_loop(void) {
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+}
+
+// Run the main loop until the player plays with no state change pending.
+// Returns the microseconds since "start", or -1 on timeout.
+static gint64 wait_playing(gint64 start) {
+	const gint64 deadline = start + kTimeoutSec * G_USEC_PER_SEC;
+	for (;;) {
+		GstState state = GST_STATE_NULL;
+		GstState pending = GST_STATE_NULL;
+		run_main_loop();
+		if (gst_element_get_state(player_, &state, &pending, 0)
+		    == GST_STATE_CHANGE_SUCCESS
+		    && state == GST_STATE_PLAYING) {
+			return g_get_monotonic_time() - start;
+		}
+		if (g_get_monotonic_time() > deadline)
+			return -1;
+		g_usleep(1000);
+	}
+}
+
+// Run the main loop for a while, letting stray requests arrive.
+static void settle(int msec) {
+	const gint64 end = g_get_monotonic_time() + msec * 1000;
+	while (g_get_monotonic_time() < end) {
+		run_main_loop();
+		g_usleep(1000);
+	}
+}
+
+static int play(int port, const char *path, const char *op) {
+	char uri[64], didl[512];
+	snprintf(uri, sizeof(uri), "http://127.0.0.1:%d%s", port, path);
+	snprintf(didl, sizeof(didl),
+		 "<DIDL-Lite><item><res size=\"%ld\" duration=\"0:%02d:%02d\" "
+		 "protocolInfo=\"http-get:*:audio/x-wav:DLNA.ORG_OP=%s\">"
+		 "%s</res></item></DIDL-Lite>",
+		 test_http_server_size(), kTrackSeconds / 60,
+		 kTrackSeconds % 60, op, uri);
+	output_gstreamer_set_uri(uri, didl, NULL);
+	if (output_gstreamer_play(transition) != 0
+	    || wait_playing(g_get_monotonic_time()) < 0) {
+		fprintf(stderr, "%s didn't start playing.\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+// Seek to "seconds" and check the one request the server got for it
+// and the position reported afterwards. "time_seek" or "range" is the
+// header expected; "range_slack" is how far the demuxer may move the
+// range start, e.g. to skip the header or align to a sample.
+static int check_seek(int seconds, const char *time_seek,
+		      long long range, long long range_slack) {
+	struct test_http_request seen[MAX_SEEN];
+	gint64 duration, position;
+	// The controller polls the position; that's also how the module
+	// learns the duration it checks the player's buffer against.
+	output_gstreamer_get_position(&duration, &position);
+	test_http_server_clear();
+	const gint64 start = g_get_monotonic_time();
+	if (output_gstreamer_seek(seconds * GST_SECOND) != 0) {
+		fprintf(stderr, "Seek to %ds failed.\n", seconds);
+		return -1;
+	}
+	const gint64 playing_usec = wait_playing(start);
+	if (playing_usec < 0) {
+		fprintf(stderr, "Not playing after seek to %ds.\n", seconds);
+		return -1;
+	}
+	settle(200);
+	output_gstreamer_get_position(&duration, &position);
+	const int count = test_http_server_requests(seen, MAX_SEEN);
+
+	int result = 0;
+	if (count != 1) {
+		fprintf(stderr, "Seek to %ds made %d requests.\n",
+			seconds, count);
+		result = -1;
+	}
+	for (int i = 0; i < count && i < MAX_SEEN; ++i) {
+		fprintf(result ? stderr : stdout,
+			"  %s %s; Range: '%s'; TimeSeekRange.dlna.org: '%s'\n",
+			seen[i].method, seen[i].path, seen[i].range,
+			seen[i].time_seek);
+	}
+	if (count >= 1) {
+		long long first = -1;
+		if (time_seek != NULL) {
+			if (strcmp(seen[0].time_seek, time_seek) != 0
+			    || seen[0].range[0] != '\0') {
+				fprintf(stderr, "Expected only "
+					"TimeSeekRange.dlna.org: %s\n",
+					time_seek);
+				result = -1;
+			}
+		} else if (seen[0].time_seek[0] != '\0'
+			   || sscanf(seen[0].range, "bytes=%lld-",
+				     &first) != 1
+			   || first < range - range_slack
+			   || first > range + range_slack) {
+			fprintf(stderr, "Expected only Range: bytes=%lld- "
+				"(give or take %lld)\n",
+				range, range_slack);
+			result = -1;
+		}
+	}
+	if (position < seconds * GST_SECOND
+	    || position > seconds * GST_SECOND + kPositionSlack) {
+		fprintf(stderr, "Position %.1fs after seek to %ds.\n",
+			position / 1e9, seconds);
+		result = -1;
+	}
+	if (count >= 1) {
+		printf("Seek to %ds: request after %.1fms, playing after "
+		       "%.1fms, position %.1fs\n", seconds,
+		       (seen[0].received_usec - start) / 1e3,
+		       playing_usec / 1e3, position / 1e9);
+	}
+	return result;
+}
+
+int main(int argc, char **argv) {
+	gst_init(&argc, &argv);
+#if (GST_VERSION_MAJOR < 1)
+	fprintf(stderr, "No time seek requests before GStreamer 1.0; "
+		"skipped.\n");
+	return 77;  // automake: skipped.
+#endif
+	static const char *const needed[] = {
+		"playbin", "souphttpsrc", "wavparse", "fakesink", NULL
+	};
+	for (int i = 0; needed[i] != NULL; ++i) {
+		GstElementFactory *factory =
+			gst_element_factory_find(needed[i]);
+		if (factory == NULL) {
+			fprintf(stderr, "No %s; skipped.\n", needed[i]);
+			return 77;  // automake: skipped.
+		}
+		gst_object_unref(factory);
+	}
+	const int port = test_http_server_start(kTrackSeconds);
+	if (port < 0) {
+		fprintf(stderr, "Can't listen on 127.0.0.1; skipped.\n");
+		return 77;
+	}
+
+	audio_pipe = g_strdup("fakesink sync=true");
+	stall_timeout = 0;  // No watchdog; the loop below never blocks.
+	if (output_gstreamer_init() != 0) {
+		fprintf(stderr, "Couldn't set up the player.\n");
+		return 1;
+	}
+
+	int result = 0;
+	// Server-side time seeks: forward, then back before the offset the
+	// stream now starts at.
+	printf("DLNA.ORG_OP=10\n");
+	if (play(port, "/time", "10") != 0
+	    || check_seek(100, "npt=100.000-", 0, 0) != 0
+	    || check_seek(30, "npt=30.000-", 0, 0) != 0) {
+		result = 1;
+	}
+	output_gstreamer_stop();
+
+	// Range requests at the offset for the average bit rate.
+	printf("DLNA.ORG_OP=01\n");
+	const long long size = test_http_server_size();
+	const int bytes_per_second = 2 * TEST_HTTP_WAV_RATE;
+	if (play(port, "/bytes", "01") != 0
+	    || check_seek(100, NULL, size * 100 / kTrackSeconds,
+			  bytes_per_second) != 0
+	    || check_seek(30, NULL, size * 30 / kTrackSeconds,
+			  bytes_per_second) != 0) {
+		result = 1;
+	}
+	output_gstreamer_stop();
+
+	gst_element_set_state(player_, GST_STATE_NULL);
+	gst_object_unref(player_);
+	return result;
+}
@@ -0,0 +1,284 @@
+/* unix_control.c - Binary control protocol on a local Unix socket
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "unix_control.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "logging.h"
+#include "upnp_device.h"
+
+#define MAX_FRAME_SIZE (64 << 10)
+
+#define TRANSPORT_SERVICE_ID "urn:upnp-org:serviceId:AVTransport"
+#define CONTROL_SERVICE_ID "urn:upnp-org:serviceId:RenderingControl"
+
+// UPnP error codes we answer with ourselves.
+#define ERROR_INVALID_ACTION 401
+#define ERROR_INVALID_ARGS 402
+
+static struct upnp_device *device_ = NULL;
+
+static int read_all(int fd, void *buffer, size_t len) {
+	char *p = (char*) buffer;
+	while (len > 0) {
+		const ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t len) {
+	const char *p = (const char*) buffer;
+	while (len > 0) {
+		const ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+		| ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint32_t parse_seconds(const char *upnp_time) {
+	int hour = 0, minute = 0, second = 0;
+	if (upnp_time == NULL)
+		return 0;
+	sscanf(upnp_time, "%d:%02d:%02d", &hour, &minute, &second);
+	return hour * 3600 + minute * 60 + second;
+}
+
+static int call(const char *service_id, const char *action,
+		const char **names, const char **values, int count) {
+	return upnp_device_call_action(device_, service_id, action,
+				       names, values, count, NULL, NULL, 0);
+}
+
+// Run the request in "in" of "len" bytes; the results go to "out", which
+// has room for 8 bytes. Returns the status.
+static int handle_request(const unsigned char *in, size_t len,
+			  unsigned char *out, size_t *out_len) {
+	*out_len = 0;
+	if (len < 1)
+		return ERROR_INVALID_ARGS;
+	const unsigned char opcode = in[0];
+	const unsigned char *arg = in + 1;
+	const size_t arg_len = len - 1;
+	char value[32];
+	int rc;
+
+	switch (opcode) {
+	case UNIX_CONTROL_SET_URI: {
+		char *uri = strndup((const char*) arg, arg_len);
+		const char *names[] = { "InstanceID", "CurrentURI",
+					"CurrentURIMetaData" };
+		const char *values[] = { "0", uri, "" };
+		rc = call(TRANSPORT_SERVICE_ID, "SetAVTransportURI",
+			  names, values, 3);
+		free(uri);
+		return rc;
+	}
+	case UNIX_CONTROL_PLAY: {
+		const char *names[] = { "InstanceID", "Speed" };
+		const char *values[] = { "0", "1" };
+		return call(TRANSPORT_SERVICE_ID, "Play", names, values, 2);
+	}
+	case UNIX_CONTROL_PAUSE:
+	case UNIX_CONTROL_STOP: {
+		const char *names[] = { "InstanceID" };
+		const char *values[] = { "0" };
+		return call(TRANSPORT_SERVICE_ID,
+			    opcode == UNIX_CONTROL_PAUSE ? "Pause" : "Stop",
+			    names, values, 1);
+	}
+	case UNIX_CONTROL_SEEK: {
+		if (arg_len != 4)
+			return ERROR_INVALID_ARGS;
+		const uint32_t t = get_u32(arg);
+		snprintf(value, sizeof(value), "%u:%02u:%02u",
+			 t / 3600, (t / 60) % 60, t % 60);
+		const char *names[] = { "InstanceID", "Unit", "Target" };
+		const char *values[] = { "0", "REL_TIME", value };
+		return call(TRANSPORT_SERVICE_ID, "Seek", names, values, 3);
+	}
+	case UNIX_CONTROL_SET_VOLUME:
+	case UNIX_CONTROL_SET_MUTE: {
+		if (arg_len != 1)
+			return ERROR_INVALID_ARGS;
+		const int is_volume = (opcode == UNIX_CONTROL_SET_VOLUME);
+		if (is_volume ? arg[0] > 100 : arg[0] > 1)
+			return ERROR_INVALID_ARGS;
+		snprintf(value, sizeof(value), "%d", arg[0]);
+		const char *names[] = { "InstanceID", "Channel",
+					is_volume ? "DesiredVolume"
+					: "DesiredMute" };
+		const char *values[] = { "0", "Master", value };
+		return call(CONTROL_SERVICE_ID,
+			    is_volume ? "SetVolume" : "SetMute",
+			    names, values, 3);
+	}
+	case UNIX_CONTROL_GET_POSITION: {
+		const char *names[] = { "InstanceID" };
+		const char *values[] = { "0" };
+		const char *out_names[] = { "RelTime", "TrackDuration" };
+		char *out_values[2];
+		rc = upnp_device_call_action(device_, TRANSPORT_SERVICE_ID,
+					     "GetPositionInfo",
+					     names, values, 1,
+					     out_names, out_values, 2);
+		if (rc == 0) {
+			put_u32(out, parse_seconds(out_values[0]));
+			put_u32(out + 4, parse_seconds(out_values[1]));
+			*out_len = 8;
+		}
+		free(out_values[0]);
+		free(out_values[1]);
+		return rc;
+	}
+	default:
+		return ERROR_INVALID_ACTION;
+	}
+}
+
+static void *handle_client(void *userdata) {
+	const int fd = (int) (intptr_t) userdata;
+	unsigned char *frame = (unsigned char*) malloc(MAX_FRAME_SIZE);
+	for (;;) {
+		unsigned char header[4];
+		if (read_all(fd, header, sizeof(header)) != 0)
+			break;
+		const uint32_t len = get_u32(header);
+		if (len > MAX_FRAME_SIZE) {
+			Log_error("unix", "Request of %u bytes; closing", len);
+			break;
+		}
+		if (read_all(fd, frame, len) != 0)
+			break;
+		// Length, status and results.
+		unsigned char response[4 + 2 + 8];
+		size_t result_len;
+		const int status = handle_request(frame, len,
+						  response + 6, &result_len);
+		put_u32(response, 2 + result_len);
+		response[4] = status >> 8;
+		response[5] = status;
+		if (write_all(fd, response, 6 + result_len) != 0)
+			break;
+	}
+	free(frame);
+	close(fd);
+	return NULL;
+}
+
+static void *accept_clients(void *userdata) {
+	const int listen_fd = (int) (intptr_t) userdata;
+	for (;;) {
+		const int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			Log_error("unix", "accept() failed: %s",
+				  strerror(errno));
+			break;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, handle_client,
+				   (void*) (intptr_t) fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(listen_fd);
+	return NULL;
+}
+
+int unix_control_start(const char *path, struct upnp_device *device) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		Log_error("unix", "Socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	// A socket left over from an earlier run; never remove anything else.
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	pthread_t thread;
+	// Anyone who can connect controls the player; only allow our own
+	// user. Nobody can connect before listen(), so there is no window.
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	    || chmod(path, S_IRUSR | S_IWUSR) != 0
+	    || listen(fd, 16) != 0) {
+		Log_error("unix", "Can't listen on %s: %s",
+			  path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	device_ = device;
+	if (pthread_create(&thread, NULL, accept_clients,
+			   (void*) (intptr_t) fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	Log_info("unix", "Control socket at %s", path);
+	return 0;
+}
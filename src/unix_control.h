@@ -0,0 +1,63 @@
+/* unix_control.h - Binary control protocol on a local Unix socket
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _UNIX_CONTROL_H
+#define _UNIX_CONTROL_H
+
+// Control for daemons on the same host, without HTTP and SOAP. Each
+// request and response is a frame: a 32 bit length of the rest of the
+// frame, then the content; all numbers big endian.
+//
+// Request:  u8 opcode, arguments.
+// Response: u16 status, 0 or the UPnP error code; results.
+//
+//   opcode  name           arguments         results
+//   1       SET_URI        uri (rest)        -
+//   2       PLAY           -                 -
+//   3       PAUSE          -                 -
+//   4       STOP           -                 -
+//   5       SEEK           u32 seconds       -
+//   6       SET_VOLUME     u8 0..100         -
+//   7       SET_MUTE       u8 0 or 1         -
+//   8       GET_POSITION   -                 u32 seconds, u32 duration
+//
+// Requests on one connection are answered in order; the operations run
+// the same action handlers as the UPnP controls.
+
+enum unix_control_opcode {
+	UNIX_CONTROL_SET_URI = 1,
+	UNIX_CONTROL_PLAY = 2,
+	UNIX_CONTROL_PAUSE = 3,
+	UNIX_CONTROL_STOP = 4,
+	UNIX_CONTROL_SEEK = 5,
+	UNIX_CONTROL_SET_VOLUME = 6,
+	UNIX_CONTROL_SET_MUTE = 7,
+	UNIX_CONTROL_GET_POSITION = 8,
+};
+
+struct upnp_device;
+
+// Listen on the Unix socket at "path", replacing a stale one. The socket
+// is made accessible to our own user only (mode 0600).
+// Returns 0 on success.
+int unix_control_start(const char *path, struct upnp_device *device);
+
+#endif /* _UNIX_CONTROL_H */
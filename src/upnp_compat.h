@@ -68,6 +68,7 @@ typedef struct Upnp_Action_Request UpnpActionRequest;
 #define UpnpActionRequest_set_ActionRequest(x, v) ((x)->ActionRequest = (v))
 #define UpnpActionRequest_get_ActionResult(x) ((x)->ActionResult)
 #define UpnpActionRequest_set_ActionResult(x, v) ((x)->ActionResult = (v))
+#define UpnpActionRequest_get_CtrlPtIPAddr(x) (&(x)->CtrlPtIPAddr)
 
 /* compat code for libupnp-1.8 */
 typedef struct Upnp_Action_Complete UpnpActionComplete;
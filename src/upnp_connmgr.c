@@ -353,8 +353,7 @@ int connmgr_init(const char* mime_filter_string) {
 
 static int get_protocol_info(struct action_event *event)
 {
-	upnp_append_variable(event, CONNMGR_VAR_SRC_PROTO_INFO, "Source");
-	upnp_append_variable(event, CONNMGR_VAR_SINK_PROTO_INFO, "Sink");
+	upnp_append_out_arguments(event);
 	return event->status;
 }
 
@@ -382,15 +381,7 @@ static int get_current_conn_info(struct action_event *event)
 	}
 	Log_info("connmgr", "Query ConnectionID='%s'", value);
 
-	upnp_append_variable(event, CONNMGR_VAR_AAT_RCS_ID, "RcsID");
-	upnp_append_variable(event, CONNMGR_VAR_AAT_AVT_ID, "AVTransportID");
-	upnp_append_variable(event, CONNMGR_VAR_AAT_PROTO_INFO,
-			     "ProtocolInfo");
-	upnp_append_variable(event, CONNMGR_VAR_AAT_CONN_MGR,
-			     "PeerConnectionManager");
-	upnp_append_variable(event, CONNMGR_VAR_AAT_CONN_ID, "PeerConnectionID");
-	upnp_append_variable(event, CONNMGR_VAR_AAT_DIR, "Direction");
-	upnp_append_variable(event, CONNMGR_VAR_AAT_CONN_STATUS, "Status");
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
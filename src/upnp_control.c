@@ -807,3 +807,8 @@ void upnp_control_register_variable_listener(variable_change_listener_t cb,
 					     void *userdata) {
 	VariableContainer_register_callback(state_variables_, cb, userdata);
 }
+
+void upnp_control_register_async_variable_listener(
+	variable_async_listener_t cb, void *userdata) {
+	VariableContainer_register_async_callback(state_variables_, cb, userdata);
+}
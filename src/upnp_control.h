@@ -32,4 +32,9 @@ struct service *upnp_control_get_service(void);
 void upnp_control_register_variable_listener(variable_change_listener_t cb,
 					     void *userdata);
 
+// Like upnp_control_register_variable_listener(), but the callback runs in a
+// thread of its own and may take its time.
+void upnp_control_register_async_variable_listener(
+	variable_async_listener_t cb, void *userdata);
+
 #endif /* _UPNP_CONTROL_H */
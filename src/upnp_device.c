@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 
 #include <upnp.h>
 #include <ithread.h>
@@ -44,11 +45,15 @@
 
 #include "logging.h"
 
+#include "http_frontend.h"
+#include "network_wait.h"
 #include "xmlescape.h"
 #include "webserver.h"
 #include "xmldoc.h"
 #include "upnp_service.h"
 #include "upnp_device.h"
+#include "upnp_multicast_event.h"
+#include "state_loop.h"
 #include "variable-container.h"
 
 // Enable logging of action requests.
@@ -60,6 +65,88 @@ struct upnp_device {
         UpnpDevice_Handle device_handle;
 };
 
+static int multicast_events_ = 0;
+
+// Port of our own HTTP server for description, control and eventing;
+// 0 to leave all of it to libupnp.
+static int http_frontend_port_ = 0;
+static struct upnp_device *frontend_device_ = NULL;
+static const char kDescriptionPath[] = "/description.xml";
+// Server-sent events with JSON of the service variables, if enabled.
+static int state_stream_ = 0;
+static const char kStateStreamPath[] = "/state-stream";
+
+static struct {
+	int max_subscriptions;
+	int timeout_sec;
+	int queue_length;
+	int queue_age_sec;
+} subscription_limits_;
+
+// Cost of sending out LastChange events, logged every kNotifyStatsInterval
+// events. The unicast part grows with the number of subscribers.
+static const int kNotifyStatsInterval = 100;
+static struct {
+	int count;
+	gint64 unicast_usec;
+	gint64 multicast_usec;
+} notify_stats_;
+
+// Token bucket per controller address. Controllers polling more often
+// than the rate limit get the last response to a query even if the state
+// changed since, until they have a token again.
+struct action_client {
+	double tokens;
+	gint64 last_refill;  // monotonic time, usec
+	unsigned long actions;
+	unsigned long over_limit;
+	unsigned long cached;
+};
+
+// Finished response to a Get* query with the same arguments, valid while
+// the service's variable container is at "version".
+struct cached_response {
+	int version;
+	IXML_Document *document;
+};
+
+// Forget all clients beyond this; they start over with a full bucket.
+static const guint kMaxActionClients = 256;
+// Responses to different arguments are kept apart; bound how many.
+static const guint kMaxCachedResponses = 64;
+
+static double action_rate_limit_ = 0;
+static ithread_mutex_t limiter_mutex_;
+static GHashTable *action_clients_ = NULL;   // address -> action_client
+
+static ithread_mutex_t cache_mutex_;
+static GHashTable *response_cache_ = NULL;   // cache key -> cached_response
+
+// An action run by upnp_device_call_action(): the handler reads the
+// arguments and writes the results here, without building or parsing any
+// XML.
+struct local_action_call {
+	const char *action_name;
+	const char **arg_names;
+	const char **arg_values;
+	int arg_count;
+	const char **out_names;
+	char **out_values;
+	int out_count;
+	int error_code;
+};
+
+static void set_local_result(struct local_action_call *call,
+			     const char *key, const char *value)
+{
+	for (int i = 0; i < call->out_count; ++i) {
+		if (strcmp(call->out_names[i], key) == 0) {
+			free(call->out_values[i]);
+			call->out_values[i] = strdup(value);
+		}
+	}
+}
+
 int upnp_add_response(struct action_event *event,
 		      const char *key, const char *value)
 {
@@ -70,6 +157,10 @@ int upnp_add_response(struct action_event *event,
 	if (event->status) {
 		return -1;
 	}
+	if (event->local) {
+		set_local_result(event->local, key, value);
+		return 0;
+	}
 
 	IXML_Document* actionResult = UpnpActionRequest_get_ActionResult(event->request);
 	const char* actionName = UpnpActionRequest_get_ActionName_cstr(event->request);
@@ -107,6 +198,68 @@ void upnp_append_variable(struct action_event *event,
 	ithread_mutex_unlock(service->service_mutex);
 }
 
+void upnp_append_out_arguments(struct action_event *event)
+{
+	struct service *service = event->service;
+	const char *actionName = event->local
+		? event->local->action_name
+		: UpnpActionRequest_get_ActionName_cstr(event->request);
+	struct action *action = find_action(service, actionName);
+	assert(action != NULL);
+	const struct argument *args =
+		service->action_arguments[action - service->actions];
+
+	if (event->status) {
+		return;
+	}
+	if (event->local) {
+		ithread_mutex_lock(service->service_mutex);
+		for (int i = 0; args && args[i].name; ++i) {
+			if (args[i].direction != PARAM_DIR_OUT)
+				continue;
+			const char *value = VariableContainer_get(
+				service->variable_container,
+				args[i].statevar, NULL);
+			assert(value != NULL);
+			set_local_result(event->local, args[i].name, value);
+		}
+		ithread_mutex_unlock(service->service_mutex);
+		return;
+	}
+
+	GString *xml = g_string_new(NULL);
+	g_string_printf(xml, "<u:%sResponse xmlns:u=\"%s\">",
+			actionName, service->service_type);
+	ithread_mutex_lock(service->service_mutex);
+	for (int i = 0; args && args[i].name; ++i) {
+		if (args[i].direction != PARAM_DIR_OUT)
+			continue;
+		const char *value = VariableContainer_get(
+			service->variable_container, args[i].statevar, NULL);
+		assert(value != NULL);   // triggers on invalid variable.
+		char *escaped = xmlescape(value, 0);
+		g_string_append_printf(xml, "<%s>%s</%s>",
+				       args[i].name, escaped, args[i].name);
+		free(escaped);
+	}
+	ithread_mutex_unlock(service->service_mutex);
+	g_string_append_printf(xml, "</u:%sResponse>", actionName);
+
+	IXML_Document *result = ixmlParseBuffer(xml->str);
+	g_string_free(xml, TRUE);
+	if (result == NULL) {
+		upnp_set_error(event, UPNP_SOAP_E_ACTION_FAILED,
+			       "Can't build %s response", actionName);
+		return;
+	}
+	IXML_Document *previous =
+		UpnpActionRequest_get_ActionResult(event->request);
+	if (previous) {
+		ixmlDocument_free(previous);
+	}
+	UpnpActionRequest_set_ActionResult(event->request, result);
+}
+
 void upnp_set_error(struct action_event *event, int error_code,
 		    const char *format, ...)
 {
@@ -118,6 +271,12 @@ void upnp_set_error(struct action_event *event, int error_code,
 	vsnprintf(buffer, sizeof(buffer), format, ap);
 	va_end(ap);
 
+	if (event->local) {
+		event->local->error_code = error_code;
+		Log_error("upnp", "%s: %s (%d)\n", __FUNCTION__,
+			  buffer, error_code);
+		return;
+	}
 	UpnpActionRequest_set_ActionResult(event->request, NULL);
 	UpnpActionRequest_set_ErrCode(event->request, UPNP_SOAP_E_ACTION_FAILED);
 	UpnpString *errStr = UpnpString_new();
@@ -132,6 +291,16 @@ const char *upnp_get_string(struct action_event *event, const char *key)
 {
 	IXML_Node *node;
 
+	if (event->local) {
+		for (int i = 0; i < event->local->arg_count; ++i) {
+			if (strcmp(event->local->arg_names[i], key) == 0)
+				return event->local->arg_values[i];
+		}
+		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+			       "Missing action request argument (%s)", key);
+		return NULL;
+	}
+
 	node = (IXML_Node *)UpnpActionRequest_get_ActionRequest(event->request);
 	if (node == NULL) {
 		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
@@ -161,6 +330,40 @@ const char *upnp_get_string(struct action_event *event, const char *key)
 	return NULL;
 }
 
+// Build the current state of the variables as one gigantic initial
+// LastChange update. Returns the XML escaped value, to be free()d.
+// All variables but "LastChange" itself and the A_ARG_TYPE ones, which
+// are not evented.
+static int is_evented_variable(const char *name)
+{
+	return strcmp("LastChange", name) != 0
+		&& strncmp("A_ARG_TYPE_", name, strlen("A_ARG_TYPE_")) != 0;
+}
+
+static char *initial_last_change(struct service *srv)
+{
+	ithread_mutex_lock(srv->service_mutex);
+	const int var_count =
+		VariableContainer_get_num_vars(srv->variable_container);
+	// TODO(hzeller): maybe use srv->last_change directly ?
+	upnp_last_change_builder_t *builder = UPnPLastChangeBuilder_new(srv->event_xml_ns);
+	for (int i = 0; i < var_count; ++i) {
+		const char *name;
+		const char *value =
+			VariableContainer_get(srv->variable_container, i, &name);
+		if (value && is_evented_variable(name)) {
+			UPnPLastChangeBuilder_add(builder, name, value);
+		}
+	}
+	ithread_mutex_unlock(srv->service_mutex);
+	char *xml_value = UPnPLastChangeBuilder_to_xml(builder);
+	Log_info("upnp", "Initial variable sync: %s", xml_value);
+	char *result = xmlescape(xml_value, 0);
+	free(xml_value);
+	UPnPLastChangeBuilder_delete(builder);
+	return result;
+}
+
 static int handle_subscription_request(struct upnp_device *priv,
 				       const UpnpSubscriptionRequest *sr_event)
 {
@@ -190,31 +393,7 @@ static int handle_subscription_request(struct upnp_device *priv,
 	const char *eventvar_values[] = {
 		NULL, NULL
 	};
-
-	// Build the current state of the variables as one gigantic initial
-	// LastChange update.
-	ithread_mutex_lock(srv->service_mutex);
-	const int var_count =
-		VariableContainer_get_num_vars(srv->variable_container);
-	// TODO(hzeller): maybe use srv->last_change directly ?
-	upnp_last_change_builder_t *builder = UPnPLastChangeBuilder_new(srv->event_xml_ns);
-	for (int i = 0; i < var_count; ++i) {
-		const char *name;
-		const char *value =
-			VariableContainer_get(srv->variable_container, i, &name);
-		// Send over all variables except "LastChange" itself. Also all
-		// A_ARG_TYPE variables are not evented.
-		if (value && strcmp("LastChange", name) != 0
-		    && strncmp("A_ARG_TYPE_", name, strlen("A_ARG_TYPE_")) != 0) {
-			UPnPLastChangeBuilder_add(builder, name, value);
-		}
-	}
-	ithread_mutex_unlock(srv->service_mutex);
-	char *xml_value = UPnPLastChangeBuilder_to_xml(builder);
-	Log_info("upnp", "Initial variable sync: %s", xml_value);
-	eventvar_values[0] = xmlescape(xml_value, 0);
-	free(xml_value);
-	UPnPLastChangeBuilder_delete(builder);
+	eventvar_values[0] = initial_last_change(srv);
 
 	const char *sid = UpnpSubscriptionRequest_get_SID_cstr(sr_event);
 	rc = UpnpAcceptSubscription(priv->device_handle,
@@ -234,14 +413,291 @@ static int handle_subscription_request(struct upnp_device *priv,
 	return result;
 }
 
+void upnp_device_enable_multicast_events(void) {
+	multicast_events_ = 1;
+}
+
+void upnp_device_set_subscription_limits(int max_subscriptions,
+					 int timeout_sec,
+					 int queue_length,
+					 int queue_age_sec) {
+	subscription_limits_.max_subscriptions = max_subscriptions;
+	subscription_limits_.timeout_sec = timeout_sec;
+	subscription_limits_.queue_length = queue_length;
+	subscription_limits_.queue_age_sec = queue_age_sec;
+}
+
+void upnp_device_set_http_frontend(int port) {
+	http_frontend_port_ = port;
+}
+
+void upnp_device_set_state_stream(int enable) {
+	state_stream_ = enable;
+}
+
+void upnp_device_set_action_rate_limit(double per_second) {
+	action_rate_limit_ = per_second;
+}
+
+static void free_cached_response(gpointer data) {
+	struct cached_response *response = (struct cached_response*) data;
+	ixmlDocument_free(response->document);
+	free(response);
+}
+
+static void init_response_cache(void) {
+	ithread_mutex_init(&cache_mutex_, NULL);
+	response_cache_ = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, free_cached_response);
+}
+
+static void init_action_rate_limit(void) {
+	if (action_rate_limit_ <= 0)
+		return;
+	ithread_mutex_init(&limiter_mutex_, NULL);
+	action_clients_ = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, g_free);
+	Log_info("upnp", "Limiting fresh queries to %.1f/s per controller",
+		 action_rate_limit_);
+}
+
+static void get_client_address(UpnpActionRequest *request,
+			       char *buffer, size_t len) {
+	const struct sockaddr_storage *addr =
+		UpnpActionRequest_get_CtrlPtIPAddr(request);
+	buffer[0] = '\0';
+	if (addr->ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((const struct sockaddr_in*) addr)->sin_addr,
+			  buffer, len);
+	} else if (addr->ss_family == AF_INET6) {
+		inet_ntop(AF_INET6,
+			  &((const struct sockaddr_in6*) addr)->sin6_addr,
+			  buffer, len);
+	}
+}
+
+// Take a token from the bucket of the controller that sent "request".
+// Returns whether it was out of tokens.
+static gboolean client_over_limit(UpnpActionRequest *request) {
+	char address[INET6_ADDRSTRLEN];
+	get_client_address(request, address, sizeof(address));
+	const gint64 now = g_get_monotonic_time();
+	const double burst = action_rate_limit_ < 1 ? 1 : action_rate_limit_;
+
+	ithread_mutex_lock(&limiter_mutex_);
+	struct action_client *client = (struct action_client*)
+		g_hash_table_lookup(action_clients_, address);
+	if (client == NULL) {
+		if (g_hash_table_size(action_clients_) >= kMaxActionClients) {
+			g_hash_table_remove_all(action_clients_);
+		}
+		client = g_new0(struct action_client, 1);
+		client->tokens = burst;
+		client->last_refill = now;
+		g_hash_table_insert(action_clients_, g_strdup(address), client);
+	}
+	client->tokens += (now - client->last_refill) * action_rate_limit_
+		/ G_USEC_PER_SEC;
+	if (client->tokens > burst) client->tokens = burst;
+	client->last_refill = now;
+	const gboolean over_limit = client->tokens < 1;
+	if (over_limit) {
+		client->over_limit++;
+	} else {
+		client->tokens -= 1;
+	}
+	if (++client->actions % 1000 == 0) {
+		Log_info("upnp", "Controller %s: %lu actions, %lu over the "
+			 "limit, %lu answered from cache", address,
+			 client->actions, client->over_limit, client->cached);
+	}
+	ithread_mutex_unlock(&limiter_mutex_);
+	return over_limit;
+}
+
+// Count a cached answer for the controller; it exists, as we just
+// looked at its bucket.
+static void count_cached_answer(UpnpActionRequest *request) {
+	char address[INET6_ADDRSTRLEN];
+	get_client_address(request, address, sizeof(address));
+	ithread_mutex_lock(&limiter_mutex_);
+	struct action_client *client = (struct action_client*)
+		g_hash_table_lookup(action_clients_, address);
+	if (client) client->cached++;
+	ithread_mutex_unlock(&limiter_mutex_);
+}
+
+// The cache key of a query: the action and its arguments in order. Only
+// queries that ran successfully are cached, so a request with missing or
+// wrong arguments never gets a cached success.
+static char *response_cache_key(struct action *action,
+				UpnpActionRequest *request) {
+	GString *key = g_string_new(NULL);
+	g_string_append_printf(key, "%p", (void*) action);
+	IXML_Node *node =
+		(IXML_Node*) UpnpActionRequest_get_ActionRequest(request);
+	if (node != NULL)
+		node = ixmlNode_getFirstChild(node);
+	if (node != NULL)
+		node = ixmlNode_getFirstChild(node);
+	for (/**/; node != NULL; node = ixmlNode_getNextSibling(node)) {
+		IXML_Node *text = ixmlNode_getFirstChild(node);
+		const char *value = text ? ixmlNode_getNodeValue(text) : NULL;
+		g_string_append_printf(key, "\n%s=%s", ixmlNode_getNodeName(node),
+				       value ? value : "");
+	}
+	return g_string_free(key, FALSE);
+}
+
+// Set a copy of the last response to this query as result, if the state
+// it was made from is still current, or in any case if "allow_stale".
+// Returns whether it did.
+static gboolean answer_from_cache(struct service *srv, const char *key,
+				  UpnpActionRequest *request,
+				  gboolean allow_stale) {
+	const int version =
+		VariableContainer_get_version(srv->variable_container);
+	IXML_Document *result = NULL;
+	ithread_mutex_lock(&cache_mutex_);
+	struct cached_response *response = (struct cached_response*)
+		g_hash_table_lookup(response_cache_, key);
+	if (response && (allow_stale || response->version == version)) {
+		// libupnp frees the result after sending it.
+		result = (IXML_Document*) ixmlNode_cloneNode(
+			(IXML_Node*) response->document, TRUE);
+	}
+	ithread_mutex_unlock(&cache_mutex_);
+	if (result == NULL)
+		return FALSE;
+	UpnpActionRequest_set_ActionResult(request, result);
+	UpnpActionRequest_set_ErrCode(request, UPNP_E_SUCCESS);
+	if (action_clients_ != NULL) {
+		count_cached_answer(request);
+	}
+	return TRUE;
+}
+
+// Keep the response to a query until the state changes. Tagged with the
+// version before the action ran: if a variable changed meanwhile, the
+// response might not reflect it and is not used.
+static void remember_response(const char *key, int version,
+			      IXML_Document *result) {
+	IXML_Document *copy = (IXML_Document*) ixmlNode_cloneNode(
+		(IXML_Node*) result, TRUE);
+	if (copy == NULL)
+		return;
+	struct cached_response *response = (struct cached_response*)
+		malloc(sizeof(*response));
+	response->version = version;
+	response->document = copy;
+	ithread_mutex_lock(&cache_mutex_);
+	if (g_hash_table_size(response_cache_) >= kMaxCachedResponses
+	    && g_hash_table_lookup(response_cache_, key) == NULL) {
+		g_hash_table_remove_all(response_cache_);
+	}
+	g_hash_table_replace(response_cache_, g_strdup(key), response);
+	ithread_mutex_unlock(&cache_mutex_);
+}
+
+static void apply_subscription_limits(UpnpDevice_Handle handle) {
+	if (subscription_limits_.max_subscriptions > 0) {
+		UpnpSetMaxSubscriptions(handle,
+					subscription_limits_.max_subscriptions);
+	}
+	if (subscription_limits_.timeout_sec > 0) {
+		UpnpSetMaxSubscriptionTimeOut(handle,
+					      subscription_limits_.timeout_sec);
+	}
+#if UPNP_VERSION >= 10619
+	if (subscription_limits_.queue_length > 0
+	    || subscription_limits_.queue_age_sec > 0) {
+		// libupnp defaults: 10 events, 30 seconds.
+		UpnpSetEventQueueLimits(
+			subscription_limits_.queue_length > 0
+			? subscription_limits_.queue_length : 10,
+			subscription_limits_.queue_age_sec > 0
+			? subscription_limits_.queue_age_sec : 30);
+	}
+#else
+	if (subscription_limits_.queue_length > 0
+	    || subscription_limits_.queue_age_sec > 0) {
+		Log_error("upnp", "Event queue limits need libupnp >= 1.6.19");
+	}
+#endif
+	Log_info("upnp", "Subscriptions: max %d, timeout %ds, queue %d "
+		 "events/%ds (0: default)",
+		 subscription_limits_.max_subscriptions,
+		 subscription_limits_.timeout_sec,
+		 subscription_limits_.queue_length,
+		 subscription_limits_.queue_age_sec);
+	if (http_frontend_port_ == 0) {
+		// libupnp doesn't tell us about failed deliveries.
+		Log_info("upnp", "Subscribers that stop answering are dropped "
+			 "when their subscription expires; with "
+			 "--http-frontend-port after failed deliveries.");
+	}
+}
+
+// GENA propertyset with the given variables; the values are already
+// XML escaped. Returns a newly allocated string.
+static char *build_propertyset(const char **varnames, const char **varvalues,
+			       int varcount)
+{
+	GString *body = g_string_new("<?xml version=\"1.0\"?>\r\n"
+				     "<e:propertyset xmlns:e=\"urn:schemas-"
+				     "upnp-org:event-1-0\">");
+	for (int i = 0; i < varcount; ++i) {
+		g_string_append_printf(body,
+				       "<e:property><%s>%s</%s></e:property>",
+				       varnames[i], varvalues[i], varnames[i]);
+	}
+	g_string_append(body, "</e:propertyset>");
+	return g_string_free(body, FALSE);
+}
+
 int upnp_device_notify(struct upnp_device *device,
                        const char *serviceID,
                        const char **varnames,
                        const char **varvalues, int varcount)
 {
-        UpnpNotify(device->device_handle,
-                   device->upnp_device_descriptor->udn, serviceID,
-		   varnames, varvalues, varcount);
+	struct service *srv = find_service(device->upnp_device_descriptor,
+					   serviceID);
+	const gint64 start = g_get_monotonic_time();
+	if (http_frontend_port_ > 0) {
+		if (srv != NULL) {
+			char *propertyset = build_propertyset(varnames,
+							      varvalues,
+							      varcount);
+			http_frontend_notify(srv->event_url, propertyset);
+			free(propertyset);
+		}
+	} else {
+		UpnpNotify(device->device_handle,
+			   device->upnp_device_descriptor->udn, serviceID,
+			   varnames, varvalues, varcount);
+	}
+	const gint64 unicast_done = g_get_monotonic_time();
+
+	// Subscribers keep getting unicast NOTIFYs; listeners that support
+	// multicast eventing don't need to subscribe in the first place.
+	if (srv != NULL && srv->multicast_events) {
+		upnp_multicast_event_send(device->upnp_device_descriptor->udn,
+					  srv, varnames, varvalues, varcount);
+	}
+
+	ithread_mutex_lock(&(device->device_mutex));
+	notify_stats_.count++;
+	notify_stats_.unicast_usec += unicast_done - start;
+	notify_stats_.multicast_usec += g_get_monotonic_time() - unicast_done;
+	if (notify_stats_.count == kNotifyStatsInterval) {
+		Log_info("upnp", "Event fan-out: %" G_GINT64_FORMAT "us unicast, "
+			 "%" G_GINT64_FORMAT "us multicast per event (avg of %d)",
+			 notify_stats_.unicast_usec / notify_stats_.count,
+			 notify_stats_.multicast_usec / notify_stats_.count,
+			 notify_stats_.count);
+		memset(&notify_stats_, 0, sizeof(notify_stats_));
+	}
+	ithread_mutex_unlock(&(device->device_mutex));
 
 	return 0;
 }
@@ -299,6 +755,21 @@ static int handle_action_request(struct upnp_device *priv,
 		return -1;
 	}
 
+	// Get* actions only report state; answer them with the last
+	// response to the same arguments while the state is the same.
+	// Controllers over the rate limit get it even if it changed.
+	const int is_query = strncmp(actionName, "Get", 3) == 0;
+	const gboolean over_limit =
+		action_rate_limit_ > 0 && client_over_limit(ar_event);
+	char *cache_key = is_query
+		? response_cache_key(event_action, ar_event) : NULL;
+	if (cache_key != NULL
+	    && answer_from_cache(event_service, cache_key, ar_event,
+				 over_limit)) {
+		g_free(cache_key);
+		return 0;
+	}
+
 	// We want to send the LastChange event only after the action is
 	// finished - just to be conservative, we don't know how clients
 	// react to get LastChange notifictions while in the middle of
@@ -339,10 +810,18 @@ static int handle_action_request(struct upnp_device *priv,
 		event.status = 0;
 		event.service = event_service;
                 event.device = priv;
+		event.local = NULL;
+		const int version = VariableContainer_get_version(
+			event_service->variable_container);
 
 		rc = (event_action->callback) (&event);
 		if (rc == 0) {
 			UpnpActionRequest_set_ErrCode(event.request, UPNP_E_SUCCESS);
+			if (cache_key != NULL
+			    && UpnpActionRequest_get_ActionResult(ar_event)) {
+				remember_response(cache_key, version,
+						  UpnpActionRequest_get_ActionResult(ar_event));
+			}
 #ifdef ENABLE_ACTION_LOGGING
 			if (UpnpActionRequest_get_ActionResult(ar_event)) {
 				char *action_result_xml = ixmlDocumenttoString(
@@ -387,15 +866,95 @@ static int handle_action_request(struct upnp_device *priv,
 		UPnPLastChangeCollector_finish(event_service->last_change);
 		ithread_mutex_unlock(event_service->service_mutex);
 	}
+	g_free(cache_key);
 	return 0;
 }
 
+struct action_call {
+	struct upnp_device *priv;
+	UpnpActionRequest *request;
+};
+
+static void run_action_call(void *userdata)
+{
+	struct action_call *call = (struct action_call*) userdata;
+	handle_action_request(call->priv, call->request);
+}
+
+// Actions change the player and service state, which is owned by the main
+// loop; run them there, one at a time, while the calling thread waits.
+static void dispatch_action_request(struct upnp_device *priv,
+				    UpnpActionRequest *request)
+{
+	struct action_call call = { priv, request };
+	state_loop_call(run_action_call, &call);
+}
+
+struct local_action {
+	struct action_event *event;
+	struct action *action;
+	int rc;
+};
+
+static void run_local_action(void *userdata)
+{
+	struct local_action *call = (struct local_action*) userdata;
+	struct service *srv = call->event->service;
+	// Like handle_action_request(): one LastChange after the action.
+	if (srv->last_change) {
+		ithread_mutex_lock(srv->service_mutex);
+		UPnPLastChangeCollector_start(srv->last_change);
+		ithread_mutex_unlock(srv->service_mutex);
+	}
+	call->rc = call->action->callback(call->event);
+	if (srv->last_change) {
+		ithread_mutex_lock(srv->service_mutex);
+		UPnPLastChangeCollector_finish(srv->last_change);
+		ithread_mutex_unlock(srv->service_mutex);
+	}
+}
+
+int upnp_device_call_action(struct upnp_device *device,
+			    const char *service_id, const char *action_name,
+			    const char **arg_names, const char **arg_values,
+			    int arg_count,
+			    const char **out_names, char **out_values,
+			    int out_count)
+{
+	for (int i = 0; i < out_count; ++i) {
+		out_values[i] = NULL;
+	}
+	struct service *srv = find_service(device->upnp_device_descriptor,
+					   service_id);
+	struct action *action = find_action(srv, action_name);
+	if (action == NULL || action->callback == NULL)
+		return 401;  // Invalid Action
+
+	struct local_action_call local = {
+		action_name, arg_names, arg_values, arg_count,
+		out_names, out_values, out_count, 0
+	};
+	struct action_event event;
+	event.request = NULL;
+	event.status = 0;
+	event.service = srv;
+	event.device = device;
+	event.local = &local;
+	struct local_action call = { &event, action, 0 };
+	state_loop_call(run_local_action, &call);
+
+	if (local.error_code != 0)
+		return local.error_code;
+	return (call.rc == 0 && event.status == 0)
+		? 0 : UPNP_SOAP_E_ACTION_FAILED;
+}
+
 static UPNP_CALLBACK(event_handler, EventType, event, userdata)
 {
 	struct upnp_device *priv = (struct upnp_device *) userdata;
 	switch (EventType) {
 	case UPNP_CONTROL_ACTION_REQUEST:
-		handle_action_request(priv, (UpnpActionRequest*)event);
+		dispatch_action_request(priv, (UpnpActionRequest*)event);
 		break;
 
 	case UPNP_CONTROL_GET_VAR_REQUEST:
@@ -414,6 +973,339 @@ static UPNP_CALLBACK(event_handler, EventType, event, userdata)
 	return 0;
 }
 
+#if UPNP_VERSION >= 10800
+// A request as libupnp would hand it to us, for actions that come in some
+// other way. Takes ownership of "action_doc", which is the action element
+// with the arguments as children.
+static UpnpActionRequest *new_action_request(struct upnp_device *device,
+					     struct service *srv,
+					     const char *action_name,
+					     IXML_Document *action_doc,
+					     const struct sockaddr_storage *peer)
+{
+	UpnpActionRequest *request = UpnpActionRequest_new();
+	UpnpActionRequest_strcpy_ActionName(request, action_name);
+	UpnpActionRequest_strcpy_DevUDN(request,
+					device->upnp_device_descriptor->udn);
+	UpnpActionRequest_strcpy_ServiceID(request, srv->service_id);
+	UpnpActionRequest_set_ActionRequest(request, action_doc);
+	UpnpActionRequest_set_CtrlPtIPAddr(request, peer);
+	return request;
+}
+
+static void delete_action_request(UpnpActionRequest *request)
+{
+	IXML_Document *doc = UpnpActionRequest_get_ActionResult(request);
+	if (doc) ixmlDocument_free(doc);
+	doc = UpnpActionRequest_get_ActionRequest(request);
+	if (doc) ixmlDocument_free(doc);
+	UpnpActionRequest_delete(request);
+}
+
+// -- Handlers of the HTTP front-end; all called from its thread.
+// Actions are handed on to the main loop.
+
+static const char kSoapEnvelopeStart[] =
+	"<?xml version=\"1.0\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+static const char kSoapEnvelopeEnd[] = "</s:Body></s:Envelope>";
+
+static int frontend_get(const char *path, char **body, size_t *len,
+			const char **content_type)
+{
+	return webserver_get_file(path, body, len, content_type);
+}
+
+// Returns the first child element of "node" with the local name "name",
+// or the first child element at all if "name" is NULL.
+static IXML_Node *child_element(IXML_Node *node, const char *name)
+{
+	node = node ? ixmlNode_getFirstChild(node) : NULL;
+	for (/**/; node != NULL; node = ixmlNode_getNextSibling(node)) {
+		if (ixmlNode_getNodeType(node) == eELEMENT_NODE
+		    && (name == NULL
+			|| strcmp(ixmlNode_getLocalName(node), name) == 0)) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+static struct service *find_service_by_url(const char *path, int event_url)
+{
+	struct upnp_device_descriptor *device_def =
+		frontend_device_->upnp_device_descriptor;
+	struct service *srv;
+	for (int i = 0; (srv = device_def->services[i]); i++) {
+		const char *url = event_url ? srv->event_url : srv->control_url;
+		if (strcmp(url, path) == 0)
+			return srv;
+	}
+	return NULL;
+}
+
+struct frontend_action {
+	UpnpActionRequest *request;
+	struct http_frontend_request *http_request;
+};
+
+// On the main loop: run the action and hand the response envelope back
+// to the front-end.
+static void run_frontend_action(void *userdata)
+{
+	struct frontend_action *call = (struct frontend_action*) userdata;
+	UpnpActionRequest *request = call->request;
+	handle_action_request(frontend_device_, request);
+
+	int status;
+	char *response;
+	IXML_Document *result = UpnpActionRequest_get_ActionResult(request);
+	if (UpnpActionRequest_get_ErrCode(request) == UPNP_E_SUCCESS
+	    && result != NULL) {
+		DOMString result_xml =
+			ixmlPrintNode(ixmlNode_getFirstChild((IXML_Node*) result));
+		response = g_strdup_printf("%s%s%s", kSoapEnvelopeStart,
+					   result_xml, kSoapEnvelopeEnd);
+		ixmlFreeDOMString(result_xml);
+		status = 200;
+	} else {
+		char *description = xmlescape(
+			UpnpActionRequest_get_ErrStr_cstr(request), 0);
+		response = g_strdup_printf(
+			"%s<s:Fault><faultcode>s:Client</faultcode>"
+			"<faultstring>UPnPError</faultstring><detail>"
+			"<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
+			"<errorCode>%d</errorCode>"
+			"<errorDescription>%s</errorDescription>"
+			"</UPnPError></detail></s:Fault>%s",
+			kSoapEnvelopeStart,
+			UpnpActionRequest_get_ErrCode(request), description,
+			kSoapEnvelopeEnd);
+		free(description);
+		status = 500;
+	}
+	delete_action_request(request);
+	http_frontend_control_done(call->http_request, status, response);
+	free(call);
+}
+
+// Parse the SOAP action in "body" here and run it through
+// handle_action_request() on the main loop, just like a request that came
+// through libupnp. The front-end goes on serving others meanwhile.
+static void frontend_control(const char *path, const char *body,
+			     const struct sockaddr_storage *peer,
+			     struct http_frontend_request *http_request)
+{
+	struct service *srv = find_service_by_url(path, 0);
+	if (srv == NULL) {
+		http_frontend_control_done(http_request, 404, NULL);
+		return;
+	}
+
+	IXML_Document *envelope = ixmlParseBuffer(body);
+	IXML_Node *action_node =
+		child_element(child_element(child_element(
+			(IXML_Node*) envelope, "Envelope"), "Body"), NULL);
+	if (action_node == NULL) {
+		if (envelope) ixmlDocument_free(envelope);
+		http_frontend_control_done(http_request, 400, NULL);
+		return;
+	}
+	// The action element becomes the document of the request, as in
+	// libupnp, so that upnp_get_string() finds the arguments.
+	DOMString action_xml = ixmlPrintNode(action_node);
+	IXML_Document *action_doc = ixmlParseBuffer(action_xml);
+	ixmlFreeDOMString(action_xml);
+
+	struct frontend_action *call = (struct frontend_action*)
+		malloc(sizeof(*call));
+	call->request = new_action_request(frontend_device_, srv,
+					   ixmlNode_getLocalName(action_node),
+					   action_doc, peer);
+	call->http_request = http_request;
+	ixmlDocument_free(envelope);
+	state_loop_post(run_frontend_action, call);
+}
+
+static char *frontend_initial_event(const char *path)
+{
+	struct service *srv = find_service_by_url(path, 1);
+	if (srv == NULL)
+		return NULL;
+	const char *names[] = { "LastChange" };
+	const char *values[] = { initial_last_change(srv) };
+	char *result = build_propertyset(names, values, 1);
+	free((char*)values[0]);
+	return result;
+}
+
+// -- State stream: {"AVTransport":{"TransportState":"PLAYING"},...} as
+// snapshot, then the same with only the changed variable for each change.
+
+static void append_json_string(GString *out, const char *value)
+{
+	g_string_append_c(out, '"');
+	for (const char *c = value; *c; ++c) {
+		switch (*c) {
+		case '"':  g_string_append(out, "\\\""); break;
+		case '\\': g_string_append(out, "\\\\"); break;
+		case '\n': g_string_append(out, "\\n"); break;
+		case '\r': g_string_append(out, "\\r"); break;
+		case '\t': g_string_append(out, "\\t"); break;
+		default:
+			if ((unsigned char) *c < 0x20) {
+				g_string_append_printf(out, "\\u%04x", *c);
+			} else {
+				g_string_append_c(out, *c);
+			}
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
+// "AVTransport" of "urn:upnp-org:serviceId:AVTransport".
+static const char *short_service_name(const struct service *srv)
+{
+	const char *colon = strrchr(srv->service_id, ':');
+	return colon ? colon + 1 : srv->service_id;
+}
+
+// Index of "srv" in the device, which is its source on the state stream.
+static int stream_source(const struct service *srv)
+{
+	struct upnp_device_descriptor *device_def =
+		frontend_device_->upnp_device_descriptor;
+	for (int i = 0; device_def->services[i]; i++) {
+		if (device_def->services[i] == srv)
+			return i;
+	}
+	return -1;
+}
+
+static char *frontend_stream_snapshot(const char *path, int *versions)
+{
+	if (!state_stream_ || strcmp(path, kStateStreamPath) != 0)
+		return NULL;
+	struct upnp_device_descriptor *device_def =
+		frontend_device_->upnp_device_descriptor;
+	GString *json = g_string_new("{");
+	struct service *srv;
+	for (int i = 0; (srv = device_def->services[i]); i++) {
+		if (srv->variable_container == NULL
+		    || i >= HTTP_FRONTEND_STREAM_SOURCES)
+			continue;
+		if (json->len > 1)
+			g_string_append_c(json, ',');
+		append_json_string(json, short_service_name(srv));
+		g_string_append(json, ":{");
+		const size_t start = json->len;
+		ithread_mutex_lock(srv->service_mutex);
+		versions[i] =
+			VariableContainer_get_version(srv->variable_container);
+		const int var_count =
+			VariableContainer_get_num_vars(srv->variable_container);
+		for (int v = 0; v < var_count; ++v) {
+			const char *name;
+			const char *value = VariableContainer_get(
+				srv->variable_container, v, &name);
+			if (value == NULL || !is_evented_variable(name))
+				continue;
+			if (json->len > start)
+				g_string_append_c(json, ',');
+			append_json_string(json, name);
+			g_string_append_c(json, ':');
+			append_json_string(json, value);
+		}
+		ithread_mutex_unlock(srv->service_mutex);
+		g_string_append_c(json, '}');
+	}
+	g_string_append_c(json, '}');
+	return g_string_free(json, FALSE);
+}
+
+// Registered as asynchronous listener, so that building and queueing the
+// delta happens outside the service lock. As it arrives late, the delta is
+// tagged with the version, so that clients whose snapshot already had it
+// don't see an older value after a newer one.
+static void stream_variable_change(void *userdata, int version, int var_num,
+				   const char *var_name,
+				   const char *old_value,
+				   const char *new_value)
+{
+	(void)var_num;
+	(void)old_value;
+	const struct service *srv = (const struct service*) userdata;
+	const int source = stream_source(srv);
+	if (!is_evented_variable(var_name) || source < 0
+	    || source >= HTTP_FRONTEND_STREAM_SOURCES)
+		return;
+	GString *json = g_string_new("{");
+	append_json_string(json, short_service_name(srv));
+	g_string_append(json, ":{");
+	append_json_string(json, var_name);
+	g_string_append_c(json, ':');
+	append_json_string(json, new_value);
+	g_string_append(json, "}}");
+	http_frontend_stream(kStateStreamPath, json->str, source, version);
+	g_string_free(json, TRUE);
+}
+
+static void start_state_stream(struct upnp_device_descriptor *device_def)
+{
+	struct service *srv;
+	for (int i = 0; (srv = device_def->services[i]); i++) {
+		if (srv->variable_container == NULL)
+			continue;
+		VariableContainer_register_async_callback(
+			srv->variable_container, stream_variable_change, srv);
+	}
+	Log_info("upnp", "State stream at http://%s:%d%s",
+		 UpnpGetServerIpAddress(), http_frontend_port_,
+		 kStateStreamPath);
+}
+
+static const struct http_frontend_handlers frontend_handlers = {
+	frontend_get,
+	frontend_control,
+	frontend_initial_event,
+	frontend_stream_snapshot,
+};
+
+// Serve description, control and eventing ourselves and register the
+// device with libupnp by URL, so that it only does the SSDP part.
+static int register_with_http_frontend(struct upnp_device *result_device)
+{
+	struct http_frontend_limits limits;
+	limits.max_subscriptions = subscription_limits_.max_subscriptions;
+	limits.timeout_sec = subscription_limits_.timeout_sec;
+	limits.queue_length = subscription_limits_.queue_length;
+	frontend_device_ = result_device;
+	if (http_frontend_start(http_frontend_port_, &frontend_handlers,
+				&limits) != 0) {
+		return UPNP_E_INIT_FAILED;
+	}
+	if (state_stream_) {
+		start_state_stream(result_device->upnp_device_descriptor);
+	}
+	char *url = g_strdup_printf("http://%s:%d%s", UpnpGetServerIpAddress(),
+				    http_frontend_port_, kDescriptionPath);
+	const int rc = UpnpRegisterRootDevice2(UPNPREG_URL_DESC,
+					       url, 0, 0,
+					       &event_handler, result_device,
+					       &(result_device->device_handle));
+	g_free(url);
+	return rc;
+}
+#else
+static int register_with_http_frontend(struct upnp_device *result_device)
+{
+	Log_error("upnp", "The HTTP front-end needs libupnp >= 1.8");
+	return UPNP_E_INIT_FAILED;
+}
+#endif
+
 static gboolean initialize_device(struct upnp_device_descriptor *device_def,
 				  struct upnp_device *result_device,
 				  const char *interface_name,
@@ -422,17 +1314,40 @@ static gboolean initialize_device(struct upnp_device_descriptor *device_def,
 	int rc;
 	char *buf;
 
-	rc = UpnpInit2(interface_name, port);
 	/* There have been situations reported in which UPNP had issues
 	 * initializing right after network came up. #129
+	 * So wait for the interface to have an address, and initialize as
+	 * soon as it has. If the address went away again in between, wait
+	 * for the next one. Failures while we have an address (e.g. one
+	 * that is still tentative) are retried with backoff for a minute.
 	 */
-	int retries_left = 60;
-	static const int kRetryTimeMs = 1000;
-	while (rc != UPNP_E_SUCCESS && retries_left--) {
-		usleep(kRetryTimeMs * 1000);
-		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Retrying... (%ds)",
-			  interface_name, port, UpnpGetErrorMessage(rc), rc, retries_left);
+	static const gint64 kRetryTimeoutUs = 60 * G_USEC_PER_SEC;
+	static const int kMaxRetryTimeMs = 1000;
+	int retry_ms = 10;
+	gint64 give_up_at = 0;
+	gint64 link_up = 0;
+	for (;;) {
+		const gint64 waited_since = network_wait_ready(interface_name);
+		if (waited_since > 0 && link_up == 0)
+			link_up = waited_since;
 		rc = UpnpInit2(interface_name, port);
+		if (rc == UPNP_E_SUCCESS)
+			break;
+		if (!network_is_ready(interface_name)) {
+			Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Address gone; waiting again.",
+				  interface_name, port, UpnpGetErrorMessage(rc), rc);
+			continue;
+		}
+		const gint64 now = g_get_monotonic_time();
+		if (give_up_at == 0)
+			give_up_at = now + kRetryTimeoutUs;
+		if (now >= give_up_at)
+			break;
+		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Retrying in %dms.",
+			  interface_name, port, UpnpGetErrorMessage(rc), rc,
+			  retry_ms);
+		usleep(retry_ms * 1000);
+		retry_ms = MIN(2 * retry_ms, kMaxRetryTimeMs);
 	}
 	if (UPNP_E_SUCCESS != rc) {
 		Log_error("upnp", "UpnpInit2(interface=%s, port=%d) Error: %s (%d). Giving up.",
@@ -442,35 +1357,45 @@ static gboolean initialize_device(struct upnp_device_descriptor *device_def,
 	Log_info("upnp", "Registered IP=%s port=%d\n",
 		 UpnpGetServerIpAddress(), UpnpGetServerPort());
 
-	rc = UpnpEnableWebserver(TRUE);
-	if (UPNP_E_SUCCESS != rc) {
-		Log_error("upnp", "UpnpEnableWebServer() Error: %s (%d)",
-			  UpnpGetErrorMessage(rc), rc);
+	if (multicast_events_
+	    && upnp_multicast_event_init(UpnpGetServerIpAddress()) != 0) {
 		return FALSE;
 	}
 
-	if (!webserver_register_callbacks())
-	  return FALSE;
+	if (http_frontend_port_ > 0) {
+		rc = register_with_http_frontend(result_device);
+	} else {
+		rc = UpnpEnableWebserver(TRUE);
+		if (UPNP_E_SUCCESS != rc) {
+			Log_error("upnp", "UpnpEnableWebServer() Error: %s (%d)",
+				  UpnpGetErrorMessage(rc), rc);
+			return FALSE;
+		}
 
-	rc = UpnpAddVirtualDir("/upnp");
-	if (UPNP_E_SUCCESS != rc) {
-		Log_error("upnp", "UpnpAddVirtualDir() Error: %s (%d)",
-			  UpnpGetErrorMessage(rc), rc);
-		return FALSE;
-	}
+		if (!webserver_register_callbacks())
+			return FALSE;
+
+		rc = UpnpAddVirtualDir("/upnp");
+		if (UPNP_E_SUCCESS != rc) {
+			Log_error("upnp", "UpnpAddVirtualDir() Error: %s (%d)",
+				  UpnpGetErrorMessage(rc), rc);
+			return FALSE;
+		}
 
-       	buf = upnp_create_device_desc(device_def);
-	rc = UpnpRegisterRootDevice2(UPNPREG_BUF_DESC,
-				     buf, strlen(buf), 1,
-				     &event_handler, result_device,
-				     &(result_device->device_handle));
-	free(buf);
+		buf = upnp_create_device_desc(device_def);
+		rc = UpnpRegisterRootDevice2(UPNPREG_BUF_DESC,
+					     buf, strlen(buf), 1,
+					     &event_handler, result_device,
+					     &(result_device->device_handle));
+		free(buf);
+	}
 
 	if (UPNP_E_SUCCESS != rc) {
 		Log_error("upnp", "UpnpRegisterRootDevice2() Error: %s (%d)",
 			  UpnpGetErrorMessage(rc), rc);
 		return FALSE;
 	}
+	apply_subscription_limits(result_device->device_handle);
 
 	rc = UpnpSendAdvertisement(result_device->device_handle, 100);
 	if (UPNP_E_SUCCESS != rc) {
@@ -478,6 +1403,10 @@ static gboolean initialize_device(struct upnp_device_descriptor *device_def,
 			  UpnpGetErrorMessage(rc), rc);
 		return FALSE;
 	}
+	if (link_up > 0) {
+		Log_info("upnp", "Advertised %.1fms after the network came up",
+			 (g_get_monotonic_time() - link_up) / 1000.0);
+	}
 
 	return TRUE;
 }
@@ -503,6 +1432,8 @@ struct upnp_device *upnp_device_init(struct upnp_device_descriptor *device_def,
 	struct upnp_device *result_device = (struct upnp_device*)malloc(sizeof(*result_device));
 	result_device->upnp_device_descriptor = device_def;
 	ithread_mutex_init(&(result_device->device_mutex), NULL);
+	init_response_cache();
+	init_action_rate_limit();
 
 	/* register icons in web server */
         for (int i = 0; (icon_entry = device_def->icons[i]); i++) {
@@ -511,10 +1442,16 @@ struct upnp_device *upnp_device_init(struct upnp_device_descriptor *device_def,
 
 	/* generate and register service schemas in web server */
         for (int i = 0; (srv = device_def->services[i]); i++) {
+		srv->multicast_events = multicast_events_;
        		buf = upnp_get_scpd(srv);
 		assert(buf != NULL);
 		webserver_register_buf(srv->scpd_url, buf, "text/xml");
 	}
+	if (http_frontend_port_ > 0) {
+		webserver_register_buf(kDescriptionPath,
+				       upnp_create_device_desc(device_def),
+				       "text/xml");
+	}
 
 	if (!initialize_device(device_def, result_device, interface_name, port)) {
 		UpnpFinish();
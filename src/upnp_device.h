@@ -54,6 +54,41 @@ struct upnp_device *upnp_device_init(struct upnp_device_descriptor *device_def,
 
 void upnp_device_shutdown(struct upnp_device *device);
 
+// Also send LastChange events as UPnP 2.0 multicast NOTIFY, so listeners
+// don't need a subscription each. Call before upnp_device_init().
+void upnp_device_enable_multicast_events(void);
+
+// Limits on event subscribers; 0 keeps the libupnp default. At most
+// "max_subscriptions" are accepted; controllers that stop renewing are
+// dropped after "timeout_sec". Events queued for one subscriber are
+// limited to "queue_length" and "queue_age_sec", older ones are discarded,
+// so a slow controller can't hold up the others.
+// Evicting subscribers after consecutive failed deliveries needs the HTTP
+// front-end (upnp_device_set_http_frontend()); libupnp's own eventing
+// doesn't report them, so there only the timeout drops dead controllers.
+// Call before upnp_device_init().
+void upnp_device_set_subscription_limits(int max_subscriptions,
+					 int timeout_sec,
+					 int queue_length,
+					 int queue_age_sec);
+
+// Serve description, control and eventing from our own event driven
+// HTTP server on "port", with keep-alive, instead of the libupnp one;
+// libupnp only does discovery then. Needs libupnp >= 1.8.
+// Call before upnp_device_init().
+void upnp_device_set_http_frontend(int port);
+
+// With the HTTP front-end, also stream the service variables as JSON
+// server-sent events at /state-stream: a snapshot on connect, then one
+// event for each change. Call before upnp_device_init().
+void upnp_device_set_state_stream(int enable);
+
+// Limit fresh Get* answers of each controller to "per_second", with
+// bursts of as many; beyond that it gets the last response to the same
+// query, even if the state changed since. 0 disables the limit.
+// Call before upnp_device_init().
+void upnp_device_set_action_rate_limit(double per_second);
+
 int upnp_add_response(struct action_event *event,
 		      const char *key, const char *value);
 void upnp_set_error(struct action_event *event, int error_code,
@@ -69,6 +104,25 @@ const char *upnp_get_string(struct action_event *event, const char *key);
 void upnp_append_variable(struct action_event *event,
                           int varnum, const char *paramname);
 
+// Set the response to all output arguments of the action, as declared in
+// its argument list, with the current values of their state variables.
+// Reads all of them under one lock and builds the response at once;
+// use instead of appending variables one by one.
+void upnp_append_out_arguments(struct action_event *event);
+
+// Run action "action_name" of the service "service_id" with the given
+// arguments, through the same handlers and on the same loop as an action
+// from a controller, and wait for it. Arguments and results are handed
+// over as strings; no SOAP document is built or parsed. Returns 0 and the
+// values of the response arguments "out_names" as malloc()ed strings in
+// "out_values" (NULL if missing), or the UPnP error code.
+int upnp_device_call_action(struct upnp_device *device,
+			    const char *service_id, const char *action_name,
+			    const char **arg_names, const char **arg_values,
+			    int arg_count,
+			    const char **out_names, char **out_values,
+			    int out_count);
+
 int upnp_device_notify(struct upnp_device *device,
 		       const char *serviceID,
 		       const char **varnames,
@@ -0,0 +1,150 @@
+/* upnp_multicast_event.c - UPnP 2.0 multicast eventing
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "upnp_multicast_event.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <ithread.h>
+
+#include "logging.h"
+#include "upnp_service.h"
+
+// UDA 2.0, 4.3.3: fixed group and port, TTL like SSDP.
+#define EVENT_GROUP "239.255.255.246"
+#define EVENT_PORT 7900
+#define EVENT_TTL 2
+#define MAX_DATAGRAM 65507
+#define MAX_SERVICES 8
+
+static int socket_ = -1;
+static struct sockaddr_in group_addr_;
+static long boot_id_ = 0;
+
+// Each service has its own SEQ count, so that listeners can tell if
+// they missed an event.
+static ithread_mutex_t seq_mutex_;
+static struct {
+	const struct service *srv;
+	unsigned int seq;
+} sequences_[MAX_SERVICES];
+
+int upnp_multicast_event_init(const char *local_ip) {
+	socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+	if (socket_ < 0) {
+		Log_error("upnp", "Can't create multicast event socket");
+		return -1;
+	}
+	const unsigned char ttl = EVENT_TTL;
+	setsockopt(socket_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	struct in_addr interface;
+	if (local_ip != NULL && inet_pton(AF_INET, local_ip, &interface) == 1) {
+		setsockopt(socket_, IPPROTO_IP, IP_MULTICAST_IF,
+			   &interface, sizeof(interface));
+	}
+	memset(&group_addr_, 0, sizeof(group_addr_));
+	group_addr_.sin_family = AF_INET;
+	group_addr_.sin_port = htons(EVENT_PORT);
+	inet_pton(AF_INET, EVENT_GROUP, &group_addr_.sin_addr);
+	ithread_mutex_init(&seq_mutex_, NULL);
+	boot_id_ = (long) time(NULL);
+	Log_info("upnp", "Multicast eventing to %s:%d from %s",
+		 EVENT_GROUP, EVENT_PORT, local_ip ? local_ip : "default");
+	return 0;
+}
+
+// Returns the SEQ value of the next event of the service: 0 for the
+// first, then counting up; wraps to 1, as 0 means 'first since boot'.
+static unsigned int next_sequence(const struct service *srv) {
+	unsigned int result = 0;
+	ithread_mutex_lock(&seq_mutex_);
+	for (int i = 0; i < MAX_SERVICES; ++i) {
+		if (sequences_[i].srv == NULL) {
+			sequences_[i].srv = srv;
+		}
+		if (sequences_[i].srv == srv) {
+			result = sequences_[i].seq;
+			sequences_[i].seq = (result == G_MAXUINT) ? 1 : result + 1;
+			break;
+		}
+	}
+	ithread_mutex_unlock(&seq_mutex_);
+	return result;
+}
+
+int upnp_multicast_event_send(const char *udn, const struct service *srv,
+			      const char **varnames, const char **varvalues,
+			      int varcount) {
+	if (socket_ < 0)
+		return -1;
+	GString *body = g_string_new("<?xml version=\"1.0\"?>\r\n"
+				     "<e:propertyset xmlns:e=\"urn:schemas-"
+				     "upnp-org:event-1-0\">");
+	for (int i = 0; i < varcount; ++i) {
+		g_string_append_printf(body,
+				       "<e:property><%s>%s</%s></e:property>",
+				       varnames[i], varvalues[i], varnames[i]);
+	}
+	g_string_append(body, "</e:propertyset>");
+
+	GString *message = g_string_new(NULL);
+	g_string_printf(message,
+			"NOTIFY * HTTP/1.1\r\n"
+			"HOST: " EVENT_GROUP ":%d\r\n"
+			"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+			"USN: %s::%s\r\n"
+			"SVCID: %s\r\n"
+			"NT: upnp:event\r\n"
+			"NTS: upnp:propchange\r\n"
+			"SEQ: %u\r\n"
+			"LVL: upnp:/info\r\n"
+			"BOOTID.UPNP.ORG: %ld\r\n"
+			"CONTENT-LENGTH: %u\r\n"
+			"\r\n",
+			EVENT_PORT, udn, srv->service_type, srv->service_id,
+			next_sequence(srv), boot_id_, (unsigned) body->len);
+	g_string_append_len(message, body->str, body->len);
+	g_string_free(body, TRUE);
+
+	int result = 0;
+	if (message->len > MAX_DATAGRAM) {
+		Log_error("upnp", "Multicast event for %s too large (%u bytes)",
+			  srv->service_id, (unsigned) message->len);
+		result = -1;
+	} else if (sendto(socket_, message->str, message->len, 0,
+			  (struct sockaddr*) &group_addr_,
+			  sizeof(group_addr_)) < 0) {
+		Log_error("upnp", "Sending multicast event failed");
+		result = -1;
+	}
+	g_string_free(message, TRUE);
+	return result;
+}
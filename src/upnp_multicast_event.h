@@ -0,0 +1,39 @@
+/* upnp_multicast_event.h - UPnP 2.0 multicast eventing
+ *
+ * This file is part of GMediaRender.
+ *
+ * GMediaRender is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * GMediaRender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GMediaRender; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _UPNP_MULTICAST_EVENT_H
+#define _UPNP_MULTICAST_EVENT_H
+
+struct service;
+
+// Open the socket sending NOTIFY messages to the UPnP eventing group
+// 239.255.255.246:7900 from the interface with the given address.
+// Returns 0 on success.
+int upnp_multicast_event_init(const char *local_ip);
+
+// Send a propchange NOTIFY for the given variables of "srv" to everyone
+// listening on the group. The values are already XML escaped.
+// Returns 0 on success.
+int upnp_multicast_event_send(const char *udn, const struct service *srv,
+			      const char **varnames, const char **varvalues,
+			      int varcount);
+
+#endif /* _UPNP_MULTICAST_EVENT_H */
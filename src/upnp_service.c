@@ -117,7 +117,8 @@ static struct xmlelement *gen_scpd_actionlist(struct xmldoc *doc,
 }
 
 static struct xmlelement *gen_scpd_statevar(struct xmldoc *doc,
-					    const struct var_meta *meta) {
+					    const struct var_meta *meta,
+					    int multicast) {
 	struct xmlelement *top,*parent;
 	const char **valuelist;
 	struct param_range *range;
@@ -128,6 +129,10 @@ static struct xmlelement *gen_scpd_statevar(struct xmldoc *doc,
 	top=xmlelement_new(doc, "stateVariable");
 
 	xmlelement_set_attribute(doc, top, "sendEvents",(meta->sendevents==EV_YES)?"yes":"no");
+	if (multicast && meta->sendevents == EV_YES
+	    && strcmp(meta->name, "LastChange") == 0) {
+		xmlelement_set_attribute(doc, top, "multicast", "yes");
+	}
 	add_value_element(doc,top,"name", meta->name);
 	add_value_element(doc,top,"dataType", param_datatype_names[meta->datatype]);
 
@@ -189,7 +194,7 @@ static struct xmlelement *gen_scpd_servicestatetable(struct xmldoc *doc,
 					 srv->variable_container, &var_count);
 	for (i = 0; i < var_count; i++) {
 		const struct var_meta *meta = &(meta_array[i]);
-		child=gen_scpd_statevar(doc, meta);
+		child=gen_scpd_statevar(doc, meta, srv->multicast_events);
 		xmlelement_add_element(doc, top, child);
 	}
 	return top;
@@ -103,13 +103,19 @@ struct service {
 	struct variable_container *variable_container;
 	struct upnp_last_change_collector *last_change;
 	int command_count;
+	int multicast_events;  // LastChange is also sent to the UPnP 2.0 group.
 };
 
+struct local_action_call;
+
 struct action_event {
 	UpnpActionRequest *request;
 	int status;
 	struct service *service;
 	struct upnp_device *device;
+	// Set for actions called through upnp_device_call_action(); arguments
+	// and results are passed there as strings, "request" is NULL.
+	struct local_action_call *local;
 };
 
 struct action *find_action(struct service *event_service,
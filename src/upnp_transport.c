@@ -70,6 +70,7 @@ enum {
 	TRANSPORT_CMD_SETAVTRANSPORTURI,
 	TRANSPORT_CMD_STOP,
 	TRANSPORT_CMD_SETNEXTAVTRANSPORTURI,
+	TRANSPORT_CMD_X_SETAVTRANSPORTURIANDPLAY,
 
 	// Not implemented
 	//TRANSPORT_CMD_NEXT,
@@ -277,6 +278,18 @@ static struct argument arguments_setnextavtransporturi[] = {
         { NULL }
 };
 
+// Vendor extension: SetAVTransportURI, SetNextAVTransportURI (unless
+// NextURI is empty) and Play as one action.
+static struct argument arguments_x_setavtransporturiandplay[] = {
+        { "InstanceID", PARAM_DIR_IN, TRANSPORT_VAR_AAT_INSTANCE_ID },
+        { "CurrentURI", PARAM_DIR_IN, TRANSPORT_VAR_AV_URI },
+        { "CurrentURIMetaData", PARAM_DIR_IN, TRANSPORT_VAR_AV_URI_META },
+        { "NextURI", PARAM_DIR_IN, TRANSPORT_VAR_NEXT_AV_URI },
+        { "NextURIMetaData", PARAM_DIR_IN, TRANSPORT_VAR_NEXT_AV_URI_META },
+        { "Speed", PARAM_DIR_IN, TRANSPORT_VAR_TRANSPORT_PLAY_SPEED },
+        { NULL }
+};
+
 static struct argument arguments_getmediainfo[] = {
         { "InstanceID", PARAM_DIR_IN, TRANSPORT_VAR_AAT_INSTANCE_ID },
         { "NrTracks", PARAM_DIR_OUT, TRANSPORT_VAR_NR_TRACKS },
@@ -390,6 +403,7 @@ static struct argument *argument_list[] = {
 	[TRANSPORT_CMD_STOP] =                      arguments_stop,
 
 	[TRANSPORT_CMD_SETNEXTAVTRANSPORTURI] =     arguments_setnextavtransporturi,
+	[TRANSPORT_CMD_X_SETAVTRANSPORTURIANDPLAY] = arguments_x_setavtransporturiandplay,
 
 	//[TRANSPORT_CMD_RECORD] =                    arguments_record,
 	//[TRANSPORT_CMD_NEXT] =                      arguments_next,
@@ -439,25 +453,25 @@ static char has_instance_id(struct action_event *event)
 	return value != NULL;
 }
 
+// In a multiroom group, a follower plays what the leader sends; only the
+// leader's transport can be controlled.
+static int rejected_as_follower(struct action_event *event)
+{
+	if (!output_is_group_follower()) {
+		return 0;
+	}
+	upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA,
+		       "Playback follows the group leader; control it there");
+	return 1;
+}
+
 static int get_media_info(struct action_event *event)
 {
 	if (!has_instance_id(event)) {
 		return -1;
 	}
 
-	upnp_append_variable(event, TRANSPORT_VAR_NR_TRACKS, "NrTracks");
-	upnp_append_variable(event, TRANSPORT_VAR_CUR_MEDIA_DUR,
-			     "MediaDuration");
-	upnp_append_variable(event, TRANSPORT_VAR_AV_URI, "CurrentURI");
-	upnp_append_variable(event, TRANSPORT_VAR_AV_URI_META,
-			     "CurrentURIMetaData");
-	upnp_append_variable(event, TRANSPORT_VAR_NEXT_AV_URI, "NextURI");
-	upnp_append_variable(event, TRANSPORT_VAR_NEXT_AV_URI_META,
-			     "NextURIMetaData");
-	upnp_append_variable(event, TRANSPORT_VAR_REC_MEDIA, "PlayMedium");
-	upnp_append_variable(event, TRANSPORT_VAR_REC_MEDIUM, "RecordMedium");
-	upnp_append_variable(event, TRANSPORT_VAR_REC_MEDIUM_WR_STATUS,
-			     "WriteStatus");
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
@@ -522,6 +536,8 @@ static void change_transport_state(enum transport_state new_state) {
 		available_actions = "PLAY,STOP,SEEK";
 		break;
 	case TRANSPORT_TRANSITIONING:
+		available_actions = "STOP";
+		break;
 	case TRANSPORT_PAUSED_RECORDING:
 	case TRANSPORT_RECORDING:
 	case TRANSPORT_NO_MEDIA_PRESENT:
@@ -550,18 +566,12 @@ static void update_meta_from_stream(const struct SongMetaData *meta) {
 
 /* UPnP action handlers */
 
-static int set_avtransport_uri(struct action_event *event)
-{
-	if (!has_instance_id(event)) {
-		return -1;
-	}
-	const char *uri = upnp_get_string(event, "CurrentURI");
-	if (uri == NULL) {
-		return -1;
-	}
+// The steps of SetAVTransportURI, SetNextAVTransportURI and Play, with
+// the service lock held, so that X_SetAVTransportURIAndPlay can do them
+// all in one go.
 
-	service_lock();
-	const char *meta = upnp_get_string(event, "CurrentURIMetaData");
+static void set_uri_locked(const char *uri, const char *meta)
+{
 	// Transport URI/Meta set now, current URI/Meta when it starts playing.
 	int requires_meta_update = replace_transport_uri_and_meta(uri, meta);
 
@@ -574,9 +584,78 @@ static int set_avtransport_uri(struct action_event *event)
 		replace_current_uri_and_meta(uri, meta);
 	}
 
-	output_set_uri(uri, (requires_meta_update
-			     ? update_meta_from_stream
-			     : NULL));
+	output_set_uri(uri, meta, (requires_meta_update
+				   ? update_meta_from_stream
+				   : NULL));
+}
+
+static void set_next_uri_locked(const char *next_uri,
+				const char *next_uri_meta)
+{
+	output_set_next_uri(next_uri, next_uri_meta);
+	replace_var(TRANSPORT_VAR_NEXT_AV_URI, next_uri);
+	if (next_uri_meta != NULL) {
+		replace_var(TRANSPORT_VAR_NEXT_AV_URI_META, next_uri_meta);
+	}
+}
+
+static void inform_play_transition_from_output(enum PlayFeedback fb);
+
+static int play_locked(struct action_event *event)
+{
+	int rc = 0;
+	switch (transport_state_) {
+	case TRANSPORT_PLAYING:
+		// Nothing to change.
+		break;
+
+	case TRANSPORT_STOPPED:
+		// If we were stopped before, we start a new song now. So just
+		// set the time to zero now; otherwise we will see the old
+		// value of the previous song until it updates some fractions
+		// of a second later.
+		replace_var(TRANSPORT_VAR_REL_TIME_POS, kZeroTime);
+
+		/* >>> fall through */
+
+	case TRANSPORT_PAUSED_PLAYBACK:
+		if (output_play(&inform_play_transition_from_output)) {
+			upnp_set_error(event, 704, "Playing failed");
+			rc = -1;
+		} else {
+			change_transport_state(TRANSPORT_PLAYING);
+			const char *av_uri = get_var(TRANSPORT_VAR_AV_URI);
+			const char *av_meta = get_var(TRANSPORT_VAR_AV_URI_META);
+			replace_current_uri_and_meta(av_uri, av_meta);
+		}
+		break;
+
+	case TRANSPORT_NO_MEDIA_PRESENT:
+	case TRANSPORT_TRANSITIONING:
+	case TRANSPORT_PAUSED_RECORDING:
+	case TRANSPORT_RECORDING:
+		/* action not allowed in these states - error 701 */
+		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA,
+			       "Transition to PLAY not allowed; allowed=%s",
+			       get_var(TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
+		rc = -1;
+		break;
+	}
+	return rc;
+}
+
+static int set_avtransport_uri(struct action_event *event)
+{
+	if (!has_instance_id(event)) {
+		return -1;
+	}
+	const char *uri = upnp_get_string(event, "CurrentURI");
+	if (uri == NULL) {
+		return -1;
+	}
+
+	service_lock();
+	set_uri_locked(uri, upnp_get_string(event, "CurrentURIMetaData"));
 	service_unlock();
 
 	return 0;
@@ -593,19 +672,42 @@ static int set_next_avtransport_uri(struct action_event *event)
 		return -1;
 	}
 
-	int rc = 0;
 	service_lock();
+	const char *next_uri_meta = upnp_get_string(event, "NextURIMetaData");
+	set_next_uri_locked(next_uri, next_uri_meta);
+	service_unlock();
 
-	output_set_next_uri(next_uri);
-	replace_var(TRANSPORT_VAR_NEXT_AV_URI, next_uri);
+	return next_uri_meta != NULL ? 0 : -1;
+}
 
+// Start "CurrentURI" from the beginning, with "NextURI" queued for gapless
+// playback after it, in one transaction: controllers need one round trip
+// instead of three, and subscribers get a single LastChange.
+static int set_avtransport_uri_and_play(struct action_event *event)
+{
+	if (!has_instance_id(event) || rejected_as_follower(event)) {
+		return -1;
+	}
+	const char *uri = upnp_get_string(event, "CurrentURI");
+	const char *meta = upnp_get_string(event, "CurrentURIMetaData");
+	const char *next_uri = upnp_get_string(event, "NextURI");
 	const char *next_uri_meta = upnp_get_string(event, "NextURIMetaData");
-	if (next_uri_meta == NULL) {
-		rc = -1;
-	} else {
-		replace_var(TRANSPORT_VAR_NEXT_AV_URI_META, next_uri_meta);
+	if (uri == NULL || meta == NULL
+	    || next_uri == NULL || next_uri_meta == NULL) {
+		return -1;
 	}
 
+	service_lock();
+	if (transport_state_ != TRANSPORT_STOPPED) {
+		// Like Stop: the new uri starts over, not where we are.
+		output_stop();
+		change_transport_state(TRANSPORT_STOPPED);
+	}
+	set_uri_locked(uri, meta);
+	if (*next_uri) {
+		set_next_uri_locked(next_uri, next_uri_meta);
+	}
+	const int rc = play_locked(event);
 	service_unlock();
 
 	return rc;
@@ -617,12 +719,7 @@ static int get_transport_info(struct action_event *event)
 		return -1;
 	}
 
-	upnp_append_variable(event, TRANSPORT_VAR_TRANSPORT_STATE,
-			     "CurrentTransportState");
-	upnp_append_variable(event, TRANSPORT_VAR_TRANSPORT_STATUS,
-			     "CurrentTransportStatus");
-	upnp_append_variable(event, TRANSPORT_VAR_TRANSPORT_PLAY_SPEED,
-			     "CurrentSpeed");
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
@@ -632,8 +729,7 @@ static int get_current_transportactions(struct action_event *event)
 		return -1;
 	}
 
-	upnp_append_variable(event, TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS,
-			     "Actions");
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
@@ -642,7 +738,7 @@ static int get_transport_settings(struct action_event *event)
 	if (!has_instance_id(event)) {
 		return -1;
 	}
-	// TODO: what variables to add ?
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
@@ -671,31 +767,29 @@ static gint64 parse_upnp_time(const char *time_string) {
 }
 
 // We constantly update the track time to event about it to our clients.
-static void *thread_update_track_time(void *userdata) {
+// Runs on the main loop every 500ms.
+static gboolean update_track_time(gpointer userdata) {
 	(void)userdata;
+	static gint64 last_duration = -1, last_position = -1;
 	const gint64 one_sec_unit = 1000000000LL;
 	char tbuf[32];
-	gint64 last_duration = -1, last_position = -1;
-	for (;;) {
-		usleep(500000);  // 500ms
-		service_lock();
-		gint64 duration, position;
-		const int pos_result = output_get_position(&duration, &position);
-		if (pos_result == 0) {
-			if (duration != last_duration) {
-				print_upnp_time(tbuf, sizeof(tbuf), duration);
-				replace_var(TRANSPORT_VAR_CUR_TRACK_DUR, tbuf);
-				last_duration = duration;
-			}
-			if (position / one_sec_unit != last_position) {
-				print_upnp_time(tbuf, sizeof(tbuf), position);
-				replace_var(TRANSPORT_VAR_REL_TIME_POS, tbuf);
-				last_position = position / one_sec_unit;
-			}
+	service_lock();
+	gint64 duration, position;
+	const int pos_result = output_get_position(&duration, &position);
+	if (pos_result == 0) {
+		if (duration != last_duration) {
+			print_upnp_time(tbuf, sizeof(tbuf), duration);
+			replace_var(TRANSPORT_VAR_CUR_TRACK_DUR, tbuf);
+			last_duration = duration;
+		}
+		if (position / one_sec_unit != last_position) {
+			print_upnp_time(tbuf, sizeof(tbuf), position);
+			replace_var(TRANSPORT_VAR_REL_TIME_POS, tbuf);
+			last_position = position / one_sec_unit;
 		}
-		service_unlock();
 	}
-	return NULL;  // not reached.
+	service_unlock();
+	return TRUE;
 }
 
 static int get_position_info(struct action_event *event)
@@ -704,17 +798,7 @@ static int get_position_info(struct action_event *event)
 		return -1;
 	}
 
-	upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK, "Track");
-	upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK_DUR,
-			     "TrackDuration");
-	upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK_META,
-			     "TrackMetaData");
-	upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK_URI, "TrackURI");
-	upnp_append_variable(event, TRANSPORT_VAR_REL_TIME_POS, "RelTime");
-	upnp_append_variable(event, TRANSPORT_VAR_ABS_TIME_POS, "AbsTime");
-	upnp_append_variable(event, TRANSPORT_VAR_REL_CTR_POS, "RelCount");
-	upnp_append_variable(event, TRANSPORT_VAR_ABS_CTR_POS, "AbsCount");
-
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
@@ -723,13 +807,13 @@ static int get_device_caps(struct action_event *event)
 	if (!has_instance_id(event)) {
 		return -1;
 	}
-	// TODO: implement ?
+	upnp_append_out_arguments(event);
 	return 0;
 }
 
 static int stop(struct action_event *event)
 {
-	if (!has_instance_id(event)) {
+	if (!has_instance_id(event) || rejected_as_follower(event)) {
 		return -1;
 	}
 
@@ -778,55 +862,30 @@ static void inform_play_transition_from_output(enum PlayFeedback fb) {
 		replace_var(TRANSPORT_VAR_NEXT_AV_URI_META, "");
 		break;
 	}
+
+	case PLAY_RECOVERING:
+		if (transport_state_ == TRANSPORT_PLAYING) {
+			change_transport_state(TRANSPORT_TRANSITIONING);
+		}
+		break;
+
+	case PLAY_RECOVERED:
+		if (transport_state_ == TRANSPORT_TRANSITIONING) {
+			change_transport_state(TRANSPORT_PLAYING);
+		}
+		break;
 	}
 	service_unlock();
 }
 
 static int play(struct action_event *event)
 {
-	if (!has_instance_id(event)) {
+	if (!has_instance_id(event) || rejected_as_follower(event)) {
 		return -1;
 	}
 
-	int rc = 0;
 	service_lock();
-	switch (transport_state_) {
-	case TRANSPORT_PLAYING:
-		// Nothing to change.
-		break;
-
-	case TRANSPORT_STOPPED:
-		// If we were stopped before, we start a new song now. So just
-		// set the time to zero now; otherwise we will see the old
-		// value of the previous song until it updates some fractions
-		// of a second later.
-		replace_var(TRANSPORT_VAR_REL_TIME_POS, kZeroTime);
-
-		/* >>> fall through */
-
-	case TRANSPORT_PAUSED_PLAYBACK:
-		if (output_play(&inform_play_transition_from_output)) {
-			upnp_set_error(event, 704, "Playing failed");
-			rc = -1;
-		} else {
-			change_transport_state(TRANSPORT_PLAYING);
-			const char *av_uri = get_var(TRANSPORT_VAR_AV_URI);
-			const char *av_meta = get_var(TRANSPORT_VAR_AV_URI_META);
-			replace_current_uri_and_meta(av_uri, av_meta);
-		}
-		break;
-
-	case TRANSPORT_NO_MEDIA_PRESENT:
-	case TRANSPORT_TRANSITIONING:
-	case TRANSPORT_PAUSED_RECORDING:
-	case TRANSPORT_RECORDING:
-		/* action not allowed in these states - error 701 */
-		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA,
-			       "Transition to PLAY not allowed; allowed=%s",
-			       get_var(TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS));
-		rc = -1;
-		break;
-	}
+	const int rc = play_locked(event);
 	service_unlock();
 
 	return rc;
@@ -834,7 +893,7 @@ static int play(struct action_event *event)
 
 static int pause_stream(struct action_event *event)
 {
-	if (!has_instance_id(event)) {
+	if (!has_instance_id(event) || rejected_as_follower(event)) {
 		return -1;
 	}
 
@@ -868,7 +927,7 @@ static int pause_stream(struct action_event *event)
 
 static int seek(struct action_event *event)
 {
-	if (!has_instance_id(event)) {
+	if (!has_instance_id(event) || rejected_as_follower(event)) {
 		return -1;
 	}
 
@@ -904,6 +963,7 @@ static struct action transport_actions[] = {
 	[TRANSPORT_CMD_SETAVTRANSPORTURI] =         {"SetAVTransportURI", set_avtransport_uri},	/* RC9800i */
 	[TRANSPORT_CMD_STOP] =                      {"Stop", stop},
 	[TRANSPORT_CMD_SETNEXTAVTRANSPORTURI] =     {"SetNextAVTransportURI", set_next_avtransport_uri},
+	[TRANSPORT_CMD_X_SETAVTRANSPORTURIANDPLAY] = {"X_SetAVTransportURIAndPlay", set_avtransport_uri_and_play},
 
 	//[TRANSPORT_CMD_RECORD] =                    {"Record", NULL},	/* optional */
 	//[TRANSPORT_CMD_NEXT] =                      {"Next", next},
@@ -1021,11 +1081,15 @@ void upnp_transport_init(struct upnp_device *device) {
 	UPnPLastChangeCollector_add_ignore(service->last_change,
 					   TRANSPORT_VAR_ABS_CTR_POS);
 
-	pthread_t thread;
-	pthread_create(&thread, NULL, thread_update_track_time, NULL);
+	g_timeout_add(500, update_track_time, NULL);
 }
 
 void upnp_transport_register_variable_listener(variable_change_listener_t cb,
 					       void *userdata) {
 	VariableContainer_register_callback(state_variables_, cb, userdata);
 }
+
+void upnp_transport_register_async_variable_listener(
+	variable_async_listener_t cb, void *userdata) {
+	VariableContainer_register_async_callback(state_variables_, cb, userdata);
+}
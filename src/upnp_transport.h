@@ -37,4 +37,9 @@ void upnp_transport_init(struct upnp_device *);
 void upnp_transport_register_variable_listener(variable_change_listener_t cb,
 						       void *userdata);
 
+// Like upnp_transport_register_variable_listener(), but the callback runs in a
+// thread of its own and may take its time.
+void upnp_transport_register_async_variable_listener(
+	variable_async_listener_t cb, void *userdata);
+
 #endif /* _UPNP_TRANSPORT_H */
@@ -36,11 +36,16 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <glib.h>
 
 #include "upnp_device.h"
 #include "upnp_service.h"
 #include "xmlescape.h"
 #include "xmldoc.h"
+#include "mpsc_queue.h"
+#include "logging.h"
 
 // -- VariableContainer
 struct cb_list {
@@ -49,11 +54,40 @@ struct cb_list {
 	struct cb_list *next;
 };
 
+// A change as seen by an asynchronous listener. The values are copies, as
+// the container frees its own once the next change comes in.
+struct change_record {
+	struct mpsc_node node;  // first, so the node is the record.
+	int version;
+	int var_num;
+	const char *var_name;
+	char *old_value;
+	char *new_value;
+};
+
+// Listener called from a thread of its own. VariableContainer_change()
+// only queues a record; "pending" tells the thread when there is work, it
+// sleeps on "cond" while there is none.
+struct async_listener {
+	variable_async_listener_t callback;
+	void *userdata;
+	int synchronous;  // No thread could be started; called right away.
+	struct mpsc_queue queue;
+	gint pending;
+	gint running;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct async_listener *next;
+};
+
 struct variable_container {
 	int variable_num;
 	const struct var_meta *vars;
 	char **values;
 	struct cb_list *callbacks;
+	struct async_listener *async_listeners;
+	volatile gint version;
 };
 
 static int cmp_meta_id(const void *a, const void *b) {
@@ -87,6 +121,8 @@ variable_container_t *VariableContainer_new(int variable_num,
 	result->vars = create_sorted_meta(variable_num, unordered_vars);
 	result->values = (char **) malloc(variable_num * sizeof(char*));
 	result->callbacks = NULL;
+	result->async_listeners = NULL;
+	result->version = 0;
 	for (int i = 0; i < variable_num; ++i) {
 		assert(result->vars[i].name != NULL);
 		assert(result->vars[i].id == i);
@@ -96,7 +132,40 @@ variable_container_t *VariableContainer_new(int variable_num,
 	return result;
 }
 
+static void free_change_record(struct change_record *record) {
+	free(record->old_value);
+	free(record->new_value);
+	free(record);
+}
+
+static void wake_async_listener(struct async_listener *listener) {
+	pthread_mutex_lock(&listener->mutex);
+	pthread_cond_signal(&listener->cond);
+	pthread_mutex_unlock(&listener->mutex);
+}
+
+static void delete_async_listener(struct async_listener *listener) {
+	if (!listener->synchronous) {
+		g_atomic_int_set(&listener->running, 0);
+		wake_async_listener(listener);
+		pthread_join(listener->thread, NULL);
+	}
+	struct mpsc_node *node;
+	while ((node = mpsc_queue_pop(&listener->queue)) != NULL) {
+		free_change_record((struct change_record*) node);
+	}
+	pthread_mutex_destroy(&listener->mutex);
+	pthread_cond_destroy(&listener->cond);
+	free(listener);
+}
+
 void VariableContainer_delete(variable_container_t *object) {
+	for (struct async_listener *it = object->async_listeners; it; /**/) {
+		struct async_listener *next = it->next;
+		delete_async_listener(it);
+		it = next;
+	}
+
 	for (int i = 0; i < object->variable_num; ++i) {
 		free(object->values[i]);
 	}
@@ -141,15 +210,41 @@ int VariableContainer_change(variable_container_t *object,
 	char *old_value = object->values[var_num];
 	char *new_value = strdup(value);
 	object->values[var_num] = new_value;
+	const int version = g_atomic_int_add(&object->version, 1) + 1;
 	for (struct cb_list *it = object->callbacks; it; it = it->next) {
 		it->callback(it->userdata,
 			     var_num, object->vars[var_num].name,
 			     old_value, new_value);
 	}
+	for (struct async_listener *it = object->async_listeners;
+	     it; it = it->next) {
+		if (it->synchronous) {
+			it->callback(it->userdata, version, var_num,
+				     object->vars[var_num].name,
+				     old_value, new_value);
+			continue;
+		}
+		struct change_record *record = (struct change_record*)
+			malloc(sizeof(struct change_record));
+		record->version = version;
+		record->var_num = var_num;
+		record->var_name = object->vars[var_num].name;
+		record->old_value = strdup(old_value);
+		record->new_value = strdup(new_value);
+		mpsc_queue_push(&it->queue, &record->node);
+		// Only a sleeping listener needs the lock and a signal.
+		if (g_atomic_int_add(&it->pending, 1) == 0) {
+			wake_async_listener(it);
+		}
+	}
 	free(old_value);
 	return 1;
 }
 
+int VariableContainer_get_version(variable_container_t *object) {
+	return g_atomic_int_get(&object->version);
+}
+
 void VariableContainer_register_callback(variable_container_t *object,
 					 variable_change_listener_t callback,
 					 void *userdata) {
@@ -161,6 +256,57 @@ void VariableContainer_register_callback(variable_container_t *object,
 	object->callbacks = item;
 }
 
+static void *run_async_listener(void *userdata) {
+	struct async_listener *listener = (struct async_listener*) userdata;
+	while (g_atomic_int_get(&listener->running)) {
+		struct mpsc_node *node = mpsc_queue_pop(&listener->queue);
+		if (node != NULL) {
+			struct change_record *record
+				= (struct change_record*) node;
+			listener->callback(listener->userdata, record->version,
+					   record->var_num, record->var_name,
+					   record->old_value, record->new_value);
+			free_change_record(record);
+			g_atomic_int_add(&listener->pending, -1);
+			continue;
+		}
+		pthread_mutex_lock(&listener->mutex);
+		if (g_atomic_int_get(&listener->pending) == 0
+		    && g_atomic_int_get(&listener->running)) {
+			pthread_cond_wait(&listener->cond, &listener->mutex);
+		}
+		pthread_mutex_unlock(&listener->mutex);
+		if (g_atomic_int_get(&listener->pending) > 0) {
+			// A producer is about to link its record.
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+void VariableContainer_register_async_callback(variable_container_t *object,
+					       variable_async_listener_t callback,
+					       void *userdata) {
+	struct async_listener *listener = (struct async_listener*)
+		malloc(sizeof(struct async_listener));
+	listener->callback = callback;
+	listener->userdata = userdata;
+	listener->synchronous = 0;
+	mpsc_queue_init(&listener->queue);
+	listener->pending = 0;
+	listener->running = 1;
+	pthread_mutex_init(&listener->mutex, NULL);
+	pthread_cond_init(&listener->cond, NULL);
+	if (pthread_create(&listener->thread, NULL,
+			   run_async_listener, listener) != 0) {
+		Log_error("variable", "Can't start listener thread; "
+			  "calling it synchronously.");
+		listener->synchronous = 1;
+	}
+	listener->next = object->async_listeners;
+	object->async_listeners = listener;
+}
+
 // -- UPnPLastChangeBuilder
 struct upnp_last_change_builder {
 	const char *xml_namespace;
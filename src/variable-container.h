@@ -80,6 +80,10 @@ const char *VariableContainer_get(variable_container_t *object, int var,
 int VariableContainer_change(variable_container_t *object,
 			     int variable_num, const char *value);
 
+// Returns a counter that goes up with every change of a variable. Can be
+// read without holding the lock that protects changes.
+int VariableContainer_get_version(variable_container_t *object);
+
 // Callback handling. Whenever a variable changes, the callback is called.
 // Be careful when changing variables in the original container as this will
 // trigger recursive calls to the container.
@@ -91,6 +95,20 @@ void VariableContainer_register_callback(variable_container_t *object,
 					 variable_change_listener_t callback,
 					 void *userdata);
 
+// Like VariableContainer_register_callback(), but the callback is called
+// later in a thread of its own, one change after the other, with copies of
+// the values. VariableContainer_change() doesn't wait for it, so slow
+// listeners (logging, ...) don't hold up whoever is changing variables.
+// "version" is the VariableContainer_get_version() right after the change;
+// a change arriving late is older than a state read at a higher version.
+typedef void (*variable_async_listener_t)(void *userdata, int version,
+					  int var_num, const char *var_name,
+					  const char *old_value,
+					  const char *new_value);
+void VariableContainer_register_async_callback(variable_container_t *object,
+					       variable_async_listener_t callback,
+					       void *userdata);
+
 // -- UPnP LastChange Builder - builds a LastChange XML document from
 // added name/value pairs.
 struct upnp_last_change_builder;
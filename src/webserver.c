@@ -143,6 +143,28 @@ int webserver_register_file(const char *path, const char *content_type)
 	return 0;
 }
 
+int webserver_get_file(const char *path, char **contents, size_t *len,
+		       const char **content_type)
+{
+	for (struct virtual_file *vf = virtual_files; vf; vf = vf->next) {
+		if (strcmp(path, vf->virtual_fname) == 0) {
+			*contents = (char*)malloc(vf->len + 1);
+			if (*contents == NULL) {
+				return -1;
+			}
+			if (vf->len) {
+				memcpy(*contents, vf->contents, vf->len);
+			}
+			*len = vf->len;
+			*content_type = vf->content_type;
+			return 0;
+		}
+	}
+	Log_info("webserver", "404 Not found. (attempt to access "
+		 "non-existent '%s')", path);
+	return -1;
+}
+
 static VD_GET_INFO_CALLBACK(webserver_get_info, filename, info, cookie)
 {
 	struct virtual_file *virtfile = virtual_files;
@@ -34,4 +34,9 @@ int webserver_register_buf(const char *path, const char *contents,
 int webserver_register_file(const char *path,
                             const char *content_type);
 
+// Copy of the registered file "path" in a newly malloc()ed "contents"
+// for servers other than the libupnp one. Returns 0 if found.
+int webserver_get_file(const char *path, char **contents, size_t *len,
+                       const char **content_type);
+
 #endif /* _WEBSERVER_H */
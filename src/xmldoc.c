@@ -134,6 +134,11 @@ char *get_node_value(struct xmlelement *element) {
 	return strdup(node_value != NULL ? node_value : "");
 }
 
+char *xmlelement_get_attribute(struct xmlelement *element, const char *name) {
+	const char *value = ixmlElement_getAttribute(to_ielem(element), name);
+	return value != NULL ? strdup(value) : NULL;
+}
+
 void xmlelement_add_element(struct xmldoc *doc,
 			    struct xmlelement *parent,
 			    struct xmlelement *child)
@@ -64,6 +64,10 @@ struct xmlelement *find_element_in_element(struct xmlelement *element,
 // Returns a newly allocated string representing the element value.
 char *get_node_value(struct xmlelement *element);
 
+// Returns a newly allocated string with the value of the attribute or NULL
+// if the element does not have such attribute.
+char *xmlelement_get_attribute(struct xmlelement *element, const char *name);
+
 struct xmlelement *add_attributevalue_element(struct xmldoc *doc,
 					      struct xmlelement *parent,
 					      const char *tagname,